@@ -0,0 +1,629 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+
+#include "k5_priv.h"
+
+/*
+ * AP-REQ verification with krb5_rd_req() against the context's keytab.
+ * Tokens come raw, wrapped in a GSS krb5 initial context token (RFC 1964
+ * section 1.1), or inside a SPNEGO NegTokenInit (RFC 4178). The AP-REP is
+ * wrapped the same way as the request. There's no GSS security context
+ * afterwards: this only authenticates the client.
+ */
+
+/* 1.2.840.113554.1.2.2 */
+static const unsigned char krb5_oid[] = {
+  0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x12, 0x01, 0x02, 0x02
+};
+/* 1.2.840.48018.1.2.2, used by Windows */
+static const unsigned char krb5_ms_oid[] = {
+  0x06, 0x09, 0x2a, 0x86, 0x48, 0x82, 0xf7, 0x12, 0x01, 0x02, 0x02
+};
+/* 1.3.6.1.5.5.2 */
+static const unsigned char spnego_oid[] = {
+  0x06, 0x06, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x02
+};
+
+#define TOK_AP_REQ "\x01\x00"
+#define TOK_AP_REP "\x02\x00"
+
+enum framing {
+  FRAMING_RAW,
+  FRAMING_GSS,
+  FRAMING_SPNEGO
+};
+
+struct der {
+  const unsigned char *p;
+  size_t left;
+};
+
+/* Read one element with the given tag, content goes to inner */
+static int
+der_get(struct der *d, unsigned int tag, struct der *inner)
+{
+  size_t len = 0;
+  unsigned int n;
+
+  if (d->left < 2 || d->p[0] != tag)
+    return -1;
+  n = d->p[1];
+  d->p += 2;
+  d->left -= 2;
+
+  if (n & 0x80) {
+    n &= 0x7f;
+    if (!n || n > 4 || d->left < n)
+      return -1;
+    while (n--) {
+      len = (len << 8) | *d->p++;
+      d->left--;
+    }
+  } else {
+    len = n;
+  }
+  if (len > d->left)
+    return -1;
+
+  inner->p = d->p;
+  inner->left = len;
+  d->p += len;
+  d->left -= len;
+  return 0;
+}
+
+static int
+der_oid_is(struct der *d, const unsigned char *oid, size_t len)
+{
+  if (d->left < len || memcmp(d->p, oid, len))
+    return 0;
+  d->p += len;
+  d->left -= len;
+  return 1;
+}
+
+static size_t
+der_header_size(size_t len)
+{
+  if (len < 0x80)
+    return 2;
+  if (len < 0x100)
+    return 3;
+  if (len < 0x10000)
+    return 4;
+  return 5;
+}
+
+static unsigned char *
+der_put_header(unsigned char *p, unsigned int tag, size_t len)
+{
+  *p++ = tag;
+  if (len < 0x80) {
+    *p++ = len;
+  } else if (len < 0x100) {
+    *p++ = 0x81;
+    *p++ = len;
+  } else if (len < 0x10000) {
+    *p++ = 0x82;
+    *p++ = len >> 8;
+    *p++ = len;
+  } else {
+    *p++ = 0x83;
+    *p++ = len >> 16;
+    *p++ = len >> 8;
+    *p++ = len;
+  }
+  return p;
+}
+
+/* Find the AP-REQ in a krb5 GSS token: OID, TOK_ID, AP-REQ */
+static int
+unwrap_gss(struct der *d, struct der *ap_req)
+{
+  struct der inner;
+
+  if (der_get(d, 0x60, &inner))
+    return -1;
+  if (!der_oid_is(&inner, krb5_oid, sizeof (krb5_oid)) &&
+      !der_oid_is(&inner, krb5_ms_oid, sizeof (krb5_ms_oid)))
+    return -1;
+  if (inner.left < 2 || memcmp(inner.p, TOK_AP_REQ, 2))
+    return -1;
+  ap_req->p = inner.p + 2;
+  ap_req->left = inner.left - 2;
+  return 0;
+}
+
+/*
+ * NegTokenInit ::= [0] SEQUENCE { mechTypes [0], reqFlags [1] OPTIONAL,
+ * mechToken [2] OPTIONAL, mechListMIC [3] OPTIONAL }. The mech token is
+ * for the first mech type, which is echoed in the reply.
+ */
+static int
+unwrap_spnego(struct der *d, struct der *ap_req, struct der *mech)
+{
+  struct der init, seq, field, types, token;
+
+  if (der_get(d, 0xa0, &init) || der_get(&init, 0x30, &seq))
+    return -1;
+
+  if (der_get(&seq, 0xa0, &field) || der_get(&field, 0x30, &types))
+    return -1;
+  mech->p = types.p;
+  if (der_get(&types, 0x06, &field))
+    return -1;
+  mech->left = field.p + field.left - mech->p;
+  if (!(mech->left == sizeof (krb5_oid) &&
+	!memcmp(mech->p, krb5_oid, sizeof (krb5_oid))) &&
+      !(mech->left == sizeof (krb5_ms_oid) &&
+	!memcmp(mech->p, krb5_ms_oid, sizeof (krb5_ms_oid))))
+    return -1;
+
+  if (seq.left && seq.p[0] == 0xa1 && der_get(&seq, 0xa1, &field))
+    return -1;
+  if (der_get(&seq, 0xa2, &field) || der_get(&field, 0x04, &token))
+    return -1;
+  return unwrap_gss(&token, ap_req);
+}
+
+/*
+ * GSS: [APPLICATION 0] { OID, TOK_ID, AP-REP }
+ * SPNEGO: NegTokenResp ::= [1] SEQUENCE { negState [0] ENUMERATED,
+ * supportedMech [1] OID, responseToken [2] OCTET STRING OPTIONAL }
+ */
+static krb5_error_code
+wrap_reply(enum framing framing, krb5_data *ap_rep, struct der *mech,
+	   k5_accepted *out)
+{
+  size_t gss_len = 0, gss_size = 0, resp_len, seq_len;
+  unsigned char *p;
+
+  if (ap_rep->length) {
+    gss_len = sizeof (krb5_oid) + 2 + ap_rep->length;
+    gss_size = der_header_size(gss_len) + gss_len;
+  }
+
+  if (framing == FRAMING_RAW) {
+    out->token_size = ap_rep->length;
+  } else if (framing == FRAMING_GSS) {
+    out->token_size = gss_size;
+  } else {
+    seq_len = 5 + der_header_size(mech->left) + mech->left;
+    if (gss_size)
+      seq_len += der_header_size(der_header_size(gss_size) + gss_size) +
+	der_header_size(gss_size) + gss_size;
+    resp_len = der_header_size(seq_len) + seq_len;
+    out->token_size = der_header_size(resp_len) + resp_len;
+  }
+
+  if (!out->token_size)
+    return 0;
+  out->token = malloc(out->token_size);
+  if (!out->token)
+    return ENOMEM;
+  p = (unsigned char *)out->token;
+
+  if (framing == FRAMING_RAW) {
+    memcpy(p, ap_rep->data, ap_rep->length);
+    return 0;
+  }
+
+  if (framing == FRAMING_SPNEGO) {
+    p = der_put_header(p, 0xa1, resp_len);
+    p = der_put_header(p, 0x30, seq_len);
+    /* negState accept-completed */
+    memcpy(p, "\xa0\x03\x0a\x01\x00", 5);
+    p += 5;
+    p = der_put_header(p, 0xa1, mech->left);
+    memcpy(p, mech->p, mech->left);
+    p += mech->left;
+    if (!gss_size)
+      return 0;
+    p = der_put_header(p, 0xa2, der_header_size(gss_size) + gss_size);
+    p = der_put_header(p, 0x04, gss_size);
+  }
+
+  p = der_put_header(p, 0x60, gss_len);
+  memcpy(p, krb5_oid, sizeof (krb5_oid));
+  p += sizeof (krb5_oid);
+  memcpy(p, TOK_AP_REP, 2);
+  p += 2;
+  memcpy(p, ap_rep->data, ap_rep->length);
+  return 0;
+}
+
+/*
+ * The replay cache is keyed on the authenticator's ciphertext:
+ * AP-REQ ::= [APPLICATION 14] SEQUENCE { pvno [0], msg-type [1],
+ * ap-options [2], ticket [3], authenticator [4] EncryptedData }
+ * EncryptedData ::= SEQUENCE { etype [0], kvno [1] OPTIONAL, cipher [2] }
+ */
+static int
+authenticator_cipher(struct der *ap_req, struct der *cipher)
+{
+  struct der d = *ap_req, app, seq, field, enc;
+
+  if (der_get(&d, 0x6e, &app) || der_get(&app, 0x30, &seq) ||
+      der_get(&seq, 0xa0, &field) || der_get(&seq, 0xa1, &field) ||
+      der_get(&seq, 0xa2, &field) || der_get(&seq, 0xa3, &field) ||
+      der_get(&seq, 0xa4, &field) || der_get(&field, 0x30, &enc) ||
+      der_get(&enc, 0xa0, &field))
+    return -1;
+  if (enc.left && enc.p[0] == 0xa1 && der_get(&enc, 0xa1, &field))
+    return -1;
+  if (der_get(&enc, 0xa2, &field) || der_get(&field, 0x04, cipher))
+    return -1;
+  return 0;
+}
+
+/* Small INTEGER, for etype and kvno */
+static int
+der_int(struct der *d, krb5_int32 *v)
+{
+  struct der i;
+  krb5_ui_4 u;
+
+  if (der_get(d, 0x02, &i) || !i.left || i.left > 4)
+    return -1;
+  /* Sign-extended in an unsigned value: shifting a negative one is UB */
+  u = (i.p[0] & 0x80) ? 0xffffffff : 0;
+  while (i.left--)
+    u = (u << 8) | *i.p++;
+  *v = (krb5_int32)u;
+  return 0;
+}
+
+/*
+ * The ticket, as far as it's in clear: Ticket ::= [APPLICATION 1]
+ * SEQUENCE { tkt-vno [0], realm [1] Realm, sname [2] PrincipalName,
+ * enc-part [3] EncryptedData }, PrincipalName ::= SEQUENCE {
+ * name-type [0], name-string [1] SEQUENCE OF GeneralString }
+ */
+struct ticket_info {
+  struct der realm;
+  struct der names;
+  krb5_int32 enctype;
+  krb5_int32 kvno;
+  struct der cipher;
+};
+
+static int
+ticket_info(struct der *ap_req, struct ticket_info *t)
+{
+  struct der d = *ap_req, app, seq, field, tkt, sname, enc;
+
+  if (der_get(&d, 0x6e, &app) || der_get(&app, 0x30, &seq) ||
+      der_get(&seq, 0xa0, &field) || der_get(&seq, 0xa1, &field) ||
+      der_get(&seq, 0xa2, &field) || der_get(&seq, 0xa3, &field) ||
+      der_get(&field, 0x61, &app) || der_get(&app, 0x30, &tkt) ||
+      der_get(&tkt, 0xa0, &field) || der_get(&tkt, 0xa1, &field) ||
+      der_get(&field, 0x1b, &t->realm) || der_get(&tkt, 0xa2, &field) ||
+      der_get(&field, 0x30, &sname) || der_get(&sname, 0xa0, &field) ||
+      der_get(&sname, 0xa1, &field) || der_get(&field, 0x30, &t->names) ||
+      der_get(&tkt, 0xa3, &field) || der_get(&field, 0x30, &enc) ||
+      der_get(&enc, 0xa0, &field) || der_int(&field, &t->enctype))
+    return -1;
+  t->kvno = 0;
+  if (enc.left && enc.p[0] == 0xa1 &&
+      (der_get(&enc, 0xa1, &field) || der_int(&field, &t->kvno)))
+    return -1;
+  if (der_get(&enc, 0xa2, &field) || der_get(&field, 0x04, &t->cipher))
+    return -1;
+  return 0;
+}
+
+/*
+ * Find the ticket's key in the keytab index, which has principals in
+ * their keytab encoding: realm then components, 16 bits length first.
+ */
+static krb5_error_code
+index_key(struct k5_kt_snapshot *snapshot, struct ticket_info *t,
+	  krb5_keyblock **key)
+{
+  unsigned char name[1024], *p = name;
+  struct der names = t->names, s = t->realm;
+
+  do {
+    if (s.left > sizeof (name) - 2 - (p - name))
+      return KRB5_KT_NOTFOUND;
+    *p++ = s.left >> 8;
+    *p++ = s.left;
+    memcpy(p, s.p, s.left);
+    p += s.left;
+  } while (names.left && !der_get(&names, 0x1b, &s));
+  if (names.left)
+    return KRB5KRB_AP_ERR_MSG_TYPE;
+
+  return k5_keytab_index_find(snapshot, name, p - name, t->kvno, t->enctype,
+			      key);
+}
+
+/*
+ * krb5's replay cache, for contexts without one of ours. krb5_rd_req()
+ * only opens it when given a server principal, and we don't give one,
+ * so it is attached to the auth context here. Older krb5 name the file
+ * after the first component of the server's name.
+ */
+static krb5_error_code
+default_rcache(k5_context k5, krb5_auth_context auth_context,
+	       struct ticket_info *t)
+{
+  struct der names, s;
+  krb5_data piece;
+  krb5_rcache rc;
+  krb5_error_code code;
+
+  piece.magic = KV5M_DATA;
+  piece.data = "host";
+  piece.length = 4;
+  if (t) {
+    names = t->names;
+    if (!der_get(&names, 0x1b, &s) && s.left) {
+      piece.data = (char *)s.p;
+      piece.length = s.left;
+    }
+  }
+
+  if ((code = krb5_get_server_rcache(k5->ctx, &piece, &rc)))
+    return code;
+  if ((code = krb5_auth_con_setrcache(k5->ctx, auth_context, rc)))
+    krb5_rc_close(k5->ctx, rc);
+  return code;
+}
+
+/* Check the authenticator against the context's replay cache */
+static krb5_error_code
+check_replay(k5_context k5, krb5_auth_context auth_context,
+	     struct der *ap_req)
+{
+  krb5_authenticator *authenticator;
+  krb5_error_code code;
+  struct der cipher;
+  time_t ctime;
+
+  if (authenticator_cipher(ap_req, &cipher))
+    return KRB5KRB_AP_ERR_MSG_TYPE;
+  if ((code = krb5_auth_con_getauthenticator(k5->ctx, auth_context,
+					     &authenticator)))
+    return code;
+  ctime = authenticator->ctime;
+  krb5_free_authenticator(k5->ctx, authenticator);
+  return k5_rcache_check(k5, cipher.p, cipher.left, ctime);
+}
+
+/* Fill a k5_ticket from the decrypted ticket, like k5_parse_ticket() */
+static krb5_error_code
+accepted_ticket(k5_context k5, krb5_ticket *ticket, k5_ticket *t)
+{
+  krb5_creds creds, *ccreds;
+  krb5_error_code code;
+
+  memset(&creds, 0, sizeof (creds));
+  creds.client = ticket->enc_part2->client;
+  creds.server = ticket->server;
+  creds.keyblock = *ticket->enc_part2->session;
+  creds.times = ticket->enc_part2->times;
+  creds.ticket_flags = ticket->enc_part2->flags;
+
+  if ((code = krb5_copy_creds(k5->ctx, &creds, &ccreds)))
+    return code;
+  if ((code = k5_parse_ticket(k5, ccreds, ticket, t))) {
+    krb5_free_creds(k5->ctx, ccreds);
+    return code;
+  }
+  /* The encoded ticket isn't kept */
+  t->data = NULL;
+  t->data_size = 0;
+  return 0;
+}
+
+krb5_error_code K5_EXPORT
+k5_set_keytab(k5_context k5, const char *name)
+{
+  char *copy = NULL;
+
+  assert(k5);
+
+  if (name && !(copy = strdup(name)))
+    return ENOMEM;
+  free(k5->kt_default);
+  k5->kt_default = copy;
+  return 0;
+}
+
+/* keytab is NULL for the context's own keytab */
+krb5_error_code
+k5_accept_keytab(k5_context k5, krb5_keytab keytab, const void *token,
+		 size_t len, k5_accepted *out)
+{
+  krb5_auth_context auth_context = NULL;
+  krb5_ticket *ticket = NULL;
+  krb5_flags options = 0;
+  krb5_data in, ap_rep;
+  k5_kinit_req req;
+  krb5_error_code code;
+  enum framing framing;
+  struct k5_kt_snapshot *snapshot = NULL;
+  krb5_keyblock *server_key = NULL;
+  struct ticket_info info;
+  struct der d, ap_req, mech;
+  int has_info;
+  double start;
+
+  assert(k5);
+  assert(k5->ctx);
+  assert(token);
+  assert(out);
+
+  memset(out, 0, sizeof (*out));
+  memset(&ap_rep, 0, sizeof (ap_rep));
+  memset(&mech, 0, sizeof (mech));
+  start = k5_now();
+  if (k5->trace)
+    k5_span_begin(k5, "accept", NULL, NULL);
+
+  d.p = token;
+  d.left = len;
+  if (len && d.p[0] == 0x6e) {
+    framing = FRAMING_RAW;
+    ap_req = d;
+  } else if (len > 2 && d.p[0] == 0x60 && !unwrap_gss(&d, &ap_req)) {
+    framing = FRAMING_GSS;
+  } else {
+    struct der outer;
+
+    d.p = token;
+    d.left = len;
+    if (der_get(&d, 0x60, &outer) ||
+	!der_oid_is(&outer, spnego_oid, sizeof (spnego_oid)) ||
+	unwrap_spnego(&outer, &ap_req, &mech)) {
+      code = KRB5KRB_AP_ERR_MSG_TYPE;
+      k5_err(k5, "k5_accept", code, NULL, "while decoding token");
+      goto cleanup;
+    }
+    framing = FRAMING_SPNEGO;
+  }
+
+  has_info = !ticket_info(&ap_req, &info);
+
+  /*
+   * FILE: keytabs go through the index, the key is handed to
+   * krb5_rd_req() so it doesn't scan the keytab. Others are loaded once
+   * by the context, and so are indexed keytabs when the ticket's server
+   * isn't found as is: krb5_rd_req() then tries every key of the
+   * ticket's enctype and kvno, for SPN aliases or keytabs which only
+   * have the account's principal.
+   */
+  if (!keytab)
+    k5_keytab_index_open(k5);
+  if (k5->kt_index && has_info &&
+      !k5_keytab_index_get(k5, &snapshot) &&
+      index_key(snapshot, &info, &server_key) && k5->trace)
+    k5_span_event(k5, "Server not in the keytab index, scanning keytab");
+  if (!server_key) {
+    memset(&req, 0, sizeof (req));
+    req.action = K5_KINIT_KEYTAB;
+    if (!keytab && (code = k5_keytab_get(k5, &req, &keytab))) {
+      k5_err(k5, "k5_accept", code, k5->kt_default,
+	     "while loading keytab %s");
+      goto cleanup;
+    }
+  }
+
+  /*
+   * With our own replay cache, keep krb5 from using its own: it only
+   * does so for auth contexts with KRB5_AUTH_CONTEXT_DO_TIME. Otherwise
+   * krb5's replay cache is attached by hand.
+   */
+  if ((code = krb5_auth_con_init(k5->ctx, &auth_context)) ||
+      (k5->rcache &&
+       (code = krb5_auth_con_setflags(k5->ctx, auth_context, 0))) ||
+      (!k5->rcache &&
+       (code = default_rcache(k5, auth_context, has_info ? &info : NULL))) ||
+      (server_key &&
+       (code = krb5_auth_con_setuseruserkey(k5->ctx, auth_context,
+					    server_key)))) {
+    k5_err(k5, "k5_accept", code, NULL, "while initializing auth context");
+    goto cleanup;
+  }
+
+  in.magic = KV5M_DATA;
+  in.data = (char *)ap_req.p;
+  in.length = ap_req.left;
+  if (k5->trace)
+    k5_span_event(k5, "Verifying AP-REQ");
+  if ((code = krb5_rd_req(k5->ctx, &auth_context, &in, NULL, keytab,
+			  &options, &ticket))) {
+    k5_err(k5, "k5_accept", code, NULL, "while verifying AP-REQ");
+    goto cleanup;
+  }
+
+  if (k5->rcache &&
+      (code = check_replay(k5, auth_context, &ap_req))) {
+    k5_err(k5, "k5_accept", code, NULL, "while checking replay cache");
+    krb5_free_ticket(k5->ctx, ticket);
+    goto cleanup;
+  }
+
+  if ((code = accepted_ticket(k5, ticket, &out->ticket))) {
+    krb5_free_ticket(k5->ctx, ticket);
+    goto cleanup;
+  }
+
+  if (k5->pac_enabled) {
+    if ((code = k5_pac_get(k5, ticket, keytab, server_key,
+			   has_info ? info.cipher.p : NULL,
+			   has_info ? info.cipher.left : 0, &out->pac))) {
+      k5_err(k5, "k5_accept", code, out->ticket.client_name,
+	     "while verifying the PAC of %s");
+      goto cleanup;
+    }
+  }
+
+  if (options & AP_OPTS_MUTUAL_REQUIRED) {
+    if ((code = krb5_mk_rep(k5->ctx, auth_context, &ap_rep))) {
+      k5_err(k5, "k5_accept", code, out->ticket.client_name,
+	     "while building AP-REP for %s");
+      goto cleanup;
+    }
+    out->mutual = 1;
+  }
+  code = wrap_reply(framing, &ap_rep, &mech, out);
+
+ cleanup:
+  k5_stat_record(k5, K5_STAT_ACCEPT, start, code);
+  if (code)
+    k5_clear_accepted(k5, out);
+  krb5_free_data_contents(k5->ctx, &ap_rep);
+  if (auth_context)
+    krb5_auth_con_free(k5->ctx, auth_context);
+  k5_keytab_index_release(snapshot);
+  if (k5->trace)
+    k5_span_end(k5, code);
+  return code;
+}
+
+krb5_error_code K5_EXPORT
+k5_accept(k5_context k5, const void *token, size_t len, k5_accepted *out)
+{
+  return k5_accept_keytab(k5, NULL, token, len, out);
+}
+
+void K5_EXPORT
+k5_clear_accepted(k5_context k5, k5_accepted *accepted)
+{
+  assert(k5);
+
+  if (!accepted)
+    return ;
+
+  k5_clear_ticket(k5, &accepted->ticket);
+  k5_pac_release(accepted->pac);
+  free(accepted->token);
+  memset(accepted, 0, sizeof (*accepted));
+}
@@ -0,0 +1,774 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* struct ucred */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "k5_priv.h"
+
+#if defined(_WIN32)
+
+krb5_error_code K5_EXPORT
+k5_agent_run(k5_context k5, const char *path, volatile int *stop)
+{
+  return ENOSYS;
+}
+
+krb5_error_code
+k5_agent_open(k5_context k5, const char *path)
+{
+  return ENOSYS;
+}
+
+krb5_error_code
+k5_agent_get(k5_context k5, const char *server, krb5_creds **creds)
+{
+  return ENOSYS;
+}
+
+krb5_error_code
+k5_agent_sync(k5_context k5)
+{
+  return ENOSYS;
+}
+
+void
+k5_agent_close(k5_context k5)
+{
+}
+
+#else
+
+/*
+ * k5d protocol. Frames are a 32 bits big endian length then the
+ * payload. Requests are one byte of operation then its argument;
+ * replies are a 32 bits big endian error code then the result:
+ *
+ *   'P'              client principal name
+ *   'G' principal    credentials for principal (see k5_creds_encode())
+ *   'L'              count, then length and credentials for each one
+ *
+ * Both ends check with SO_PEERCRED that the other one runs as the same
+ * user. The agent handles every request ready after one poll() together:
+ * concurrent requests for the same principal share one lookup, and one
+ * ccache scan answers every list.
+ */
+
+#define AGENT_PRINCIPAL 'P'
+#define AGENT_GET 'G'
+#define AGENT_LIST 'L'
+#define AGENT_MAX_FRAME (1 << 20)
+#define AGENT_MAX_CLIENTS 1024
+
+struct frame {
+  unsigned char *data;
+  size_t len;
+  size_t size;
+};
+
+struct client {
+  int fd;
+  struct frame in;
+};
+
+static int
+frame_reserve(struct frame *f, size_t len)
+{
+  unsigned char *tmp;
+  size_t size = f->size ? f->size : 256;
+
+  if (f->len + len <= f->size)
+    return 0;
+  while (size < f->len + len)
+    size *= 2;
+  tmp = realloc(f->data, size);
+  if (!tmp)
+    return -1;
+  f->data = tmp;
+  f->size = size;
+  return 0;
+}
+
+static int
+frame_put(struct frame *f, const void *data, size_t len)
+{
+  if (frame_reserve(f, len))
+    return -1;
+  memcpy(f->data + f->len, data, len);
+  f->len += len;
+  return 0;
+}
+
+static int
+frame_put_u32(struct frame *f, unsigned int v)
+{
+  unsigned char b[4];
+
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v;
+  return frame_put(f, b, 4);
+}
+
+static unsigned int
+get_u32(const unsigned char *p)
+{
+  return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int
+frame_put_creds(k5_context k5, struct frame *f, krb5_creds *creds)
+{
+  char *client = NULL, *server = NULL;
+  size_t len, at;
+  int ret = -1;
+
+  if (krb5_unparse_name(k5->ctx, creds->client, &client) ||
+      krb5_unparse_name(k5->ctx, creds->server, &server))
+    goto cleanup;
+  len = k5_creds_size(client, server, creds);
+  at = f->len;
+  if (frame_put_u32(f, len) || frame_reserve(f, len) ||
+      k5_creds_encode(client, server, creds, f->data + f->len, len, &len))
+    goto cleanup;
+  /* The size is an upper bound */
+  f->len += len;
+  f->data[at] = len >> 24;
+  f->data[at + 1] = len >> 16;
+  f->data[at + 2] = len >> 8;
+  f->data[at + 3] = len;
+  ret = 0;
+
+ cleanup:
+  if (client)
+    krb5_free_unparsed_name(k5->ctx, client);
+  if (server)
+    krb5_free_unparsed_name(k5->ctx, server);
+  return ret;
+}
+
+static int
+write_all(int fd, const void *data, size_t len)
+{
+  const char *p = data;
+  ssize_t n;
+
+  while (len) {
+    n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue ;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int
+read_all(int fd, void *data, size_t len)
+{
+  char *p = data;
+  ssize_t n;
+
+  while (len) {
+    n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue ;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* The other end must run as us */
+static krb5_error_code
+check_peer(int fd)
+{
+  uid_t uid;
+#if defined(SO_PEERCRED)
+  struct ucred cred;
+  socklen_t len = sizeof (cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+    return errno;
+  uid = cred.uid;
+#else
+  gid_t gid;
+
+  if (getpeereid(fd, &uid, &gid))
+    return errno;
+#endif
+  return uid == geteuid() ? 0 : EACCES;
+}
+
+static int
+agent_address(const char *path, struct sockaddr_un *addr)
+{
+  char def[sizeof (addr->sun_path)];
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+
+  if (!path || !*path) {
+    if (dir)
+      snprintf(def, sizeof (def), "%s/k5d.sock", dir);
+    else
+      snprintf(def, sizeof (def), "/tmp/k5d-%lu.sock",
+	       (unsigned long)geteuid());
+    path = def;
+  }
+  if (strlen(path) >= sizeof (addr->sun_path))
+    return -1;
+  memset(addr, 0, sizeof (*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+/* Server side */
+
+struct request {
+  struct client *client;
+  int op;
+  const char *arg;
+  int done;
+};
+
+static void
+reply(struct client *c, krb5_error_code code, struct frame *body)
+{
+  unsigned char head[8];
+  size_t len = 4 + (body ? body->len : 0);
+
+  head[0] = len >> 24;
+  head[1] = len >> 16;
+  head[2] = len >> 8;
+  head[3] = len;
+  head[4] = (unsigned int)code >> 24;
+  head[5] = (unsigned int)code >> 16;
+  head[6] = (unsigned int)code >> 8;
+  head[7] = code;
+  if (write_all(c->fd, head, 8) ||
+      (body && body->len && write_all(c->fd, body->data, body->len))) {
+    close(c->fd);
+    c->fd = -1;
+  }
+}
+
+static void
+serve_principal(k5_context k5, struct request *reqs, int n)
+{
+  krb5_principal princ = NULL;
+  krb5_error_code code;
+  struct frame f;
+  char *name = NULL;
+  int i;
+
+  memset(&f, 0, sizeof (f));
+  code = krb5_cc_get_principal(k5->ctx, k5->cc, &princ);
+  if (!code)
+    code = krb5_unparse_name(k5->ctx, princ, &name);
+  if (!code && frame_put(&f, name, strlen(name) + 1))
+    code = ENOMEM;
+
+  for (i = 0; i < n; ++i)
+    if (reqs[i].op == AGENT_PRINCIPAL && reqs[i].client->fd >= 0)
+      reply(reqs[i].client, code, code ? NULL : &f);
+
+  if (name)
+    krb5_free_unparsed_name(k5->ctx, name);
+  if (princ)
+    krb5_free_principal(k5->ctx, princ);
+  free(f.data);
+}
+
+static void
+serve_list(k5_context k5, struct request *reqs, int n)
+{
+  k5_klist_entries entries;
+  krb5_error_code code;
+  struct frame f;
+  int i;
+
+  memset(&f, 0, sizeof (f));
+  code = k5_klist(k5, &entries);
+  if (!code) {
+    frame_put_u32(&f, entries.count);
+    for (i = 0; i < entries.count && !code; ++i)
+      if (frame_put_creds(k5, &f, entries.tickets[i].creds))
+	code = ENOMEM;
+    k5_clear_klist(k5, &entries);
+  }
+
+  for (i = 0; i < n; ++i)
+    if (reqs[i].op == AGENT_LIST && reqs[i].client->fd >= 0)
+      reply(reqs[i].client, code, code ? NULL : &f);
+  free(f.data);
+}
+
+/* One lookup for every request for the same principal */
+static void
+serve_get(k5_context k5, struct request *reqs, int n, int first)
+{
+  k5_ticket ticket;
+  krb5_error_code code;
+  struct frame f;
+  int i;
+
+  memset(&f, 0, sizeof (f));
+  code = k5_get_service_ticket(k5, NULL, reqs[first].arg, &ticket);
+  if (!code) {
+    if (frame_put_creds(k5, &f, ticket.creds))
+      code = ENOMEM;
+    k5_clear_ticket(k5, &ticket);
+  }
+
+  for (i = first; i < n; ++i) {
+    if (reqs[i].op != AGENT_GET || reqs[i].done ||
+	strcmp(reqs[i].arg, reqs[first].arg))
+      continue ;
+    reqs[i].done = 1;
+    if (reqs[i].client->fd >= 0)
+      reply(reqs[i].client, code, code ? NULL : &f);
+  }
+  free(f.data);
+}
+
+/* Complete requests in c->in, at most one per client and round */
+static int
+parse_request(struct client *c, struct request *req)
+{
+  size_t len;
+
+  if (c->in.len < 4)
+    return 0;
+  len = get_u32(c->in.data);
+  if (len > AGENT_MAX_FRAME || !len)
+    return -1;
+  if (c->in.len < 4 + len)
+    return 0;
+
+  req->client = c;
+  req->op = c->in.data[4];
+  req->arg = (const char *)c->in.data + 5;
+  req->done = 0;
+  if (req->op == AGENT_GET &&
+      (len < 2 || c->in.data[4 + len - 1] != '\0'))
+    return -1;
+  if (req->op != AGENT_GET && req->op != AGENT_LIST &&
+      req->op != AGENT_PRINCIPAL)
+    return -1;
+  return 1;
+}
+
+/* A whole request is buffered, or a bad one parse_request() refuses */
+static int
+request_ready(struct client *c)
+{
+  size_t len;
+
+  if (c->fd < 0 || c->in.len < 4)
+    return 0;
+  len = get_u32(c->in.data);
+  return !len || len > AGENT_MAX_FRAME || c->in.len - 4 >= len;
+}
+
+static void
+consume_request(struct client *c)
+{
+  size_t len = 4 + get_u32(c->in.data);
+
+  memmove(c->in.data, c->in.data + len, c->in.len - len);
+  c->in.len -= len;
+}
+
+static void
+serve(k5_context k5, struct request *reqs, int n)
+{
+  int i, principal = 0, list = 0;
+
+  for (i = 0; i < n; ++i) {
+    if (reqs[i].op == AGENT_PRINCIPAL)
+      principal = 1;
+    else if (reqs[i].op == AGENT_LIST)
+      list = 1;
+  }
+  if (principal)
+    serve_principal(k5, reqs, n);
+  if (list)
+    serve_list(k5, reqs, n);
+  for (i = 0; i < n; ++i)
+    if (reqs[i].op == AGENT_GET && !reqs[i].done)
+      serve_get(k5, reqs, n, i);
+}
+
+static void
+client_read(struct client *c)
+{
+  ssize_t n;
+
+  if (frame_reserve(&c->in, 4096)) {
+    close(c->fd);
+    c->fd = -1;
+    return ;
+  }
+  n = read(c->fd, c->in.data + c->in.len, c->in.size - c->in.len);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    return ;
+  if (n <= 0) {
+    close(c->fd);
+    c->fd = -1;
+    return ;
+  }
+  c->in.len += n;
+}
+
+krb5_error_code K5_EXPORT
+k5_agent_run(k5_context k5, const char *path, volatile int *stop)
+{
+  struct sockaddr_un addr;
+  struct client *clients = NULL;
+  struct request *reqs = NULL;
+  struct pollfd *fds = NULL;
+  krb5_error_code code = 0;
+  mode_t mask;
+  int lfd, count = 0, i, n, pending = 0;
+
+  assert(k5);
+  assert(k5->ctx);
+  assert(stop);
+
+  if (agent_address(path, &addr))
+    return ENAMETOOLONG;
+  if ((code = k5_cc_open(k5)))
+    return code;
+
+  lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (lfd < 0)
+    return errno;
+  unlink(addr.sun_path);
+  mask = umask(077);
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof (addr)) ||
+      listen(lfd, 128)) {
+    code = errno;
+    umask(mask);
+    k5_err(k5, "k5_agent_run", code, addr.sun_path,
+	   "while listening on %s");
+    close(lfd);
+    return code;
+  }
+  umask(mask);
+
+  clients = calloc(AGENT_MAX_CLIENTS, sizeof (*clients));
+  reqs = calloc(AGENT_MAX_CLIENTS, sizeof (*reqs));
+  fds = calloc(AGENT_MAX_CLIENTS + 1, sizeof (*fds));
+  if (!clients || !reqs || !fds) {
+    code = ENOMEM;
+    goto cleanup;
+  }
+
+  while (!*stop) {
+    fds[0].fd = lfd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    for (i = 0; i < count; ++i) {
+      fds[i + 1].fd = clients[i].fd;
+      fds[i + 1].events = POLLIN;
+      fds[i + 1].revents = 0;
+    }
+
+    /* Don't wait while requests are already buffered */
+    n = poll(fds, count + 1, pending ? 0 : 1000);
+    if (n < 0 && errno != EINTR) {
+      code = errno;
+      break ;
+    }
+    if (n <= 0 && !pending)
+      continue ;
+
+    for (i = 0; i < count; ++i)
+      if (fds[i + 1].revents)
+	client_read(&clients[i]);
+
+    if ((fds[0].revents & POLLIN) && count < AGENT_MAX_CLIENTS) {
+      int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+      if (fd >= 0 && check_peer(fd)) {
+	close(fd);
+      } else if (fd >= 0) {
+	memset(&clients[count], 0, sizeof (clients[count]));
+	clients[count++].fd = fd;
+      }
+    }
+
+    /* Everything that arrived meanwhile is served together */
+    for (i = n = 0; i < count; ++i) {
+      if (clients[i].fd < 0)
+	continue ;
+      switch (parse_request(&clients[i], &reqs[n])) {
+      case 1:
+	n++;
+	break ;
+      case -1:
+	close(clients[i].fd);
+	clients[i].fd = -1;
+	break ;
+      }
+    }
+    serve(k5, reqs, n);
+    for (i = 0; i < n; ++i)
+      if (reqs[i].client->fd >= 0)
+	consume_request(reqs[i].client);
+
+    /* Forget closed connections */
+    pending = 0;
+    for (i = n = 0; i < count; ++i) {
+      if (clients[i].fd >= 0) {
+	pending |= request_ready(&clients[i]);
+	clients[n++] = clients[i];
+      } else {
+	free(clients[i].in.data);
+      }
+    }
+    count = n;
+  }
+
+ cleanup:
+  for (i = 0; i < count; ++i) {
+    close(clients[i].fd);
+    free(clients[i].in.data);
+  }
+  free(clients);
+  free(reqs);
+  free(fds);
+  close(lfd);
+  unlink(addr.sun_path);
+  return code;
+}
+
+/* Client side */
+
+static krb5_error_code
+agent_connect(k5_context k5)
+{
+  struct sockaddr_un addr;
+  krb5_error_code code;
+  int fd;
+
+  if (agent_address(k5->agent_path, &addr))
+    return ENAMETOOLONG;
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return errno;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof (addr))) {
+    code = errno;
+    close(fd);
+    return code;
+  }
+  /* Don't take tickets from someone else's agent */
+  if ((code = check_peer(fd))) {
+    close(fd);
+    return code;
+  }
+  k5->agent_fd = fd;
+  return 0;
+}
+
+/* One request, one reply. The connection is opened again if it broke */
+static krb5_error_code
+agent_call(k5_context k5, int op, const char *arg, struct frame *out)
+{
+  unsigned char head[5];
+  size_t len = 1 + (arg ? strlen(arg) + 1 : 0);
+  krb5_error_code code;
+  int tries;
+
+  memset(out, 0, sizeof (*out));
+  head[0] = len >> 24;
+  head[1] = len >> 16;
+  head[2] = len >> 8;
+  head[3] = len;
+  head[4] = op;
+
+  for (tries = 0; tries < 2; ++tries) {
+    if (k5->agent_fd < 0 && (code = agent_connect(k5)))
+      return code;
+    if (!write_all(k5->agent_fd, head, 5) &&
+	(!arg || !write_all(k5->agent_fd, arg, len - 1)) &&
+	!read_all(k5->agent_fd, head, 4))
+      break ;
+    close(k5->agent_fd);
+    k5->agent_fd = -1;
+  }
+  if (tries == 2)
+    return ECONNRESET;
+
+  len = get_u32(head);
+  if (len < 4 || len > AGENT_MAX_FRAME || frame_reserve(out, len) ||
+      read_all(k5->agent_fd, out->data, len)) {
+    close(k5->agent_fd);
+    k5->agent_fd = -1;
+    free(out->data);
+    memset(out, 0, sizeof (*out));
+    return KRB5_CC_IO;
+  }
+  out->len = len;
+  return (krb5_error_code)get_u32(out->data);
+}
+
+krb5_error_code
+k5_agent_open(k5_context k5, const char *path)
+{
+  krb5_principal princ = NULL;
+  krb5_error_code code;
+  struct frame f;
+  char name[64];
+
+  if (!(k5->agent_path = strdup(path)))
+    return ENOMEM;
+
+  if ((code = agent_call(k5, AGENT_PRINCIPAL, NULL, &f)))
+    goto cleanup;
+  if (f.len < 5 || f.data[f.len - 1] != '\0') {
+    code = KRB5_CC_FORMAT;
+    goto cleanup;
+  }
+  if ((code = krb5_parse_name(k5->ctx, (char *)f.data + 4, &princ)))
+    goto cleanup;
+
+  /* Tickets from the agent are kept in memory */
+  snprintf(name, sizeof (name), "MEMORY:libk5-agent-%p", (void *)k5);
+  if ((code = krb5_cc_resolve(k5->ctx, name, &k5->cc)))
+    goto cleanup;
+  code = krb5_cc_initialize(k5->ctx, k5->cc, princ);
+
+ cleanup:
+  free(f.data);
+  if (princ)
+    krb5_free_principal(k5->ctx, princ);
+  return code;
+}
+
+krb5_error_code
+k5_agent_get(k5_context k5, const char *server, krb5_creds **creds)
+{
+  krb5_error_code code;
+  struct frame f;
+  size_t len;
+
+  if ((code = agent_call(k5, AGENT_GET, server, &f)))
+    goto cleanup;
+  len = f.len >= 8 ? get_u32(f.data + 4) : 0;
+  if (f.len < 8 || len > f.len - 8) {
+    code = KRB5_CC_FORMAT;
+    goto cleanup;
+  }
+  if (!(code = k5_creds_decode(k5, f.data + 8, len, creds)))
+    krb5_cc_store_cred(k5->ctx, k5->cc, *creds);
+
+ cleanup:
+  free(f.data);
+  return code;
+}
+
+/* The ccache gets every ticket of the agent, for k5_klist() */
+krb5_error_code
+k5_agent_sync(k5_context k5)
+{
+  krb5_principal princ = NULL;
+  krb5_error_code code;
+  struct frame f;
+  size_t at, len;
+  unsigned int count, i;
+
+  if ((code = agent_call(k5, AGENT_LIST, NULL, &f)))
+    goto cleanup;
+  if (f.len < 8) {
+    code = KRB5_CC_FORMAT;
+    goto cleanup;
+  }
+  count = get_u32(f.data + 4);
+
+  if ((code = krb5_cc_get_principal(k5->ctx, k5->cc, &princ)) ||
+      (code = krb5_cc_initialize(k5->ctx, k5->cc, princ)))
+    goto cleanup;
+
+  for (i = 0, at = 8; i < count && !code; ++i) {
+    krb5_creds *creds;
+
+    len = at + 4 <= f.len ? get_u32(f.data + at) : f.len;
+    if (len > f.len - at - 4) {
+      code = KRB5_CC_FORMAT;
+      break ;
+    }
+    if (!(code = k5_creds_decode(k5, f.data + at + 4, len, &creds))) {
+      code = krb5_cc_store_cred(k5->ctx, k5->cc, creds);
+      krb5_free_creds(k5->ctx, creds);
+    }
+    at += 4 + len;
+  }
+
+ cleanup:
+  free(f.data);
+  if (princ)
+    krb5_free_principal(k5->ctx, princ);
+  return code;
+}
+
+/* Memory ccaches outlive krb5_cc_close(), destroy the agent's copy */
+void
+k5_agent_close(k5_context k5)
+{
+  char name[64];
+
+  snprintf(name, sizeof (name), "libk5-agent-%p", (void *)k5);
+  if (k5->cc && !strcmp(krb5_cc_get_type(k5->ctx, k5->cc), "MEMORY") &&
+      !strcmp(krb5_cc_get_name(k5->ctx, k5->cc), name)) {
+    krb5_cc_destroy(k5->ctx, k5->cc);
+    k5->cc = NULL;
+  }
+  if (k5->agent_fd >= 0)
+    close(k5->agent_fd);
+  k5->agent_fd = -1;
+  free(k5->agent_path);
+  k5->agent_path = NULL;
+}
+
+#endif
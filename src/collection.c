@@ -0,0 +1,283 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "k5_priv.h"
+
+#if defined(_WIN32)
+
+krb5_error_code K5_EXPORT
+k5_scan_collection(k5_context k5, int threads, k5_ccache_fn fn, void *data,
+		   k5_ccache_info **infos, int *count)
+{
+  return ENOSYS;
+}
+
+void K5_EXPORT
+k5_free_collection(k5_ccache_info *infos, int count)
+{
+}
+
+#else
+
+/*
+ * The collection is listed first, from the caller's context, then
+ * threads take caches one at a time with an atomic counter. Each cache
+ * is opened by its own quiet k5_context: contexts share the parsed
+ * krb5.conf, and the callback gets a context it can use like any other
+ * (k5_kinit() to renew, k5_kdestroy()...) without locking. An error on
+ * one cache is recorded in its entry and doesn't stop the others.
+ */
+
+struct scan {
+  k5_context k5;
+  k5_ccache_fn fn;
+  void *data;
+  k5_ccache_info *infos;
+  int count;
+  volatile int next;
+};
+
+/* krbtgt/REALM@REALM for the client's realm */
+static int
+is_local_tgt(krb5_principal client, krb5_creds *creds)
+{
+  krb5_principal p = creds->server;
+
+  return p->length == 2 && p->data[0].length == 6 &&
+    !memcmp(p->data[0].data, "krbtgt", 6) &&
+    p->data[1].length == client->realm.length &&
+    !memcmp(p->data[1].data, client->realm.data, client->realm.length) &&
+    p->realm.length == client->realm.length &&
+    !memcmp(p->realm.data, client->realm.data, client->realm.length);
+}
+
+static krb5_error_code
+scan_one(k5_context k5, k5_ccache_info *info)
+{
+  krb5_principal client = NULL;
+  char *name = NULL;
+  krb5_cc_cursor cur;
+  krb5_creds creds;
+  krb5_error_code code;
+
+  if ((code = k5_cc_open(k5)))
+    return code;
+
+  if ((code = krb5_cc_get_principal(k5->ctx, k5->cc, &client))) {
+    k5_err(k5, "k5_scan_collection", code, info->name,
+	   "while retrieving principal name");
+    return code;
+  }
+
+  if ((code = krb5_unparse_name(k5->ctx, client, &name))) {
+    k5_err(k5, "k5_scan_collection", code, info->name,
+	   "while unparsing principal name");
+    goto cleanup;
+  }
+  if (!(info->principal = strdup(name))) {
+    code = ENOMEM;
+    goto cleanup;
+  }
+
+  if ((code = krb5_cc_start_seq_get(k5->ctx, k5->cc, &cur))) {
+    k5_err(k5, "k5_scan_collection", code, info->principal,
+	   "while starting to retrieve tickets");
+    goto cleanup;
+  }
+
+  while (!(code = krb5_cc_next_cred(k5->ctx, k5->cc, &cur, &creds))) {
+    if (!krb5_is_config_principal(k5->ctx, creds.server)) {
+      info->tickets++;
+      if (is_local_tgt(client, &creds)) {
+	info->tgt_endtime = creds.times.endtime;
+	info->tgt_renew_till = creds.times.renew_till;
+      }
+    }
+    krb5_free_cred_contents(k5->ctx, &creds);
+  }
+
+  if (code == KRB5_CC_END)
+    code = 0;
+  else
+    k5_err(k5, "k5_scan_collection", code, info->principal,
+	   "while retrieving a ticket");
+  krb5_cc_end_seq_get(k5->ctx, k5->cc, &cur);
+
+ cleanup:
+  if (name)
+    krb5_free_unparsed_name(k5->ctx, name);
+  krb5_free_principal(k5->ctx, client);
+  return code;
+}
+
+static void *
+scan_thread(void *arg)
+{
+  struct scan *scan = arg;
+  int i;
+
+  while ((i = __sync_fetch_and_add(&scan->next, 1)) < scan->count) {
+    k5_ccache_info *info = &scan->infos[i];
+    k5_context k5;
+
+    if ((info->code = k5_init_context(&k5, info->name)))
+      continue ;
+    k5_set_quiet(k5, 1);
+    info->code = scan_one(k5, info);
+    if (scan->fn)
+      info->callback_code = scan->fn(k5, info, scan->data);
+    k5_free_context(k5);
+  }
+  return NULL;
+}
+
+/* Full names of the collection's caches */
+static krb5_error_code
+list_caches(k5_context k5, k5_ccache_info **infos, int *count)
+{
+  krb5_cccol_cursor cursor;
+  krb5_ccache cc;
+  krb5_error_code code;
+  int size = 0;
+
+  if ((code = krb5_cccol_cursor_new(k5->ctx, &cursor))) {
+    k5_err(k5, "k5_scan_collection", code, NULL,
+	   "while listing the ccache collection");
+    return code;
+  }
+
+  while (!(code = krb5_cccol_cursor_next(k5->ctx, cursor, &cc)) && cc) {
+    const char *type = krb5_cc_get_type(k5->ctx, cc);
+    const char *name = krb5_cc_get_name(k5->ctx, cc);
+    k5_ccache_info *info;
+
+    if (*count == size) {
+      k5_ccache_info *tmp;
+
+      size = size ? size * 2 : 16;
+      tmp = realloc(*infos, size * sizeof (**infos));
+      if (!tmp) {
+	krb5_cc_close(k5->ctx, cc);
+	code = ENOMEM;
+	break ;
+      }
+      *infos = tmp;
+    }
+
+    info = &(*infos)[*count];
+    memset(info, 0, sizeof (*info));
+    info->name = malloc(strlen(type) + strlen(name) + 2);
+    krb5_cc_close(k5->ctx, cc);
+    if (!info->name) {
+      code = ENOMEM;
+      break ;
+    }
+    sprintf(info->name, "%s:%s", type, name);
+    (*count)++;
+  }
+  krb5_cccol_cursor_free(k5->ctx, &cursor);
+
+  if (code)
+    k5_err(k5, "k5_scan_collection", code, NULL,
+	   "while listing the ccache collection");
+  return code;
+}
+
+krb5_error_code K5_EXPORT
+k5_scan_collection(k5_context k5, int threads, k5_ccache_fn fn, void *data,
+		   k5_ccache_info **infos, int *count)
+{
+  struct scan scan;
+  pthread_t *tids = NULL;
+  krb5_error_code code;
+  int i, started = 0;
+
+  assert(k5);
+  assert(infos);
+  assert(count);
+
+  *infos = NULL;
+  *count = 0;
+
+  memset(&scan, 0, sizeof (scan));
+  if ((code = list_caches(k5, &scan.infos, &scan.count)))
+    goto cleanup;
+
+  scan.k5 = k5;
+  scan.fn = fn;
+  scan.data = data;
+
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > scan.count)
+    threads = scan.count;
+  if (threads > 0)
+    tids = calloc(threads, sizeof (*tids));
+
+  for (i = 0; tids && i < threads; ++i) {
+    if (pthread_create(&tids[i], NULL, scan_thread, &scan))
+      break ;
+    started++;
+  }
+  /* Scan in this thread when no thread could be started */
+  if (!started)
+    scan_thread(&scan);
+  for (i = 0; i < started; ++i)
+    pthread_join(tids[i], NULL);
+
+ cleanup:
+  free(tids);
+  if (code) {
+    k5_free_collection(scan.infos, scan.count);
+    return code;
+  }
+  *infos = scan.infos;
+  *count = scan.count;
+  return 0;
+}
+
+void K5_EXPORT
+k5_free_collection(k5_ccache_info *infos, int count)
+{
+  int i;
+
+  if (!infos)
+    return ;
+  for (i = 0; i < count; ++i) {
+    free(infos[i].name);
+    free(infos[i].principal);
+  }
+  free(infos);
+}
+
+#endif
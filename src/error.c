@@ -0,0 +1,101 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+
+#include "k5_priv.h"
+
+/*
+ * Record an error, and report it with com_err() unless the context is
+ * quiet. format is a constant string, with at most one %s standing for
+ * principal. Nothing is formatted here in quiet mode: the principal is
+ * copied and the message is only built by k5_last_error_message().
+ */
+void
+k5_err(k5_context k5, const char *op, krb5_error_code code,
+       const char *principal, const char *format)
+{
+  k5_last_error *e = &k5->last_error;
+  size_t len = 0;
+
+  e->code = code;
+  e->op = op;
+  e->format = format;
+  if (principal) {
+    len = strlen(principal);
+    if (len >= sizeof (e->principal))
+      len = sizeof (e->principal) - 1;
+    memcpy(e->principal, principal, len);
+  }
+  e->principal[len] = '\0';
+  k5->last_error_formatted = 0;
+
+  if (!k5->quiet)
+    com_err(op, code, format, e->principal);
+}
+
+void K5_EXPORT
+k5_set_quiet(k5_context k5, int enabled)
+{
+  assert(k5);
+
+  k5->quiet = enabled;
+}
+
+const k5_last_error K5_EXPORT *
+k5_get_last_error(k5_context k5)
+{
+  assert(k5);
+
+  return &k5->last_error;
+}
+
+const char K5_EXPORT *
+k5_last_error_message(k5_context k5)
+{
+  k5_last_error *e;
+  const char *msg;
+  int n;
+
+  assert(k5);
+
+  e = &k5->last_error;
+  if (!e->code)
+    return "";
+  if (k5->last_error_formatted)
+    return k5->last_error_message;
+
+  msg = krb5_get_error_message(k5->ctx, e->code);
+  n = snprintf(k5->last_error_message, sizeof (k5->last_error_message),
+	       "%s: %s ", e->op, msg);
+  krb5_free_error_message(k5->ctx, msg);
+
+  if (n >= 0 && (size_t)n < sizeof (k5->last_error_message))
+    snprintf(k5->last_error_message + n, sizeof (k5->last_error_message) - n,
+	     e->format, e->principal);
+  k5->last_error_formatted = 1;
+  return k5->last_error_message;
+}
@@ -0,0 +1,81 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "k5_priv.h"
+
+#if defined(K5_LAZY_GSSAPI)
+
+#include <dlfcn.h>
+#include <pthread.h>
+
+/*
+ * Only k5_get_service_ticket_gss() needs GSSAPI, so lazy builds don't
+ * link it: the library is loaded the first time it is called, and never
+ * unloaded. Programs which don't use GSS don't pay for its loading and
+ * relocations at exec time.
+ */
+
+struct k5_gss k5_gss;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int loaded;
+
+static void
+gss_load(void)
+{
+  void *handle;
+
+  if (!(handle = dlopen(K5_GSSAPI_LIBRARY, RTLD_NOW | RTLD_LOCAL)))
+    return ;
+
+#define LOAD(f)					\
+  if (!(*(void **)&k5_gss.f = dlsym(handle, "gss_" #f)))	\
+    goto fail
+
+  LOAD(import_name);
+  LOAD(acquire_cred);
+  LOAD(init_sec_context);
+  LOAD(release_cred);
+  LOAD(release_buffer);
+  LOAD(release_name);
+  LOAD(delete_sec_context);
+#undef LOAD
+
+  loaded = 1;
+  return ;
+
+ fail:
+  memset(&k5_gss, 0, sizeof (k5_gss));
+  dlclose(handle);
+}
+
+krb5_error_code
+k5_gss_load(void)
+{
+  pthread_once(&once, gss_load);
+  return loaded ? 0 : ENOSYS;
+}
+
+#endif
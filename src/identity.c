@@ -0,0 +1,392 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+
+#include "k5_priv.h"
+
+/*
+ * Many client identities over one k5_context. Each identity is a
+ * MEMORY: ccache; before each operation the context's ccache handle is
+ * switched to the identity's, so the krb5 context, its parsed config,
+ * the keytab and the principal cache are shared by all of them.
+ *
+ * Identities are found by name in a hash table and kept in LRU order.
+ * Their size is estimated from their credentials after each operation;
+ * when there are too many identities, or they use too many bytes, the
+ * least recently used ones are destroyed. The identity being used is
+ * never evicted.
+ */
+
+#define IDENTITIES_DEFAULT 1024
+
+struct identity {
+  char *name;
+  unsigned int hash;
+  krb5_ccache cc;
+  size_t bytes;
+  struct identity *next_hash;
+  struct identity *prev, *next;
+};
+
+struct _k5_identities {
+  k5_context k5;
+  int max;
+  size_t max_bytes;
+  unsigned int mask;
+  struct identity **table;
+  /* Most recently used first */
+  struct identity *head, *tail;
+  /* Identity whose ccache is k5->cc */
+  struct identity *current;
+  unsigned long serial;
+  k5_identity_stats stats;
+};
+
+static unsigned int
+identity_hash(const char *name)
+{
+  unsigned int h = 2166136261u;
+
+  /* FNV-1a */
+  for (; *name; ++name)
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  return h;
+}
+
+static struct identity *
+identity_find(k5_identities ids, const char *name)
+{
+  unsigned int h = identity_hash(name);
+  struct identity *id;
+
+  for (id = ids->table[h & ids->mask]; id; id = id->next_hash)
+    if (id->hash == h && !strcmp(id->name, name))
+      return id;
+  return NULL;
+}
+
+static void
+lru_unlink(k5_identities ids, struct identity *id)
+{
+  if (id->prev)
+    id->prev->next = id->next;
+  else
+    ids->head = id->next;
+  if (id->next)
+    id->next->prev = id->prev;
+  else
+    ids->tail = id->prev;
+  id->prev = id->next = NULL;
+}
+
+static void
+lru_push(k5_identities ids, struct identity *id)
+{
+  id->next = ids->head;
+  if (ids->head)
+    ids->head->prev = id;
+  ids->head = id;
+  if (!ids->tail)
+    ids->tail = id;
+}
+
+/* Rough size of the credentials of the identity's ccache */
+static size_t
+identity_size(k5_context k5, krb5_ccache cc)
+{
+  krb5_cc_cursor cur;
+  krb5_creds creds;
+  size_t bytes = 0;
+  int i;
+
+  if (krb5_cc_start_seq_get(k5->ctx, cc, &cur))
+    return 0;
+  while (!krb5_cc_next_cred(k5->ctx, cc, &cur, &creds)) {
+    bytes += sizeof (creds) + creds.ticket.length +
+      creds.second_ticket.length + creds.keyblock.length;
+    for (i = 0; i < creds.server->length; ++i)
+      bytes += creds.server->data[i].length;
+    krb5_free_cred_contents(k5->ctx, &creds);
+  }
+  krb5_cc_end_seq_get(k5->ctx, cc, &cur);
+  return bytes;
+}
+
+/* Point the context at the identity's ccache */
+static void
+identity_use(k5_identities ids, struct identity *id)
+{
+  k5_context k5 = ids->k5;
+
+  if (ids->current == id && k5->cc == id->cc)
+    return ;
+  /* Opened by the application on the context itself */
+  if (k5->cc && (!ids->current || k5->cc != ids->current->cc))
+    krb5_cc_close(k5->ctx, k5->cc);
+  k5->cc = id->cc;
+  ids->current = id;
+  k5_princ_set_client(k5, NULL);
+}
+
+static void
+identity_remove(k5_identities ids, struct identity *id, int destroy)
+{
+  k5_context k5 = ids->k5;
+  struct identity **p = &ids->table[id->hash & ids->mask];
+
+  while (*p != id)
+    p = &(*p)->next_hash;
+  *p = id->next_hash;
+  lru_unlink(ids, id);
+
+  if (ids->current == id) {
+    if (k5->cc == id->cc)
+      k5->cc = NULL;
+    ids->current = NULL;
+    k5_princ_set_client(k5, NULL);
+  }
+  if (destroy)
+    krb5_cc_destroy(k5->ctx, id->cc);
+  else
+    krb5_cc_close(k5->ctx, id->cc);
+
+  ids->stats.resident--;
+  ids->stats.bytes -= id->bytes;
+  free(id->name);
+  free(id);
+}
+
+/* Update the size of id, then evict until the limits are met */
+static void
+identity_account(k5_identities ids, struct identity *id)
+{
+  size_t bytes = identity_size(ids->k5, id->cc);
+
+  ids->stats.bytes += bytes - id->bytes;
+  id->bytes = bytes;
+
+  while (ids->tail && ids->tail != id &&
+	 (ids->stats.resident > ids->max ||
+	  (ids->max_bytes && ids->stats.bytes > ids->max_bytes))) {
+    identity_remove(ids, ids->tail, 1);
+    ids->stats.evictions++;
+  }
+}
+
+static krb5_error_code
+identity_new(k5_identities ids, const char *name, struct identity **idp)
+{
+  k5_context k5 = ids->k5;
+  struct identity *id;
+  krb5_error_code code;
+  char cc_name[64];
+
+  id = calloc(1, sizeof (*id));
+  if (!id || !(id->name = strdup(name))) {
+    free(id);
+    return ENOMEM;
+  }
+
+  snprintf(cc_name, sizeof (cc_name), "MEMORY:libk5-identity-%p-%lu",
+	   (void *)ids, ++ids->serial);
+  if ((code = krb5_cc_resolve(k5->ctx, cc_name, &id->cc))) {
+    k5_err(k5, "k5_identity_kinit", code, name, "resolving ccache for %s");
+    free(id->name);
+    free(id);
+    return code;
+  }
+
+  id->hash = identity_hash(name);
+  id->next_hash = ids->table[id->hash & ids->mask];
+  ids->table[id->hash & ids->mask] = id;
+  lru_push(ids, id);
+  ids->stats.resident++;
+  *idp = id;
+  return 0;
+}
+
+/* Find a resident identity and make it the most recently used */
+static krb5_error_code
+identity_get(k5_identities ids, const char *op, const char *name,
+	     struct identity **idp)
+{
+  struct identity *id = identity_find(ids, name);
+
+  if (!id) {
+    ids->stats.misses++;
+    k5_err(ids->k5, op, KRB5_FCC_NOFILE, name, "identity %s is not resident");
+    return KRB5_FCC_NOFILE;
+  }
+  ids->stats.hits++;
+  lru_unlink(ids, id);
+  lru_push(ids, id);
+  *idp = id;
+  return 0;
+}
+
+krb5_error_code K5_EXPORT
+k5_identities_create(k5_identities *idsp, int max_identities,
+		     size_t max_bytes)
+{
+  k5_identities ids;
+  krb5_error_code code;
+  char cc_name[64];
+  unsigned int size = 16;
+
+  assert(idsp);
+
+  *idsp = NULL;
+  if (max_identities < 0)
+    return EINVAL;
+  if (!max_identities)
+    max_identities = IDENTITIES_DEFAULT;
+  while (size < (unsigned int)max_identities && size < (1u << 20))
+    size <<= 1;
+
+  ids = calloc(1, sizeof (*ids));
+  if (!ids)
+    return ENOMEM;
+  ids->max = max_identities;
+  ids->max_bytes = max_bytes;
+  ids->mask = size - 1;
+  ids->table = calloc(size, sizeof (*ids->table));
+  if (!ids->table) {
+    free(ids);
+    return ENOMEM;
+  }
+
+  /* Stray ccache calls on the context don't touch the default ccache */
+  snprintf(cc_name, sizeof (cc_name), "MEMORY:libk5-identities-%p",
+	   (void *)ids);
+  if ((code = k5_init_context(&ids->k5, cc_name))) {
+    free(ids->table);
+    free(ids);
+    return code;
+  }
+
+  *idsp = ids;
+  return 0;
+}
+
+k5_context K5_EXPORT
+k5_identities_context(k5_identities ids)
+{
+  assert(ids);
+
+  return ids->k5;
+}
+
+krb5_error_code K5_EXPORT
+k5_identity_kinit(k5_identities ids, k5_kinit_req *req, k5_ticket *ticket)
+{
+  struct identity *id;
+  krb5_error_code code;
+  int created = 0;
+
+  assert(ids);
+  assert(req);
+
+  if (!req->principal_name)
+    return EINVAL;
+
+  if ((id = identity_find(ids, req->principal_name))) {
+    ids->stats.hits++;
+    lru_unlink(ids, id);
+    lru_push(ids, id);
+  } else {
+    ids->stats.misses++;
+    if ((code = identity_new(ids, req->principal_name, &id)))
+      return code;
+    created = 1;
+  }
+
+  identity_use(ids, id);
+  code = k5_kinit(ids->k5, req, ticket);
+  if (code && created) {
+    identity_remove(ids, id, 1);
+    return code;
+  }
+  identity_account(ids, id);
+  return code;
+}
+
+krb5_error_code K5_EXPORT
+k5_identity_get_service_ticket(k5_identities ids, const char *principal,
+			       const char *service, const char *hostname,
+			       k5_ticket *ticket)
+{
+  struct identity *id;
+  krb5_error_code code;
+
+  assert(ids);
+  assert(principal);
+
+  if ((code = identity_get(ids, "k5_identity_get_service_ticket",
+			   principal, &id)))
+    return code;
+
+  identity_use(ids, id);
+  code = k5_get_service_ticket(ids->k5, service, hostname, ticket);
+  identity_account(ids, id);
+  return code;
+}
+
+krb5_error_code K5_EXPORT
+k5_identity_destroy(k5_identities ids, const char *principal)
+{
+  struct identity *id;
+  krb5_error_code code;
+
+  assert(ids);
+  assert(principal);
+
+  if ((code = identity_get(ids, "k5_identity_destroy", principal, &id)))
+    return code;
+  identity_remove(ids, id, 1);
+  return 0;
+}
+
+void K5_EXPORT
+k5_identities_stats(k5_identities ids, k5_identity_stats *stats)
+{
+  assert(ids);
+  assert(stats);
+
+  *stats = ids->stats;
+}
+
+void K5_EXPORT
+k5_identities_free(k5_identities ids)
+{
+  if (!ids)
+    return ;
+  while (ids->head)
+    identity_remove(ids, ids->head, 1);
+  k5_free_context(ids->k5);
+  free(ids->table);
+  free(ids);
+}
@@ -50,7 +50,13 @@
 #include <assert.h>
 #include <stdio.h>
 
+#if defined(HAVE_KRB5_INIT_CONTEXT_PROFILE)
+#include <pthread.h>
+#include <profile.h>
+#endif
+
 #include "k5_priv.h"
+#include "k5_probes.h"
 
 static void
 k5_parse_ticket_flags(k5_ticket *ticket)
@@ -107,7 +113,34 @@ k5_parse_ticket_etypes(k5_ticket *ticket)
       sprintf(ticket->ticket_enc, "etype %d", enctype);
 }
 
+#if defined(HAVE_SYS_SDT_H) && defined(HAVE_KRB5_KDC_HOOKS)
+static krb5_error_code
+k5_kdc_send_hook(krb5_context ctx, void *data, const krb5_data *realm,
+		 const krb5_data *message, krb5_data **new_message_out,
+		 krb5_data **new_reply_out)
+{
+  k5_context k5 = data;
+
+  k5->kdc_start = k5_now();
+  K5_PROBE3(kdc__send, realm->data, realm->length, message->length);
+  return 0;
+}
+
 static krb5_error_code
+k5_kdc_recv_hook(krb5_context ctx, void *data, krb5_error_code code,
+		 const krb5_data *realm, const krb5_data *message,
+		 const krb5_data *reply, krb5_data **new_reply_out)
+{
+  k5_context k5 = data;
+
+  K5_PROBE5(kdc__recv, realm->data, realm->length, code,
+	    reply ? reply->length : 0, K5_PROBE_NS(k5->kdc_start));
+  /* Keep krb5's own result */
+  return code;
+}
+#endif
+
+krb5_error_code
 k5_parse_ticket(k5_context k5, krb5_creds *creds,
 		krb5_ticket *ticket, k5_ticket *t)
 {
@@ -116,12 +149,12 @@ k5_parse_ticket(k5_context k5, krb5_creds *creds,
 
   code = krb5_unparse_name(k5->ctx, creds->client, &name);
   if (code) {
-    com_err("k5_parse_ticket", code, "while unparsing client name");
+    k5_err(k5, "k5_parse_ticket", code, NULL, "while unparsing client name");
     return code;
   }
   code = krb5_unparse_name(k5->ctx, creds->server, &sname);
   if (code) {
-    com_err("k5_parse_ticket", code, "while unparsing server name");
+    k5_err(k5, "k5_parse_ticket", code, name, "while unparsing server name");
     krb5_free_unparsed_name(k5->ctx, name);
     return code;
   }
@@ -149,22 +182,153 @@ k5_parse_ticket(k5_context k5, krb5_creds *creds,
   return 0;
 }
 
+#if defined(HAVE_KRB5_INIT_CONTEXT_PROFILE)
+/*
+ * krb5_init_context() reads and parses krb5.conf and its includes every
+ * time. Contexts are created from one process-wide profile instead: the
+ * profile library shares the parsed files between the profiles opened on
+ * them as long as one of them lives, and only reads a file again once it
+ * changed. The profile is replaced when KRB5_CONFIG changes; references
+ * keep the old one alive until contexts being created from it are done.
+ */
+struct k5_profile {
+  int refs;
+  char *config;
+  profile_t profile;
+};
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct k5_profile *profile_shared;
+
+static void
+k5_profile_release(struct k5_profile *p)
+{
+  if (--p->refs)
+    return ;
+  profile_release(p->profile);
+  free(p->config);
+  free(p);
+}
+
+static krb5_error_code
+k5_profile_get(struct k5_profile **pp)
+{
+  const char *config = getenv("KRB5_CONFIG");
+  struct k5_profile *p;
+  krb5_error_code code = 0;
+  krb5_context ctx;
+
+  pthread_mutex_lock(&profile_lock);
+  p = profile_shared;
+  if (p && (config ? !p->config || strcmp(config, p->config) : !!p->config)) {
+    profile_shared = NULL;
+    k5_profile_release(p);
+    p = NULL;
+  }
+
+  if (!p) {
+    if (!(p = calloc(1, sizeof (*p))) ||
+	(config && !(p->config = strdup(config)))) {
+      code = ENOMEM;
+      goto cleanup;
+    }
+    if ((code = krb5_init_context(&ctx)))
+      goto cleanup;
+    code = krb5_get_profile(ctx, &p->profile);
+    krb5_free_context(ctx);
+    if (code)
+      goto cleanup;
+    /* The process' reference */
+    p->refs = 1;
+    profile_shared = p;
+  }
+
+  p->refs++;
+  *pp = p;
+  pthread_mutex_unlock(&profile_lock);
+  return 0;
+
+ cleanup:
+  if (p)
+    free(p->config);
+  free(p);
+  pthread_mutex_unlock(&profile_lock);
+  return code;
+}
+
+static krb5_error_code
+k5_profile_init_context(krb5_context *ctx, const k5_context_options *options)
+{
+  struct k5_profile *p;
+  profile_t overlay = NULL;
+  krb5_error_code code;
+
+  if ((code = k5_profile_get(&p)))
+    return code;
+  if (options)
+    code = k5_options_profile(p->profile, options, &overlay);
+  if (!code)
+    code = krb5_init_context_profile(overlay ? overlay : p->profile, 0, ctx);
+  if (overlay)
+    profile_release(overlay);
+  pthread_mutex_lock(&profile_lock);
+  k5_profile_release(p);
+  pthread_mutex_unlock(&profile_lock);
+  return code;
+}
+#endif
+
+/* The ccache is resolved on first use */
+krb5_error_code
+k5_cc_open(k5_context k5)
+{
+  krb5_error_code code = 0;
+
+  if (k5->cc)
+    return 0;
+
+  if (k5->cc_name) {
+    if ((code = krb5_cc_resolve(k5->ctx, k5->cc_name, &k5->cc)))
+      k5_err(k5, "k5_cc_open", code, k5->cc_name, "resolving ccache %s");
+  } else {
+    if ((code = krb5_cc_default(k5->ctx, &k5->cc)))
+      k5_err(k5, "k5_cc_open", code, NULL, "while getting default ccache");
+  }
+  return code;
+}
+
 /**
  * @fn krb5_error_code k5_init_context(k5_context *k5p, const char *cache)
  * @brief Initialize k5_context
  * @param k5p libk5 context
- * @param cache optional cache, set to NULL to use default
+ * @param cache optional cache, set to NULL to use default. "K5D:path"
+ * (or "K5D:" for the default path) gets tickets from k5d, see
+ * k5_agent_run(): they are copied into a MEMORY: ccache of the context.
+ * Other caches are resolved on first use, errors are reported then.
  * @return 0 on success; otherwise returns an error code
  * @sa k5_free_context
  */
 krb5_error_code K5_EXPORT
 k5_init_context(k5_context *k5p, const char *cache)
+{
+  return k5_init_context_ex(k5p, cache, NULL);
+}
+
+krb5_error_code K5_EXPORT
+k5_init_context_ex(k5_context *k5p, const char *cache,
+		   const k5_context_options *options)
 {
   krb5_error_code code = 0;
   k5_context k5;
 
   assert(k5p);
 
+#if !defined(HAVE_KRB5_INIT_CONTEXT_PROFILE)
+  /* Needs MIT krb5's profile_init_vtable() */
+  if (options)
+    return ENOSYS;
+#endif
+
   *k5p = malloc(sizeof (struct _k5_context));
   k5 = *k5p;
 
@@ -172,31 +336,44 @@ k5_init_context(k5_context *k5p, const char *cache)
     return ENOMEM;
 
   memset(k5, 0, sizeof (struct _k5_context));
+  k5->watch_fd = -1;
+  k5->agent_fd = -1;
 
+#if defined(HAVE_KRB5_INIT_CONTEXT_PROFILE)
+  code = k5_profile_init_context(&k5->ctx, options);
+#else
   code = krb5_init_context(&k5->ctx);
+#endif
 
   if (code)
     goto cleanup;
 
-  if (cache) {
-    if ((code = krb5_cc_resolve(k5->ctx, cache, &k5->cc))) {
-      com_err("k5_init_context", code, "resolving ccache %s", cache);
-      goto cleanup;
-    }
-  } else {
-    if ((code = krb5_cc_default(k5->ctx, &k5->cc))) {
-      com_err("k5_init_context", code, "while getting default ccache");
+#if defined(HAVE_SYS_SDT_H) && defined(HAVE_KRB5_KDC_HOOKS)
+  krb5_set_kdc_send_hook(k5->ctx, k5_kdc_send_hook, k5);
+  krb5_set_kdc_recv_hook(k5->ctx, k5_kdc_recv_hook, k5);
+#endif
+
+  if (cache && !strncmp(cache, "K5D:", 4)) {
+    if ((code = k5_agent_open(k5, cache + 4))) {
+      k5_err(k5, "k5_init_context", code, cache,
+	     "while connecting to k5d (%s)");
       goto cleanup;
     }
+  } else if (cache && !(k5->cc_name = strdup(cache))) {
+    code = ENOMEM;
+    goto cleanup;
   }
 
   return 0;
 
  cleanup:
+  if (k5->agent_path)
+    k5_agent_close(k5);
   if (k5->cc)
     krb5_cc_close(k5->ctx, k5->cc);
   if (k5->ctx)
     krb5_free_context(k5->ctx);
+  free(k5->cc_name);
   free(k5);
   return code;
 }
@@ -207,10 +384,24 @@ k5_free_context(k5_context k5)
   if (!k5)
     return 0;
 
+  k5_auto_renew_stop(k5);
+  k5_watch_close(k5);
+  /* Destroys the agent's memory ccache */
+  if (k5->agent_path)
+    k5_agent_close(k5);
   if (k5->cc)
     krb5_cc_close(k5->ctx, k5->cc);
+  k5_keytab_free(k5);
+  k5_keytab_index_free(k5);
+  free(k5->kt_default);
+  k5_rcache_free(k5);
+  k5_pac_cache_free(k5);
+  k5_tcache_free(k5);
+  k5_princ_cache_free(k5);
   if (k5->ctx)
     krb5_free_context(k5->ctx);
+  free(k5->trace);
+  free(k5->cc_name);
   free(k5);
   return 0;
 }
@@ -232,7 +423,9 @@ k5_kinit(k5_context k5, k5_kinit_req *req, k5_ticket *k5_ticket)
   krb5_ticket *ticket = NULL;
   krb5_get_init_creds_opt *options = NULL;
   krb5_principal me = NULL;
+  krb5_keytab keytab = NULL;
   char* name = NULL;
+  double start;
 
   /* Client creds.client field */
   memset(&creds, 0, sizeof(creds));
@@ -245,30 +438,50 @@ k5_kinit(k5_context k5, k5_kinit_req *req, k5_ticket *k5_ticket)
 	    req->service_name ? req->service_name : "<none>");
   }
 
+  K5_PROBE_CLOCK(entry);
+  K5_PROBE1(kinit__entry, req->principal_name);
+
+  if (k5->trace)
+    k5_span_begin(k5, req->action == K5_VALIDATE ? "validate" :
+		  req->action == K5_RENEW ? "renew" : "kinit",
+		  NULL, req->principal_name);
+
+  if ((code = k5_cc_open(k5)))
+    goto cleanup;
 
   if (req->principal_name)
     {
       /* Use specified name */
       if ((code = krb5_parse_name(k5->ctx, req->principal_name, &me))) {
-	com_err("k5_kinit", code, "when parsing name %s",
-		req->principal_name);
-	return code;
+	k5_err(k5, "k5_kinit", code, req->principal_name,
+	       "when parsing name %s");
+	goto cleanup;
+      }
+    }
+  else if (req->action == K5_KINIT_KEYTAB)
+    {
+      /* Like kinit -k, use host/<fqdn> */
+      if ((code = krb5_sname_to_principal(k5->ctx, NULL, "host",
+					  KRB5_NT_SRV_HST, &me))) {
+	k5_err(k5, "k5_kinit", code, NULL,
+	       "when creating default server principal name");
+	goto cleanup;
       }
     }
   else
     {
       /* Get default principal from cache if one exists */
       if ((code = krb5_cc_get_principal(k5->ctx, k5->cc, &me))) {
-	com_err("k5_kinit", code, "when parsing name %s",
-		req->principal_name);
-	return code;
+	k5_err(k5, "k5_kinit", code, req->principal_name,
+	       "when parsing name %s");
+	goto cleanup;
       }
     }
 
   code = krb5_unparse_name(k5->ctx, me, &name);
   if (code) {
-    com_err("k5_kinit", code, "when unparsing name");
-    return code;
+    k5_err(k5, "k5_kinit", code, req->principal_name, "when unparsing name");
+    goto cleanup;
   }
 
   code = krb5_get_init_creds_opt_alloc(k5->ctx, &options);
@@ -289,6 +502,7 @@ k5_kinit(k5_context k5, k5_kinit_req *req, k5_ticket *k5_ticket)
   if (req->not_proxiable)
     krb5_get_init_creds_opt_set_proxiable(options, 0);
 
+  start = k5_now();
   switch (req->action) {
   case K5_KINIT_PW:
     code = krb5_get_init_creds_password(k5->ctx, &creds, me,
@@ -305,48 +519,77 @@ k5_kinit(k5_context k5, k5_kinit_req *req, k5_ticket *k5_ticket)
     code = krb5_get_renewed_creds(k5->ctx, &creds, me, k5->cc,
 				  req->service_name);
     break;
+  case K5_KINIT_KEYTAB:
+    code = k5_keytab_get(k5, req, &keytab);
+    if (code) {
+      k5_err(k5, "k5_kinit", code, req->keytab_name, "while loading keytab %s");
+      goto cleanup;
+    }
+    code = krb5_get_init_creds_keytab(k5->ctx, &creds, me, keytab,
+				      req->starttime, req->service_name,
+				      options);
+    break;
   }
 
+  k5_stat_record(k5, req->action == K5_VALIDATE ? K5_STAT_VALIDATE :
+		 req->action == K5_RENEW ? K5_STAT_RENEW : K5_STAT_AS,
+		 start, code);
+
   if (code) {
-    char *doing = 0;
+    const char *doing = 0;
+    int bad_key = code == KRB5KRB_AP_ERR_BAD_INTEGRITY;
 
     switch (req->action) {
     case K5_KINIT_PW:
-      doing = "getting initial credentials";
+      doing = bad_key ?
+	"password incorrect while getting initial credentials for %s" :
+	"while getting initial credentials for %s";
       break;
     case K5_VALIDATE:
-      doing = "validating credentials";
+      doing = "while validating credentials for %s";
       break;
     case K5_RENEW:
-      doing = "renewing credentials";
+      doing = "while renewing credentials for %s";
+      break;
+    case K5_KINIT_KEYTAB:
+      doing = bad_key ?
+	"keytab key doesn't match while getting initial credentials for %s" :
+	"while getting initial credentials from keytab for %s";
       break;
     }
 
-    if (code == KRB5KRB_AP_ERR_BAD_INTEGRITY)
-      com_err("k5_kinit", EINVAL, "password incorrect while %s\n",
-	      doing);
-    else
-      com_err("k5_kinit", code, "while %s", doing);
+    k5_err(k5, "k5_kinit", code, name, doing);
     goto cleanup;
   }
 
+  if (k5->trace)
+    k5_span_event(k5, "Initializing ccache");
+  start = k5_now();
   code = krb5_cc_initialize(k5->ctx, k5->cc, me);
+  /* The client may have changed */
+  k5_princ_set_client(k5, NULL);
   if (code) {
-    com_err("k5_kinit", code, "when initializing cache");
+    k5_stat_record(k5, K5_STAT_CC_WRITE, start, code);
+    k5_err(k5, "k5_kinit", code, name, "when initializing cache");
     goto cleanup;
   }
 
   code = krb5_cc_store_cred(k5->ctx, k5->cc, &creds);
+  k5_stat_record(k5, K5_STAT_CC_WRITE, start, code);
   if (code) {
-    com_err("k5_kinit", code, "while storing credentials");
+    k5_err(k5, "k5_kinit", code, name, "while storing credentials");
     goto cleanup;
   }
+  if (k5->trace)
+    k5_span_event(k5, "Stored credentials");
+  if (k5->watch_fd >= 0)
+    k5_watch_update(k5, &creds);
 
   if (!k5_ticket)
     goto cleanup;
 
   if ((code = krb5_copy_creds(k5->ctx, &creds, &ccreds))) {
-    com_err("k5_kinit", code, "while copying credentials");
+    k5_err(k5, "k5_kinit", code, name, "while copying credentials");
     goto cleanup;
   }
 
@@ -372,15 +615,28 @@ k5_kinit(k5_context k5, k5_kinit_req *req, k5_ticket *k5_ticket)
     krb5_free_unparsed_name(k5->ctx, name);
   if (me)
     krb5_free_principal(k5->ctx, me);
+  if (k5->trace)
+    k5_span_end(k5, code);
+  K5_PROBE3(kinit__return, req->principal_name, code, K5_PROBE_NS(entry));
   return code;
 }
 
-#if defined(_WIN32)
+#if defined(_WIN32) || defined(K5_LAZY_GSSAPI)
 static gss_OID_desc gss_c_nt_hostbased_service =
     { 10, (void *) "\x2a\x86\x48\x86\xf7\x12\x01\x02\x01\x04" };
 #define GSS_C_NT_HOSTBASED_SERVICE &gss_c_nt_hostbased_service
 #endif
 
+#if defined(K5_LAZY_GSSAPI)
+#define gss_import_name (*k5_gss.import_name)
+#define gss_acquire_cred (*k5_gss.acquire_cred)
+#define gss_init_sec_context (*k5_gss.init_sec_context)
+#define gss_release_cred (*k5_gss.release_cred)
+#define gss_release_buffer (*k5_gss.release_buffer)
+#define gss_release_name (*k5_gss.release_name)
+#define gss_delete_sec_context (*k5_gss.delete_sec_context)
+#endif
+
 krb5_error_code K5_EXPORT
 k5_get_service_ticket_gss(k5_context k5, const char *service,
 			  const char *hostname,
@@ -395,12 +651,38 @@ k5_get_service_ticket_gss(k5_context k5, const char *service,
   gss_cred_id_t credh;
   char *name;
   gss_ctx_id_t ctx;
+  double start;
 
   assert(service);
   assert(ticket);
 
-  if ((code = k5_get_service_ticket(k5, service, hostname, ticket)))
+  K5_PROBE_CLOCK(entry);
+  K5_PROBE2(gss__entry, service, hostname);
+
+  if (k5->trace)
+    k5_span_begin(k5, "gss", service, hostname);
+
+#if defined(K5_LAZY_GSSAPI)
+  if ((code = k5_gss_load())) {
+    k5_err(k5, "k5_get_service_ticket_gss", code, K5_GSSAPI_LIBRARY,
+	   "while loading %s");
+    if (k5->trace)
+      k5_span_end(k5, code);
+    K5_PROBE4(gss__return, service, hostname, code, K5_PROBE_NS(entry));
+    return code;
+  }
+#endif
+
+  if ((code = k5_get_service_ticket(k5, service, hostname, ticket))) {
+    if (k5->trace)
+      k5_span_end(k5, code);
+    K5_PROBE4(gss__return, service, hostname, code, K5_PROBE_NS(entry));
     return code;
+  }
+
+  start = k5_now();
+  if (k5->trace)
+    k5_span_event(k5, "Initializing GSS context");
 
   name = malloc(strlen(service) + strlen(hostname) + 2);
   if (!name) {
@@ -459,9 +741,12 @@ k5_get_service_ticket_gss(k5_context k5, const char *service,
   }
 
   memcpy(ticket->gss_data, otoken.value, otoken.length);
+  if (k5->trace)
+    k5_span_event(k5, "Encoding GSS token in base64");
   k5_b64enc_ticket(ticket);
 
  cleanup:
+   k5_stat_record(k5, K5_STAT_GSS, start, code);
    if (code) {
      k5_clear_ticket(k5, ticket);
    }
@@ -471,32 +756,98 @@ k5_get_service_ticket_gss(k5_context k5, const char *service,
    gss_delete_sec_context(&min, &ctx, GSS_C_NO_BUFFER);
 
    free(name);
+   if (k5->trace)
+     k5_span_end(k5, code);
+   K5_PROBE4(gss__return, service, hostname, code, K5_PROBE_NS(entry));
    return code;
 }
 
+/*
+ * With a shared ticket cache or k5d: the ccache first, then the shared
+ * cache, then k5d or else the KDC. Tickets from the KDC are shared,
+ * tickets from the shared cache or k5d go to the ccache.
+ */
+static krb5_error_code
+k5_get_credentials_shared(k5_context k5, krb5_creds *in_creds,
+			  const char *server, krb5_creds **out_creds)
+{
+  krb5_error_code code;
+  char *client = NULL;
+
+  code = krb5_get_credentials(k5->ctx, KRB5_GC_CACHED, k5->cc, in_creds,
+			      out_creds);
+  if (code != KRB5_CC_NOTFOUND)
+    return code;
+
+  if ((code = krb5_unparse_name(k5->ctx, in_creds->client, &client)))
+    return code;
+
+  if (k5->tcache && !k5_tcache_get(k5, client, server, out_creds)) {
+    if (k5->trace)
+      k5_span_event(k5, "Found in shared ticket cache");
+    krb5_cc_store_cred(k5->ctx, k5->cc, *out_creds);
+  } else if (k5->agent_path) {
+    code = k5_agent_get(k5, server, out_creds);
+    if (!code && k5->tcache)
+      k5_tcache_put(k5, client, server, *out_creds);
+  } else {
+    code = krb5_get_credentials(k5->ctx, 0, k5->cc, in_creds, out_creds);
+    if (!code)
+      k5_tcache_put(k5, client, server, *out_creds);
+  }
+
+  krb5_free_unparsed_name(k5->ctx, client);
+  return code;
+}
+
 static krb5_error_code
 k5_get_service_ticket_internal(k5_context k5, const char *service,
 		      const char *hostname, k5_ticket *k5_ticket)
 {
   krb5_error_code code = 0;
-  krb5_principal me;
+  krb5_principal me = NULL;
   krb5_creds in_creds, *out_creds = NULL;
   krb5_ticket *ticket = NULL;
   char *princ = NULL;
+  double start;
+  /* Set when me, or in_creds.server and princ, belong to the cache */
+  int client_cached = 0, server_cached = 0;
 
   assert(k5);
   assert(hostname);
 
-  code = krb5_cc_get_principal(k5->ctx, k5->cc, &me);
-  if (code) {
-    com_err("k5_get_service_ticket", code, "while getting client principal name");
-    return code;
+  K5_PROBE_CLOCK(entry);
+  K5_PROBE2(service_internal__entry, service, hostname);
+
+  if (k5->princ_cache && !k5_princ_client(k5, &me)) {
+    client_cached = 1;
+  } else {
+    start = k5_now();
+    code = krb5_cc_get_principal(k5->ctx, k5->cc, &me);
+    k5_stat_record(k5, K5_STAT_CC_READ, start, code);
+    if (code) {
+      k5_err(k5, "k5_get_service_ticket", code, hostname,
+	     "while getting client principal name");
+      K5_PROBE4(service_internal__return, service, hostname, code,
+		K5_PROBE_NS(entry));
+      return code;
+    }
+    if (k5->princ_cache) {
+      k5_princ_set_client(k5, me);
+      client_cached = 1;
+    }
   }
 
   memset(&in_creds, 0, sizeof(in_creds));
   in_creds.client = me;
   in_creds.keyblock.enctype = 0;
 
+  if (k5->princ_cache &&
+      !k5_princ_find(k5, service, hostname, &in_creds.server, &princ)) {
+    server_cached = 1;
+    goto resolved;
+  }
+
   if (service != NULL) {
     code = krb5_sname_to_principal(k5->ctx, hostname,
 				   service, KRB5_NT_SRV_HST,
@@ -506,28 +857,40 @@ k5_get_service_ticket_internal(k5_context k5, const char *service,
   }
 
   if (code) {
-    com_err("k5_get_service_ticket", code, "while parsing principal name %s",
-	    hostname);
+    k5_err(k5, "k5_get_service_ticket", code, hostname,
+	   "while parsing principal name %s");
     goto cleanup;
   }
 
   code = krb5_unparse_name(k5->ctx, in_creds.server, &princ);
 
   if (code) {
-    com_err("k5_get_service_ticket", code,
-	    "while formatting parsed principal name for '%s'",
-	    hostname);
+    k5_err(k5, "k5_get_service_ticket", code, hostname,
+	   "while formatting parsed principal name for '%s'");
     goto cleanup;
   }
 
-  code = krb5_get_credentials(k5->ctx, 0, k5->cc, &in_creds, &out_creds);
+  if (k5->princ_cache &&
+      !k5_princ_add(k5, service, hostname, in_creds.server, princ))
+    server_cached = 1;
+
+ resolved:
+  start = k5_now();
+  if (k5->tcache || k5->agent_path)
+    code = k5_get_credentials_shared(k5, &in_creds, princ, &out_creds);
+  else
+    code = krb5_get_credentials(k5->ctx, 0, k5->cc, &in_creds, &out_creds);
+  k5_stat_record(k5, K5_STAT_TGS, start, code);
 
   if (code) {
-    com_err("k5_get_service_ticket", code, "while getting credentials for %s",
-	    princ);
+    k5_err(k5, "k5_get_service_ticket", code, princ,
+	   "while getting credentials for %s");
     goto cleanup;
   }
 
+  if (k5->watch_fd >= 0)
+    k5_watch_update(k5, out_creds);
+
   if (!k5_ticket)
     goto cleanup;
 
@@ -537,9 +900,14 @@ k5_get_service_ticket_internal(k5_context k5, const char *service,
   if ((code = k5_parse_ticket(k5, out_creds, ticket, k5_ticket)))
     goto cleanup;
 
-  krb5_free_principal(k5->ctx, in_creds.server);
-  krb5_free_unparsed_name(k5->ctx, princ);
-  krb5_free_principal(k5->ctx, me);
+  if (!server_cached) {
+    krb5_free_principal(k5->ctx, in_creds.server);
+    krb5_free_unparsed_name(k5->ctx, princ);
+  }
+  if (!client_cached)
+    krb5_free_principal(k5->ctx, me);
+  K5_PROBE4(service_internal__return, service, hostname, code,
+	    K5_PROBE_NS(entry));
   return code;
 
  cleanup:
@@ -547,13 +915,15 @@ k5_get_service_ticket_internal(k5_context k5, const char *service,
     krb5_free_ticket(k5->ctx, ticket);
   if (out_creds)
     krb5_free_creds(k5->ctx, out_creds);
-  if (in_creds.server)
+  if (in_creds.server && !server_cached)
     krb5_free_principal(k5->ctx, in_creds.server);
-  if (princ)
+  if (princ && !server_cached)
     krb5_free_unparsed_name(k5->ctx, princ);
-  if (me)
+  if (me && !client_cached)
     krb5_free_principal(k5->ctx, me);
 
+  K5_PROBE4(service_internal__return, service, hostname, code,
+	    K5_PROBE_NS(entry));
   return code;
 }
 
@@ -570,10 +940,19 @@ k5_get_service_ticket(k5_context k5, const char *service,
   assert(k5);
   assert(hostname);
 
+  K5_PROBE_CLOCK(entry);
+  K5_PROBE2(service__entry, service, hostname);
+
+  if (k5->trace)
+    k5_span_begin(k5, "service", service, hostname);
+
+  if ((code = k5_cc_open(k5)))
+    goto cleanup;
+
   /* First, try like the used asked us */
   code = k5_get_service_ticket_internal(k5, service, hostname, k5_ticket);
   if (!code)
-    return code;
+    goto cleanup;
 
   /*
    * if it fails, try to append default principal's realm
@@ -586,17 +965,18 @@ k5_get_service_ticket(k5_context k5, const char *service,
    * don't try to append realm
    */
   if (!service)
-    return code;
+    goto cleanup;
 
   code = krb5_cc_get_principal(k5->ctx, k5->cc, &me);
   if (code) {
-    com_err("k5_get_service_ticket", code, "while getting client principal name");
-    return code;
+    k5_err(k5, "k5_get_service_ticket", code, hostname,
+	   "while getting client principal name");
+    goto cleanup;
   }
 
   /* Check that we can really try to append the realm */
   if (!krb5_princ_realm(k5->ctx, me)->length)
-    return code;
+    goto cleanup;
   len = strlen(service) + strlen("/") + strlen(hostname) + strlen("@") +
         krb5_princ_realm(k5->ctx, me)->length + 1;
   sname = malloc(len);
@@ -611,11 +991,16 @@ k5_get_service_ticket(k5_context k5, const char *service,
   strncat(sname, krb5_princ_realm(k5->ctx, me)->data,
           krb5_princ_realm(k5->ctx, me)->length);
 
+  if (k5->trace)
+    k5_span_event(k5, "Retrying with the client realm");
   code = k5_get_service_ticket_internal(k5, NULL, sname, k5_ticket);
 cleanup:
   if (me)
     krb5_free_principal(k5->ctx, me);
   free(sname);
+  if (k5->trace)
+    k5_span_end(k5, code);
+  K5_PROBE4(service__return, service, hostname, code, K5_PROBE_NS(entry));
   return code;
 }
 
@@ -628,41 +1013,49 @@ k5_klist(k5_context k5, k5_klist_entries *rep)
   krb5_flags flags;
   krb5_error_code code;
   char *defname = NULL;
+  double start;
 
   assert(k5);
   assert(k5->ctx);
-  assert(k5->cc);
   assert(rep);
 
   memset(rep, 0, sizeof (*rep));
+  if ((code = k5_cc_open(k5)))
+    return code;
+  start = k5_now();
+  /* The agent has the tickets */
+  if (k5->agent_path && (code = k5_agent_sync(k5))) {
+    k5_err(k5, "k5_klist", code, NULL, "while listing k5d tickets");
+    return code;
+  }
+  K5_PROBE1(klist__entry, krb5_cc_get_name(k5->ctx, k5->cc));
+  if (k5->trace)
+    k5_span_begin(k5, "klist", NULL, krb5_cc_get_name(k5->ctx, k5->cc));
 
   flags = 0;				/* turns off OPENCLOSE mode */
   if ((code = krb5_cc_set_flags(k5->ctx, k5->cc, flags))) {
     if (code == KRB5_FCC_NOFILE) {
-      com_err("k5_klist", code, "(ticket cache %s:%s)",
-	      krb5_cc_get_type(k5->ctx, k5->cc),
-	      krb5_cc_get_name(k5->ctx, k5->cc));
+      k5_err(k5, "k5_klist", code, krb5_cc_get_name(k5->ctx, k5->cc),
+	     "(ticket cache %s)");
     } else {
-      com_err("k5_klist", code,
-	      "while setting cache flags (ticket cache %s:%s)",
-	      krb5_cc_get_type(k5->ctx, k5->cc),
-	      krb5_cc_get_name(k5->ctx, k5->cc));
+      k5_err(k5, "k5_klist", code, krb5_cc_get_name(k5->ctx, k5->cc),
+	     "while setting cache flags (ticket cache %s)");
     }
     goto cleanup;
   }
 
   if ((code = krb5_cc_get_principal(k5->ctx, k5->cc, &princ))) {
-    com_err("k5_klist", code, "while retrieving principal name");
+    k5_err(k5, "k5_klist", code, defname, "while retrieving principal name");
     goto cleanup;
   }
 
   if ((code = krb5_unparse_name(k5->ctx, princ, &defname))) {
-    com_err("k5_klist", code, "while unparsing principal name");
+    k5_err(k5, "k5_klist", code, defname, "while unparsing principal name");
     goto cleanup;
   }
 
   if ((code = krb5_cc_start_seq_get(k5->ctx, k5->cc, &cur))) {
-    com_err("k5_klist", code, "while starting to retrieve tickets");
+    k5_err(k5, "k5_klist", code, defname, "while starting to retrieve tickets");
     goto cleanup;
   }
 
@@ -675,12 +1068,12 @@ k5_klist(k5_context k5, k5_klist_entries *rep)
 
     if ((code = krb5_copy_creds(k5->ctx, &creds, &ccreds))) {
       krb5_free_cred_contents(k5->ctx, &creds);
-      com_err("k5_klist", code, "while copying creds");
+      k5_err(k5, "k5_klist", code, defname, "while copying creds");
       continue ;
     }
 
     if ((code = krb5_decode_ticket(&ccreds->ticket, &ticket))) {
-      com_err("k5_klist", code, "while decoding ticket");
+      k5_err(k5, "k5_klist", code, defname, "while decoding ticket");
       krb5_free_creds(k5->ctx, ccreds);
       krb5_free_cred_contents(k5->ctx, &creds);
       continue ;
@@ -693,22 +1086,23 @@ k5_klist(k5_context k5, k5_klist_entries *rep)
 
   if (code == KRB5_CC_END) {
     if ((code = krb5_cc_end_seq_get(k5->ctx, k5->cc, &cur))) {
-      com_err("k5_klist", code, "while finishing ticket retrieval");
+      k5_err(k5, "k5_klist", code, defname, "while finishing ticket retrieval");
       goto cleanup;
     }
     flags = KRB5_TC_OPENCLOSE;	/* turns on OPENCLOSE mode */
     if ((code = krb5_cc_set_flags(k5->ctx, k5->cc, flags))) {
-      com_err("k5_klist", code, "while closing ccache");
+      k5_err(k5, "k5_klist", code, defname, "while closing ccache");
       goto cleanup;
     }
   } else {
-    com_err("k5_klist", code, "while retrieving a ticket");
+    k5_err(k5, "k5_klist", code, defname, "while retrieving a ticket");
     goto cleanup;
   }
 
   rep->defname = strdup(defname);
 
  cleanup:
+  k5_stat_record(k5, K5_STAT_KLIST, start, code);
   if (defname)
     krb5_free_unparsed_name(k5->ctx, defname);
   if (princ)
@@ -717,6 +1111,10 @@ k5_klist(k5_context k5, k5_klist_entries *rep)
   if (code)
     k5_clear_klist(k5, rep);
 
+  if (k5->trace)
+    k5_span_end(k5, code);
+  K5_PROBE4(klist__return, krb5_cc_get_name(k5->ctx, k5->cc), code,
+	    K5_PROBE_NS(start), rep->count);
   return code;
 }
 
@@ -727,11 +1125,12 @@ k5_kdestroy(k5_context k5)
 
   assert(k5);
   assert(k5->ctx);
-  assert(k5->cc);
 
+  if ((code = k5_cc_open(k5)))
+    return code;
   code = krb5_cc_destroy (k5->ctx, k5->cc);
   if (code != 0) {
-    com_err ("k5_kdestroy", code, "while destroying cache");
+    k5_err(k5, "k5_kdestroy", code, NULL, "while destroying cache");
     if (code != KRB5_FCC_NOFILE) {
       if (k5->verbose)
 	fprintf(stderr, "Ticket cache NOT destroyed!\n");
@@ -739,6 +1138,7 @@ k5_kdestroy(k5_context k5)
   }
 
   k5->cc = NULL;
+  k5_princ_set_client(k5, NULL);
 
   return code;
 }
@@ -748,7 +1148,6 @@ k5_clear_ticket(k5_context k5, k5_ticket *ticket)
 {
   assert(k5);
   assert(k5->ctx);
-  assert(k5->cc);
 
   if (!ticket)
     return 0;
@@ -772,7 +1171,6 @@ k5_clear_klist(k5_context k5, k5_klist_entries *klist)
 
   assert(k5);
   assert(k5->ctx);
-  assert(k5->cc);
 
   if (!klist)
     return 0;
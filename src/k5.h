@@ -43,6 +43,7 @@
 #endif
 
 
+#include <stdio.h>
 #include <krb5/krb5.h>
 
 /**
@@ -157,6 +158,7 @@ enum k5_kinit_action {
   K5_KINIT_PW, /**< Init with password */
   K5_VALIDATE, /**< Validate */
   K5_RENEW,    /**> Renew */
+  K5_KINIT_KEYTAB, /**< Init with a keytab */
 };
 
 /**
@@ -209,11 +211,331 @@ typedef struct _k5_kinit_req {
    * Set to NULL to use default prompter
    */
   krb5_prompter_fct prompter;
+  /**
+   * Keytab name for K5_KINIT_KEYTAB, NULL for the context's keytab
+   * (see k5_set_keytab()) or the default keytab.
+   * It is read once and kept by the context, FILE: keytabs are read
+   * again when they change.
+   */
+  char *keytab_name;
+  /**
+   * Optional keytab file contents for K5_KINIT_KEYTAB, used instead
+   * of keytab_name. Loaded into a MEMORY: keytab kept by the context.
+   */
+  const void *keytab_data;
+  /**
+   * keytab_data size
+   */
+  size_t keytab_size;
 } k5_kinit_req;
 
+/**
+ * @brief Operations tracked by k5_get_stats()
+ */
+enum k5_stat_op {
+  K5_STAT_AS,       /**< Initial credentials (AS exchange) */
+  K5_STAT_TGS,      /**< Service tickets (TGS exchange or cache hit) */
+  K5_STAT_RENEW,    /**< TGT renewal */
+  K5_STAT_VALIDATE, /**< TGT validation */
+  K5_STAT_KLIST,    /**< k5_klist() */
+  K5_STAT_CC_READ,  /**< Credential cache reads */
+  K5_STAT_CC_WRITE, /**< Credential cache writes */
+  K5_STAT_GSS,      /**< GSS token generation */
+  K5_STAT_ACCEPT,   /**< AP-REQ verification, k5_accept() */
+  K5_STAT_MAX
+};
+
+/**
+ * Number of latency buckets, the last one is +Inf
+ * @sa k5_stats_bucket_bound
+ */
+#define K5_STAT_BUCKETS 12
+
+/**
+ * Number of distinct error codes counted in k5_stats
+ */
+#define K5_STAT_ERRORS 16
+
+/**
+ * @brief Counters and latency histogram of one operation
+ */
+typedef struct _k5_stat_counter {
+  /**
+   * Successful calls
+   */
+  unsigned long success;
+  /**
+   * Failed calls
+   */
+  unsigned long failure;
+  /**
+   * Total time spent, in seconds
+   */
+  double sum;
+  /**
+   * Calls per latency bucket (not cumulative)
+   */
+  unsigned long buckets[K5_STAT_BUCKETS];
+} k5_stat_counter;
+
+/**
+ * @brief Error count
+ */
+typedef struct _k5_stat_error {
+  /**
+   * Error code
+   */
+  krb5_error_code code;
+  /**
+   * Number of times it was returned
+   */
+  unsigned long count;
+} k5_stat_error;
+
+/**
+ * @brief Per context statistics
+ */
+typedef struct _k5_stats {
+  /**
+   * Counters, indexed by enum k5_stat_op
+   */
+  k5_stat_counter ops[K5_STAT_MAX];
+  /**
+   * Errors by code, unused entries have a zero count
+   */
+  k5_stat_error errors[K5_STAT_ERRORS];
+  /**
+   * Errors that didn't fit in errors
+   */
+  unsigned long other_errors;
+} k5_stats;
+
+/**
+ * Maximum number of events recorded per trace span
+ */
+#define K5_TRACE_EVENTS 32
+
+/**
+ * Maximum length of trace event messages and principals, including the nul
+ */
+#define K5_TRACE_MESSAGE 128
+
+/**
+ * @brief Timestamped event of a trace span
+ */
+typedef struct _k5_trace_event {
+  /**
+   * Seconds since the beginning of the span
+   */
+  double offset;
+  /**
+   * krb5 trace message, truncated
+   */
+  char message[K5_TRACE_MESSAGE];
+} k5_trace_event;
+
+/**
+ * @brief Trace of one libk5 call
+ * @sa k5_set_trace
+ */
+typedef struct _k5_trace_span {
+  /**
+   * Span number, starting at 0
+   */
+  unsigned long id;
+  /**
+   * Operation (kinit, service, gss, klist)
+   */
+  const char *op;
+  /**
+   * Client or service principal, or cache name for klist
+   */
+  char principal[K5_TRACE_MESSAGE];
+  /**
+   * Start time, monotonic clock in seconds
+   */
+  double start;
+  /**
+   * Duration in seconds
+   */
+  double elapsed;
+  /**
+   * Returned error code
+   */
+  krb5_error_code code;
+  /**
+   * Number of events
+   */
+  int count;
+  /**
+   * Events that didn't fit in events
+   */
+  int dropped;
+  /**
+   * Events, in order
+   */
+  k5_trace_event events[K5_TRACE_EVENTS];
+} k5_trace_span;
+
+/**
+ * Maximum length of k5_last_error principals, including the nul
+ */
+#define K5_ERROR_PRINCIPAL 256
+
+/**
+ * @brief Last error of a context
+ * @sa k5_get_last_error
+ */
+typedef struct _k5_last_error {
+  /**
+   * Error code, 0 if no error was recorded
+   */
+  krb5_error_code code;
+  /**
+   * Failed operation (k5_kinit, k5_klist, ...)
+   */
+  const char *op;
+  /**
+   * Principal, service or cache the operation was about, may be empty
+   */
+  char principal[K5_ERROR_PRINCIPAL];
+  /**
+   * What was being done, %s stands for principal.
+   * Use k5_last_error_message() to get the whole message.
+   */
+  const char *format;
+} k5_last_error;
+
+/**
+ * @brief Authorization data of a Windows PAC
+ *
+ * Only groups with SE_GROUP_ENABLED are listed. Read only, shared
+ * between the results of k5_accept() for the same ticket.
+ */
+typedef struct _k5_pac {
+  /**
+   * Domain SID, S-1-5-21-...
+   */
+  const char *domain_sid;
+  /**
+   * User RID in domain_sid
+   */
+  unsigned int user_rid;
+  /**
+   * Primary group RID in domain_sid
+   */
+  unsigned int primary_group_rid;
+  /**
+   * Group RIDs in domain_sid, sorted, without duplicates, including
+   * the primary group. See k5_pac_has_group().
+   */
+  unsigned int *groups;
+  /**
+   * Number of groups
+   */
+  int group_count;
+  /**
+   * Other group SIDs (extra SIDs and resource groups), sorted with
+   * strcmp(), without duplicates
+   */
+  char **sids;
+  /**
+   * Number of sids
+   */
+  int sid_count;
+} k5_pac;
+
+/**
+ * @brief Result of k5_accept()
+ */
+typedef struct _k5_accepted {
+  /**
+   * The client's ticket: client and server names, times, flags and
+   * encryption types. data isn't set.
+   */
+  k5_ticket ticket;
+  /**
+   * Set if the client asked for mutual authentication
+   */
+  int mutual;
+  /**
+   * Reply to send back to the client, framed like the request (raw
+   * AP-REP, GSS token or SPNEGO NegTokenResp). NULL if there is none.
+   */
+  char *token;
+  /**
+   * Reply size
+   */
+  size_t token_size;
+  /**
+   * Verified PAC of the ticket, NULL if there is none or if PAC
+   * decoding is off (see k5_set_pac_cache())
+   */
+  const k5_pac *pac;
+} k5_accepted;
+
 krb5_error_code K5_EXPORT
 k5_init_context(k5_context *k5, const char *cache);
 
+/**
+ * @brief Boolean krb5.conf setting in k5_context_options
+ */
+enum k5_option {
+  K5_OPTION_DEFAULT,  /**< As set in krb5.conf */
+  K5_OPTION_TRUE,     /**< true */
+  K5_OPTION_FALSE,    /**< false */
+  K5_OPTION_FALLBACK  /**< fallback, dns_canonicalize_hostname only */
+};
+
+/**
+ * @brief krb5.conf [libdefaults] settings for one context
+ *
+ * Zero (memset()) keeps krb5.conf's value for every field.
+ */
+typedef struct _k5_context_options {
+  /**
+   * Canonicalize host names with DNS before building service principals
+   */
+  enum k5_option dns_canonicalize_hostname;
+  /**
+   * Reverse DNS lookups while canonicalizing (true or false)
+   */
+  enum k5_option rdns;
+  /**
+   * Messages larger than this go over TCP, 1 to always use TCP, 0 for
+   * the default
+   */
+  int udp_preference_limit;
+  /**
+   * Seconds to wait for the KDCs (request_timeout with MIT krb5, which
+   * bounds the whole request), 0 for the default
+   */
+  int kdc_timeout;
+  /**
+   * Default ccache: a type (FILE, DIR, KEYRING, KCM or MEMORY) for its
+   * usual name, or a full ccache name. NULL for the default.
+   * KRB5CCNAME still takes precedence.
+   */
+  const char *ccache_type;
+} k5_context_options;
+
+/**
+ * @brief Initialize k5_context with its own krb5.conf settings
+ *
+ * options are layered in memory over krb5.conf, which is left alone,
+ * so each application can tune DNS use and KDC timeouts.
+ * @param k5 libk5 context
+ * @param cache optional cache, see k5_init_context()
+ * @param options settings, copied. NULL for krb5.conf's.
+ * @return 0 on success, EINVAL for an invalid option, ENOSYS when
+ * options are not supported by the krb5 library; otherwise returns an
+ * error code
+ * @sa k5_init_context
+ */
+krb5_error_code K5_EXPORT
+k5_init_context_ex(k5_context *k5, const char *cache,
+		   const k5_context_options *options);
+
 /**
  * @brief Free k5_context
  * @param k5 libk5 context
@@ -231,6 +553,35 @@ k5_free_context(k5_context k5);
 void K5_EXPORT
 k5_set_verbose(k5_context k5, int enabled);
 
+/**
+ * @brief Don't report errors on stderr
+ *
+ * By default, errors are reported with com_err(). In quiet mode, they
+ * are only recorded in the context, see k5_get_last_error().
+ * @param k5 libk5 context
+ * @param enabled enable quiet mode
+ */
+void K5_EXPORT
+k5_set_quiet(k5_context k5, int enabled);
+
+/**
+ * @brief Get the last error recorded on this context
+ * @param k5 libk5 context
+ * @return last error, valid until the context is freed
+ * @sa k5_last_error_message
+ */
+const k5_last_error K5_EXPORT *
+k5_get_last_error(k5_context k5);
+
+/**
+ * @brief Format the last error, like com_err() would have
+ * @param k5 libk5 context
+ * @return message, valid until the next libk5 call on this context
+ * @sa k5_get_last_error
+ */
+const char K5_EXPORT *
+k5_last_error_message(k5_context k5);
+
 /**
  * @brief Request a ticket
  * @param k5 libk5 context
@@ -307,6 +658,586 @@ k5_clear_ticket(k5_context k5, k5_ticket *ticket);
 krb5_error_code K5_EXPORT
 k5_clear_klist(k5_context k5, k5_klist_entries *klist);
 
+/**
+ * @brief Get a copy of the context statistics
+ * @param k5 libk5 context
+ * @param stats filled with the current statistics
+ * @return 0 on success; otherwise returns an error code
+ * @sa k5_reset_stats
+ */
+krb5_error_code K5_EXPORT
+k5_get_stats(k5_context k5, k5_stats *stats);
+
+/**
+ * @brief Reset the context statistics
+ * @param k5 libk5 context
+ */
+void K5_EXPORT
+k5_reset_stats(k5_context k5);
+
+/**
+ * @brief Upper bound of a latency bucket
+ * @param bucket bucket index, 0 to K5_STAT_BUCKETS - 1
+ * @return bound in seconds, or a negative value for the +Inf bucket
+ */
+double K5_EXPORT
+k5_stats_bucket_bound(int bucket);
+
+/**
+ * @brief Render the context statistics in Prometheus text format
+ * @param k5 libk5 context
+ * @param out malloc()ed, nul terminated text, to be free()d by the caller
+ * @return 0 on success; otherwise returns an error code
+ * @sa k5_get_stats
+ */
+krb5_error_code K5_EXPORT
+k5_stats_prometheus(k5_context k5, char **out);
+
+/**
+ * @brief Set the context's keytab
+ *
+ * Used by k5_accept(), and by K5_KINIT_KEYTAB requests without a keytab.
+ * The keytab is read once and kept by the context, FILE: keytabs are
+ * read again when they change. For k5_accept(), FILE: keytabs are
+ * indexed by principal, kvno and enctype; a new index replaces the old
+ * one without blocking verifications in progress.
+ * @param k5 libk5 context
+ * @param name keytab name, NULL for the default keytab
+ * @return 0 on success; otherwise returns an error code
+ */
+krb5_error_code K5_EXPORT
+k5_set_keytab(k5_context k5, const char *name);
+
+/**
+ * @brief Verify a client's AP-REQ
+ *
+ * token is a raw AP-REQ, a GSS krb5 initial context token or a SPNEGO
+ * NegTokenInit carrying one. It is checked against the context's keytab,
+ * for any principal found in it. No GSS security context is established.
+ * @param k5 libk5 context
+ * @param token token sent by the client
+ * @param len token size
+ * @param out accepted ticket and reply, free with k5_clear_accepted()
+ * @return 0 on success; otherwise returns an error code
+ * @sa k5_set_keytab
+ */
+krb5_error_code K5_EXPORT
+k5_accept(k5_context k5, const void *token, size_t len, k5_accepted *out);
+
+/**
+ * @brief Pool of acceptor threads
+ * @sa k5_accept_pool_create
+ */
+typedef struct _k5_accept_pool * k5_accept_pool;
+
+/**
+ * @brief Per thread counters of an acceptor pool
+ * @sa k5_accept_pool_stats
+ */
+typedef struct _k5_accept_worker_stats {
+  /**
+   * Tokens accepted
+   */
+  unsigned long accepted;
+  /**
+   * Tokens refused
+   */
+  unsigned long failed;
+  /**
+   * Seconds spent on batches
+   */
+  double busy;
+  /**
+   * CPU seconds used on batches. (accepted + failed) / cpu is the
+   * throughput of one core.
+   */
+  double cpu;
+} k5_accept_worker_stats;
+
+/**
+ * @brief Start a pool of threads verifying AP-REQs in batches
+ *
+ * Each thread has its own krb5 context. They share the keytab of k5,
+ * loaded once by k5 (see k5_set_keytab()), and its replay cache. k5
+ * must not be used by another thread during k5_accept_batch().
+ * @param k5 libk5 context
+ * @param threads number of threads, 0 for one per online CPU
+ * @param pool new pool, free with k5_accept_pool_free()
+ * @return 0 on success, ENOSYS when not supported; otherwise returns an
+ * error code
+ */
+krb5_error_code K5_EXPORT
+k5_accept_pool_create(k5_context k5, int threads, k5_accept_pool *pool);
+
+/**
+ * @brief Verify tokens with the pool's threads, like k5_accept()
+ *
+ * Returns once every token is done. Batches from several threads are
+ * run one after the other.
+ * @param pool acceptor pool
+ * @param tokens tokens sent by the clients
+ * @param lens token sizes
+ * @param n number of tokens
+ * @param out results, out[i] for tokens[i]; free each one with
+ * k5_clear_accepted()
+ * @param codes optional, codes[i] is what k5_accept() would have
+ * returned for tokens[i]
+ * @return 0 on success, even if some tokens were refused; otherwise
+ * returns an error code
+ */
+krb5_error_code K5_EXPORT
+k5_accept_batch(k5_accept_pool pool, const void *const *tokens,
+		const size_t *lens, int n, k5_accepted *out,
+		krb5_error_code *codes);
+
+/**
+ * @brief Get per thread counters
+ * @param pool acceptor pool
+ * @param stats one entry per thread
+ * @param n size of stats
+ * @return number of entries filled
+ */
+int K5_EXPORT
+k5_accept_pool_stats(k5_accept_pool pool, k5_accept_worker_stats *stats,
+		     int n);
+
+/**
+ * @brief Stop the pool's threads and free it
+ * @param pool acceptor pool
+ */
+void K5_EXPORT
+k5_accept_pool_free(k5_accept_pool pool);
+
+/**
+ * @brief Replay cache types for k5_set_replay_cache()
+ */
+enum k5_rcache_type {
+  /**
+   * krb5's own replay cache (krb5_get_server_rcache()), opened for each
+   * k5_accept()
+   */
+  K5_RCACHE_DEFAULT,
+  K5_RCACHE_MEMORY,  /**< In memory, shared by the process' contexts */
+  K5_RCACHE_SHARED   /**< In a shared memory segment, across processes */
+};
+
+/**
+ * @brief Choose the replay cache used by k5_accept()
+ *
+ * The memory caches are lock free hash tables of fixed size, keyed by a
+ * hash of the authenticator. Entries expire with the clock skew. When
+ * the entries for a hash are all taken, the authenticator is refused
+ * with KRB5_RC_IO_SPACE until some expire, so size them for the
+ * expected number of authentications per clock skew (8 bytes each).
+ * A shared segment must belong to the caller and be closed to other
+ * users, or it is refused with EACCES.
+ * @param k5 libk5 context
+ * @param type replay cache type
+ * @param name shared memory name (shm_open()) for K5_RCACHE_SHARED
+ * @param size memory budget in bytes, 0 for 4 MB. K5_RCACHE_MEMORY
+ * uses the size of the first call; a shared segment keeps the size
+ * it was created with.
+ * @return 0 on success; otherwise returns an error code
+ * @sa k5_accept
+ */
+krb5_error_code K5_EXPORT
+k5_set_replay_cache(k5_context k5, enum k5_rcache_type type,
+		    const char *name, size_t size);
+
+/**
+ * @brief Decode the PAC of accepted tickets
+ *
+ * The PAC signatures are checked with the service key, then its logon
+ * information is decoded into k5_accepted.pac. Decoded PACs are kept in
+ * a bounded cache keyed by the ticket, until the ticket expires, so
+ * clients presenting the same ticket again are only decoded once.
+ * @param k5 libk5 context
+ * @param entries cache size, 0 to decode without caching, -1 to not
+ * decode PACs (the default)
+ * @return 0 on success; otherwise returns an error code
+ * @sa k5_accept
+ */
+krb5_error_code K5_EXPORT
+k5_set_pac_cache(k5_context k5, int entries);
+
+/**
+ * @brief Check a group membership
+ * @param pac decoded PAC
+ * @param rid group RID in pac->domain_sid
+ * @return 1 if the user is in the group, 0 otherwise
+ */
+int K5_EXPORT
+k5_pac_has_group(const k5_pac *pac, unsigned int rid);
+
+/**
+ * @brief Free k5_accepted data
+ * @param k5 libk5 context
+ * @param accepted filled by k5_accept()
+ */
+void K5_EXPORT
+k5_clear_accepted(k5_context k5, k5_accepted *accepted);
+
+/**
+ * @brief Share service tickets with the other processes of the user
+ *
+ * Service tickets k5_get_service_ticket() gets from the KDC are put in
+ * a table in POSIX shared memory; the other processes using the same
+ * name find them there instead of asking the KDC, and store them in
+ * their ccache. Entries are keyed by client and server principal and
+ * readers never block. The segment is created with mode 0600 and
+ * refused if it belongs to another user or is open to others.
+ * @param k5 libk5 context
+ * @param name shared memory name (shm_open()), NULL to stop sharing
+ * @param size memory budget in bytes, 0 for 4 MB, 8 KB per ticket. A
+ * segment keeps the size it was created with.
+ * @return 0 on success, ENOSYS when not supported; otherwise returns an
+ * error code
+ */
+krb5_error_code K5_EXPORT
+k5_set_ticket_cache(k5_context k5, const char *name, size_t size);
+
+/**
+ * @brief Serve k5's tickets to the user's other processes (k5d)
+ *
+ * Listens on a Unix socket and answers principal, service ticket and
+ * list requests from processes running as the same user (checked with
+ * SO_PEERCRED), until *stop is set. Requests which arrive together are
+ * batched: one lookup per service principal, one ccache scan for every
+ * list. Service tickets are taken from k5's ccache, or from the KDC.
+ * Contexts created with k5_init_context(&k5, "K5D:path") are clients.
+ * @param k5 libk5 context
+ * @param path socket path, NULL for $XDG_RUNTIME_DIR/k5d.sock or else
+ * /tmp/k5d-uid.sock
+ * @param stop checked at least once a second
+ * @return 0 once stopped, ENOSYS when not supported; otherwise returns
+ * an error code
+ */
+krb5_error_code K5_EXPORT
+k5_agent_run(k5_context k5, const char *path, volatile int *stop);
+
+/**
+ * @brief Cache resolved principals
+ *
+ * k5_get_service_ticket() turns (service, hostname) into a principal
+ * with krb5_sname_to_principal(), which may do forward and reverse DNS
+ * lookups and a realm lookup, and parses principal names. With the
+ * cache, these results and the ccache's client principal are kept for
+ * ttl seconds, so repeated calls do no DNS and no parsing. DNS changes
+ * are seen once the entry expires. The client principal is forgotten by
+ * k5_kinit() and k5_kdestroy().
+ * @param k5 libk5 context
+ * @param entries number of principals kept, 0 to turn the cache off
+ * (the default)
+ * @param ttl seconds, 0 for 300
+ * @return 0 on success; otherwise returns an error code
+ */
+krb5_error_code K5_EXPORT
+k5_set_principal_cache(k5_context k5, int entries, int ttl);
+
+/**
+ * @brief One ccache of a collection
+ * @sa k5_scan_collection
+ */
+typedef struct _k5_ccache_info {
+  /**
+   * Full ccache name (type:residual)
+   */
+  char *name;
+  /**
+   * Client principal, NULL if the cache couldn't be read
+   */
+  char *principal;
+  /**
+   * TGT end time, 0 without a TGT for the client's realm
+   */
+  time_t tgt_endtime;
+  /**
+   * TGT renew till time, 0 if not renewable
+   */
+  time_t tgt_renew_till;
+  /**
+   * Number of tickets, configuration entries excluded
+   */
+  int tickets;
+  /**
+   * 0 if the cache was read; otherwise the error
+   */
+  krb5_error_code code;
+  /**
+   * What the callback returned
+   */
+  krb5_error_code callback_code;
+} k5_ccache_info;
+
+/**
+ * @brief Callback called by k5_scan_collection() for each ccache
+ * @param k5 quiet libk5 context opened on the ccache, freed when the
+ * callback returns; k5_kinit() with K5_RENEW renews the TGT and
+ * k5_kdestroy() destroys the ccache
+ * @param info what was read from the ccache, check info->code
+ * @param data data given to k5_scan_collection()
+ * @return stored in info->callback_code
+ */
+typedef krb5_error_code (*k5_ccache_fn)(k5_context k5,
+					const k5_ccache_info *info,
+					void *data);
+
+/**
+ * @brief Read every ccache of the collection
+ *
+ * Lists the caches of the default ccache type's collection (DIR:,
+ * KEYRING:...) with krb5_cccol_cursor, then reads them in parallel:
+ * client principal, TGT times and ticket count. Each cache is opened by
+ * its own context. Errors are reported per cache, in the code and
+ * callback_code fields, and don't stop the scan. The callback may be
+ * called from several threads at once.
+ * @param k5 libk5 context
+ * @param threads number of threads, 0 for one per online CPU
+ * @param fn optional callback, called for each cache once it is read
+ * @param data passed to fn
+ * @param infos one entry per cache, free with k5_free_collection()
+ * @param count number of entries
+ * @return 0 once every cache is done, ENOSYS when not supported;
+ * otherwise returns an error code
+ */
+krb5_error_code K5_EXPORT
+k5_scan_collection(k5_context k5, int threads, k5_ccache_fn fn, void *data,
+		   k5_ccache_info **infos, int *count);
+
+/**
+ * @brief Free the result of k5_scan_collection()
+ * @param infos entries
+ * @param count number of entries
+ */
+void K5_EXPORT
+k5_free_collection(k5_ccache_info *infos, int count);
+
+/**
+ * @brief Set of client identities sharing one context
+ * @sa k5_identities_create
+ */
+typedef struct _k5_identities * k5_identities;
+
+/**
+ * @brief Counters of an identity set
+ * @sa k5_identities_stats
+ */
+typedef struct _k5_identity_stats {
+  /**
+   * Identities currently resident
+   */
+  int resident;
+  /**
+   * Estimated size of their credentials, in bytes
+   */
+  size_t bytes;
+  /**
+   * Operations on a resident identity
+   */
+  unsigned long hits;
+  /**
+   * Operations on an identity that wasn't resident, including the
+   * k5_identity_kinit() calls which created one
+   */
+  unsigned long misses;
+  /**
+   * Identities evicted to stay within the limits
+   */
+  unsigned long evictions;
+} k5_identity_stats;
+
+/**
+ * @brief Create a set of client identities
+ *
+ * The identities share one libk5 context, and so one krb5 context,
+ * parsed krb5.conf, keytab and principal cache. Each one has its own
+ * MEMORY: ccache, created by k5_identity_kinit(). When there are more
+ * than max_identities identities, or their credentials take more than
+ * max_bytes, the least recently used ones are destroyed. Like a
+ * k5_context, the set must not be used by several threads at once.
+ * @param ids new identity set, free with k5_identities_free()
+ * @param max_identities maximum number of resident identities, 0 for 1024
+ * @param max_bytes maximum size of their credentials, 0 for no limit
+ * @return 0 on success; otherwise returns an error code
+ */
+krb5_error_code K5_EXPORT
+k5_identities_create(k5_identities *ids, int max_identities,
+		     size_t max_bytes);
+
+/**
+ * @brief Get the context shared by the identities
+ *
+ * Use it for settings (k5_set_keytab(), k5_set_principal_cache(),
+ * k5_set_trace()...), statistics and errors, not for ccache
+ * operations, which would act on whichever identity was used last.
+ * @param ids identity set
+ * @return libk5 context, owned by the set
+ */
+k5_context K5_EXPORT
+k5_identities_context(k5_identities ids);
+
+/**
+ * @brief Get initial credentials for an identity, like k5_kinit()
+ *
+ * The identity is named by req->principal_name, which is required, and
+ * is created if it isn't resident. It isn't kept when the first kinit
+ * fails. K5_RENEW and K5_VALIDATE work on resident identities.
+ * @param ids identity set
+ * @param req kinit request
+ * @param ticket optional, see k5_kinit()
+ * @return 0 on success; otherwise returns an error code
+ */
+krb5_error_code K5_EXPORT
+k5_identity_kinit(k5_identities ids, k5_kinit_req *req, k5_ticket *ticket);
+
+/**
+ * @brief Get a service ticket for an identity, like
+ * k5_get_service_ticket()
+ * @param ids identity set
+ * @param principal identity, spelled as in k5_identity_kinit()
+ * @param service service name, see k5_get_service_ticket()
+ * @param hostname host name
+ * @param ticket service ticket
+ * @return 0 on success, KRB5_FCC_NOFILE when the identity isn't resident
+ * (never created, destroyed or evicted); otherwise returns an error code
+ */
+krb5_error_code K5_EXPORT
+k5_identity_get_service_ticket(k5_identities ids, const char *principal,
+			       const char *service, const char *hostname,
+			       k5_ticket *ticket);
+
+/**
+ * @brief Destroy an identity and its ccache
+ * @param ids identity set
+ * @param principal identity, spelled as in k5_identity_kinit()
+ * @return 0 on success, KRB5_FCC_NOFILE when the identity isn't resident
+ */
+krb5_error_code K5_EXPORT
+k5_identity_destroy(k5_identities ids, const char *principal);
+
+/**
+ * @brief Get the counters of an identity set
+ * @param ids identity set
+ * @param stats counters
+ */
+void K5_EXPORT
+k5_identities_stats(k5_identities ids, k5_identity_stats *stats);
+
+/**
+ * @brief Destroy every identity and free the set
+ * @param ids identity set
+ */
+void K5_EXPORT
+k5_identities_free(k5_identities ids);
+
+/**
+ * @brief Renew the context's TGT in the background
+ *
+ * A single thread per process handles every context. The TGT is renewed
+ * once about 80% of its lifetime is gone; when it can't be renewed
+ * anymore, a new one is requested with req. Failures are retried with
+ * exponential backoff. The thread works on its own krb5 context and
+ * ccache handle, on the same ccache as k5. Children created by fork()
+ * don't renew; call k5_auto_renew_start() again in the child if needed.
+ * @param k5 libk5 context
+ * @param req how to get a new TGT (K5_KINIT_KEYTAB, or K5_KINIT_PW with
+ * a prompter that doesn't need a terminal), copied. NULL to only renew.
+ * @return 0 on success; otherwise returns an error code
+ * @sa k5_auto_renew_stop
+ */
+krb5_error_code K5_EXPORT
+k5_auto_renew_start(k5_context k5, k5_kinit_req *req);
+
+/**
+ * @brief Stop renewing the context's TGT
+ *
+ * Waits for the renewal in progress, if any. Called by k5_free_context().
+ * @param k5 libk5 context
+ * @sa k5_auto_renew_start
+ */
+void K5_EXPORT
+k5_auto_renew_stop(k5_context k5);
+
+/**
+ * @brief Flags for k5_watch_expiry()
+ */
+#define K5_WATCH_TGT 1 /**< Only watch the TGT, not service tickets */
+
+/**
+ * @brief Get a file descriptor readable when tickets are about to expire
+ *
+ * The descriptor (a timerfd, Linux only) becomes readable when a ticket
+ * of the context's ccache has less than threshold seconds left; poll it
+ * for POLLIN, then call k5_watch_query(). Tickets obtained through the
+ * context are taken into account; after changing the ccache some other
+ * way, call k5_watch_expiry() again. Calling it again also changes the
+ * threshold and flags, and returns the same descriptor, which belongs to
+ * the context and is closed by k5_free_context().
+ * @param k5 libk5 context
+ * @param threshold seconds before the end time
+ * @param flags 0 or K5_WATCH_TGT
+ * @param fd descriptor to poll
+ * @return 0 on success, ENOSYS when not supported; otherwise returns an
+ * error code
+ * @sa k5_watch_query
+ */
+krb5_error_code K5_EXPORT
+k5_watch_expiry(k5_context k5, int threshold, int flags, int *fd);
+
+/**
+ * @brief Tell which tickets fell below the k5_watch_expiry() threshold
+ *
+ * Clears the descriptor, which then waits for the next ticket to come
+ * under the threshold. Expired tickets are listed too.
+ * @param k5 libk5 context
+ * @param expiring watched tickets with less than threshold seconds
+ * left, free with k5_clear_klist(). defname isn't set.
+ * @return 0 on success; otherwise returns an error code
+ * @sa k5_watch_expiry
+ */
+krb5_error_code K5_EXPORT
+k5_watch_query(k5_context k5, k5_klist_entries *expiring);
+
+/**
+ * @brief Enable or disable per call trace spans
+ *
+ * Every k5_kinit(), k5_get_service_ticket(), k5_get_service_ticket_gss()
+ * and k5_klist() call then records a span holding the krb5 trace
+ * messages (DNS, KDC lookup, requests and replies, ccache operations)
+ * with their time offset. The last spans are kept in a fixed size ring
+ * buffer. Don't call it while another thread uses k5_get_trace().
+ * @param k5 libk5 context
+ * @param spans number of spans to keep, 0 to disable tracing
+ * @return 0 on success; otherwise returns an error code
+ * @sa k5_get_trace
+ * @sa k5_trace_dump
+ */
+krb5_error_code K5_EXPORT
+k5_set_trace(k5_context k5, int spans);
+
+/**
+ * @brief Copy the last finished spans, oldest first
+ *
+ * Safe to call from another thread while the context is in use.
+ * @param k5 libk5 context
+ * @param spans array of at least n spans
+ * @param n maximum number of spans to copy
+ * @return number of spans copied
+ * @sa k5_set_trace
+ */
+int K5_EXPORT
+k5_get_trace(k5_context k5, k5_trace_span *spans, int n);
+
+/**
+ * @brief Print the last finished spans
+ * @param k5 libk5 context
+ * @param out output stream
+ * @param n maximum number of spans to print
+ * @sa k5_get_trace
+ */
+void K5_EXPORT
+k5_trace_dump(k5_context k5, FILE *out, int n);
+
 #if defined(_WIN32)
 /**
  * @brief Check MSLSA related registry keys
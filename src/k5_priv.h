@@ -28,7 +28,37 @@
 struct _k5_context {
   krb5_context ctx;
   krb5_ccache cc;
+  /* Resolved on first use, NULL for the default ccache */
+  char *cc_name;
   int verbose;
+  k5_stats stats;
+  struct k5_trace *trace;
+  double kdc_start;
+  int quiet;
+  k5_last_error last_error;
+  int last_error_formatted;
+  char last_error_message[512];
+  krb5_keytab kt;
+  char *kt_name;
+  void *kt_data;
+  size_t kt_size;
+  time_t kt_mtime;
+  unsigned int kt_generation;
+  char *kt_default;
+  struct k5_kt_index *kt_index;
+  struct k5_rcache *rcache;
+  int rcache_skew;
+  struct k5_pac_cache *pac_cache;
+  int pac_enabled;
+  struct k5_tcache *tcache;
+  struct k5_princ_cache *princ_cache;
+  char *agent_path;
+  int agent_fd;
+  struct k5_renew *renew;
+  int watch_fd;
+  int watch_threshold;
+  int watch_flags;
+  time_t watch_armed;
 };
 
 #include <krb5/krb5.h>
@@ -36,4 +66,130 @@ struct _k5_context {
 
 int k5_b64enc_ticket(k5_ticket *ticket);
 
+#if defined(HAVE_KRB5_INIT_CONTEXT_PROFILE)
+/* options layered over base, see options.c */
+krb5_error_code k5_options_profile(profile_t base,
+				   const k5_context_options *options,
+				   profile_t *profile);
+#endif
+
+#if defined(K5_LAZY_GSSAPI)
+/* GSSAPI functions, filled by k5_gss_load(), see gss.c */
+struct k5_gss {
+  __typeof__(gss_import_name) *import_name;
+  __typeof__(gss_acquire_cred) *acquire_cred;
+  __typeof__(gss_init_sec_context) *init_sec_context;
+  __typeof__(gss_release_cred) *release_cred;
+  __typeof__(gss_release_buffer) *release_buffer;
+  __typeof__(gss_release_name) *release_name;
+  __typeof__(gss_delete_sec_context) *delete_sec_context;
+};
+
+extern struct k5_gss k5_gss;
+krb5_error_code k5_gss_load(void);
+#endif
+
+/*
+ * Only call these when k5->princ_cache is set, except
+ * k5_princ_set_client(). Principals and names belong to the cache;
+ * k5_princ_add() and k5_princ_set_client() take them over.
+ */
+krb5_error_code k5_princ_find(k5_context k5, const char *service,
+			      const char *host, krb5_principal *principal,
+			      char **name);
+krb5_error_code k5_princ_add(k5_context k5, const char *service,
+			     const char *host, krb5_principal principal,
+			     char *name);
+krb5_error_code k5_princ_client(k5_context k5, krb5_principal *client);
+/* NULL to forget the client, when the ccache is initialized */
+void k5_princ_set_client(k5_context k5, krb5_principal client);
+void k5_princ_cache_free(k5_context k5);
+
+/* Resolves k5->cc if needed */
+krb5_error_code k5_cc_open(k5_context k5);
+
+void k5_err(k5_context k5, const char *op, krb5_error_code code,
+	    const char *principal, const char *format);
+
+double k5_now(void);
+void k5_stat_record(k5_context k5, enum k5_stat_op op, double start,
+		    krb5_error_code code);
+
+/* Only call these when k5->trace is set */
+void k5_span_begin(k5_context k5, const char *op, const char *service,
+		   const char *name);
+void k5_span_event(k5_context k5, const char *message);
+void k5_span_end(k5_context k5, krb5_error_code code);
+
+krb5_error_code k5_keytab_get(k5_context k5, k5_kinit_req *req,
+			      krb5_keytab *kt);
+void k5_keytab_free(k5_context k5);
+
+/*
+ * Hash index of a FILE: keytab for k5_accept(), kept by the context that
+ * opened it; others can borrow it (k5->kt_index) while it lives.
+ * ENOENT when the keytab isn't a file.
+ */
+struct k5_kt_snapshot;
+krb5_error_code k5_keytab_index_open(k5_context k5);
+krb5_error_code k5_keytab_index_get(k5_context k5,
+				    struct k5_kt_snapshot **snapshot);
+/* kvno 0 for the latest one, key lives as long as the snapshot */
+krb5_error_code k5_keytab_index_find(struct k5_kt_snapshot *snapshot,
+				     const unsigned char *principal,
+				     size_t len, krb5_kvno kvno,
+				     krb5_enctype enctype,
+				     krb5_keyblock **key);
+void k5_keytab_index_release(struct k5_kt_snapshot *snapshot);
+void k5_keytab_index_free(k5_context k5);
+
+/* Only call k5_watch_update() when k5->watch_fd is set */
+void k5_watch_update(k5_context k5, krb5_creds *creds);
+void k5_watch_close(k5_context k5);
+
+krb5_error_code k5_accept_keytab(k5_context k5, krb5_keytab keytab,
+				 const void *token, size_t len,
+				 k5_accepted *out);
+
+krb5_error_code k5_rcache_check(k5_context k5, const void *data, size_t len,
+				time_t ctime);
+void k5_rcache_free(k5_context k5);
+
+/*
+ * server_key, or else keytab, has the ticket's key. key is the ticket's
+ * ciphertext, NULL to bypass the cache.
+ */
+krb5_error_code k5_pac_get(k5_context k5, krb5_ticket *ticket,
+			   krb5_keytab keytab, krb5_keyblock *server_key,
+			   const void *key, size_t key_size,
+			   const k5_pac **pac);
+void k5_pac_release(const k5_pac *pac);
+void k5_pac_cache_free(k5_context k5);
+
+/* client \0 server \0 credentials, see tcache.c */
+size_t k5_creds_size(const char *client, const char *server,
+		     krb5_creds *creds);
+krb5_error_code k5_creds_encode(const char *client, const char *server,
+				krb5_creds *creds, void *data, size_t size,
+				size_t *len);
+krb5_error_code k5_creds_decode(k5_context k5, const void *data, size_t len,
+				krb5_creds **creds);
+
+/* Only call these when k5->tcache is set */
+krb5_error_code k5_tcache_get(k5_context k5, const char *client,
+			      const char *server, krb5_creds **creds);
+void k5_tcache_put(k5_context k5, const char *client, const char *server,
+		   krb5_creds *creds);
+void k5_tcache_free(k5_context k5);
+
+/* k5d client mode, see agent.c. Only call these when k5->agent_path is set */
+krb5_error_code k5_agent_open(k5_context k5, const char *path);
+krb5_error_code k5_agent_get(k5_context k5, const char *server,
+			     krb5_creds **creds);
+krb5_error_code k5_agent_sync(k5_context k5);
+void k5_agent_close(k5_context k5);
+
+krb5_error_code k5_parse_ticket(k5_context k5, krb5_creds *creds,
+				krb5_ticket *ticket, k5_ticket *t);
+
 #endif /* K5_PRIV_H_ */
@@ -0,0 +1,69 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef K5_PROBES_H_
+# define K5_PROBES_H_
+
+/*
+ * USDT probes, provider "libk5". Each one compiles to a nop and a note
+ * in the .note.stapsdt section, so they cost nothing until attached.
+ * Arguments are evaluated even when no tracer is attached, so keep them
+ * cheap. Elapsed times are in nanoseconds, measured from a
+ * K5_PROBE_CLOCK() variable with K5_PROBE_NS().
+ *
+ *   kinit__entry(principal)
+ *   kinit__return(principal, code, ns)
+ *   service__entry(service, hostname)
+ *   service__return(service, hostname, code, ns)
+ *   service_internal__entry(service, hostname)
+ *   service_internal__return(service, hostname, code, ns)
+ *   gss__entry(service, hostname)
+ *   gss__return(service, hostname, code, ns)
+ *   klist__entry(cache)
+ *   klist__return(cache, code, ns, count)
+ *   kdc__send(realm, realm_length, request_length)
+ *   kdc__recv(realm, realm_length, code, reply_length, ns)
+ *
+ * Principals, services and hostnames may be NULL. Realms aren't nul
+ * terminated.
+ */
+#if defined(HAVE_SYS_SDT_H)
+# include <sys/sdt.h>
+# define K5_PROBE1(name, a) DTRACE_PROBE1(libk5, name, a)
+# define K5_PROBE2(name, a, b) DTRACE_PROBE2(libk5, name, a, b)
+# define K5_PROBE3(name, a, b, c) DTRACE_PROBE3(libk5, name, a, b, c)
+# define K5_PROBE4(name, a, b, c, d) DTRACE_PROBE4(libk5, name, a, b, c, d)
+# define K5_PROBE5(name, a, b, c, d, e) \
+  DTRACE_PROBE5(libk5, name, a, b, c, d, e)
+# define K5_PROBE_CLOCK(var) double var = k5_now()
+#else
+# define K5_PROBE1(name, a) do { } while (0)
+# define K5_PROBE2(name, a, b) do { } while (0)
+# define K5_PROBE3(name, a, b, c) do { } while (0)
+# define K5_PROBE4(name, a, b, c, d) do { } while (0)
+# define K5_PROBE5(name, a, b, c, d, e) do { } while (0)
+# define K5_PROBE_CLOCK(var)
+#endif
+
+#define K5_PROBE_NS(start) ((long long)((k5_now() - (start)) * 1e9))
+
+#endif /* K5_PROBES_H_ */
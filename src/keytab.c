@@ -0,0 +1,835 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#include "k5_priv.h"
+
+/*
+ * Keytabs used by K5_KINIT_KEYTAB are copied once into a MEMORY: keytab
+ * held by the context, so renewing credentials doesn't read the keytab
+ * file again. FILE: keytabs are reloaded when their mtime changes.
+ */
+
+struct reader {
+  const unsigned char *p;
+  size_t left;
+};
+
+/* Wipe key material before freeing it, like krb5 does */
+static void
+wipe(void *p, size_t len)
+{
+  volatile unsigned char *v = p;
+
+  while (v && len--)
+    *v++ = 0;
+}
+
+static int
+read_u8(struct reader *r, unsigned int *v)
+{
+  if (r->left < 1)
+    return -1;
+  *v = r->p[0];
+  r->p++;
+  r->left--;
+  return 0;
+}
+
+static int
+read_u16(struct reader *r, unsigned int *v)
+{
+  if (r->left < 2)
+    return -1;
+  *v = (r->p[0] << 8) | r->p[1];
+  r->p += 2;
+  r->left -= 2;
+  return 0;
+}
+
+static int
+read_u32(struct reader *r, unsigned long *v)
+{
+  if (r->left < 4)
+    return -1;
+  *v = ((unsigned long)r->p[0] << 24) | (r->p[1] << 16) |
+    (r->p[2] << 8) | r->p[3];
+  r->p += 4;
+  r->left -= 4;
+  return 0;
+}
+
+static int
+read_data(struct reader *r, krb5_data *data)
+{
+  unsigned int len;
+
+  if (read_u16(r, &len) || r->left < len)
+    return -1;
+  data->magic = KV5M_DATA;
+  data->length = len;
+  data->data = malloc(len + 1);
+  if (!data->data)
+    return -1;
+  memcpy(data->data, r->p, len);
+  data->data[len] = '\0';
+  r->p += len;
+  r->left -= len;
+  return 0;
+}
+
+static void
+free_entry(krb5_keytab_entry *entry)
+{
+  krb5_principal princ = entry->principal;
+  int i;
+
+  if (princ) {
+    for (i = 0; i < princ->length; ++i)
+      free(princ->data[i].data);
+    free(princ->data);
+    free(princ->realm.data);
+    free(princ);
+  }
+  wipe(entry->key.contents, entry->key.length);
+  free(entry->key.contents);
+  memset(entry, 0, sizeof (*entry));
+}
+
+/* One entry of a version 0x502 keytab, see MIT's keytab.txt */
+static int
+read_entry(struct reader *r, krb5_keytab_entry *entry)
+{
+  krb5_principal princ;
+  unsigned int count, vno8, type;
+  unsigned long name_type, timestamp, vno32;
+  krb5_data key;
+  int i;
+
+  memset(entry, 0, sizeof (*entry));
+
+  princ = calloc(1, sizeof (*princ));
+  if (!princ)
+    return -1;
+  entry->principal = princ;
+  princ->magic = KV5M_PRINCIPAL;
+
+  if (read_u16(r, &count))
+    return -1;
+  princ->data = calloc(count ? count : 1, sizeof (*princ->data));
+  if (!princ->data || read_data(r, &princ->realm))
+    return -1;
+  for (i = 0; i < (int)count; ++i) {
+    if (read_data(r, &princ->data[i]))
+      return -1;
+    princ->length++;
+  }
+
+  if (read_u32(r, &name_type) || read_u32(r, &timestamp) ||
+      read_u8(r, &vno8) || read_u16(r, &type) || read_data(r, &key))
+    return -1;
+
+  princ->type = name_type;
+  entry->magic = KV5M_KEYTAB_ENTRY;
+  entry->timestamp = timestamp;
+  entry->vno = vno8;
+  entry->key.magic = KV5M_KEYBLOCK;
+  entry->key.enctype = type;
+  entry->key.length = key.length;
+  entry->key.contents = (krb5_octet *)key.data;
+
+  /* The 32 bits kvno, if present, overrides the 8 bits one */
+  if (!read_u32(r, &vno32) && vno32)
+    entry->vno = vno32;
+  return 0;
+}
+
+static krb5_error_code
+keytab_load_buffer(k5_context k5, const void *data, size_t size,
+		   krb5_keytab kt)
+{
+  struct reader r;
+  unsigned int version;
+  krb5_error_code code;
+
+  r.p = data;
+  r.left = size;
+
+  if (read_u16(&r, &version))
+    return KRB5_KT_END;
+  if (version != 0x0502)
+    return KRB5_KEYTAB_BADVNO;
+
+  while (r.left) {
+    struct reader rec;
+    krb5_keytab_entry entry;
+    unsigned long len;
+    long reclen;
+
+    if (read_u32(&r, &len))
+      return KRB5_KT_FORMAT;
+    reclen = (long)(krb5_int32)len;
+    /* Negative sizes are holes left by removed entries */
+    if (reclen < 0)
+      reclen = -reclen;
+    if ((size_t)reclen > r.left)
+      return KRB5_KT_FORMAT;
+
+    rec.p = r.p;
+    rec.left = reclen;
+    r.p += reclen;
+    r.left -= reclen;
+
+    if ((krb5_int32)len <= 0)
+      continue ;
+
+    if (read_entry(&rec, &entry)) {
+      free_entry(&entry);
+      return KRB5_KT_FORMAT;
+    }
+    code = krb5_kt_add_entry(k5->ctx, kt, &entry);
+    free_entry(&entry);
+    if (code)
+      return code;
+  }
+  return 0;
+}
+
+static krb5_error_code
+keytab_copy(k5_context k5, const char *name, krb5_keytab kt)
+{
+  krb5_keytab src = NULL;
+  krb5_keytab_entry entry;
+  krb5_kt_cursor cursor;
+  krb5_error_code code;
+
+  if ((code = krb5_kt_resolve(k5->ctx, name, &src)))
+    return code;
+
+  if ((code = krb5_kt_start_seq_get(k5->ctx, src, &cursor)))
+    goto cleanup;
+
+  while (!(code = krb5_kt_next_entry(k5->ctx, src, &entry, &cursor))) {
+    code = krb5_kt_add_entry(k5->ctx, kt, &entry);
+    krb5_free_keytab_entry_contents(k5->ctx, &entry);
+    if (code)
+      break ;
+  }
+  krb5_kt_end_seq_get(k5->ctx, src, &cursor);
+  if (code == KRB5_KT_END)
+    code = 0;
+
+ cleanup:
+  krb5_kt_close(k5->ctx, src);
+  return code;
+}
+
+/* Path of FILE: keytabs, NULL for other types */
+static const char *
+keytab_path(const char *name)
+{
+  if (!strncmp(name, "FILE:", 5))
+    return name + 5;
+  if (!strncmp(name, "WRFILE:", 7))
+    return name + 7;
+  /* No prefix, or a drive letter */
+  if (!strchr(name, ':') || (strchr(name, ':') == name + 1))
+    return name;
+  return NULL;
+}
+
+void
+k5_keytab_free(k5_context k5)
+{
+  if (k5->kt)
+    krb5_kt_close(k5->ctx, k5->kt);
+  free(k5->kt_name);
+  wipe(k5->kt_data, k5->kt_size);
+  free(k5->kt_data);
+  k5->kt = NULL;
+  k5->kt_name = NULL;
+  k5->kt_data = NULL;
+  k5->kt_size = 0;
+  k5->kt_mtime = 0;
+}
+
+krb5_error_code
+k5_keytab_get(k5_context k5, k5_kinit_req *req, krb5_keytab *ktp)
+{
+  char defname[1024], memname[64];
+  const char *name = NULL, *path = NULL;
+  krb5_keytab kt = NULL;
+  krb5_error_code code;
+  struct stat st;
+  time_t mtime = 0;
+
+  if (req->keytab_data) {
+    if (k5->kt && k5->kt_data && k5->kt_size == req->keytab_size &&
+	!memcmp(k5->kt_data, req->keytab_data, req->keytab_size)) {
+      *ktp = k5->kt;
+      return 0;
+    }
+  } else {
+    name = req->keytab_name;
+    if (!name)
+      name = k5->kt_default;
+    if (!name) {
+      if ((code = krb5_kt_default_name(k5->ctx, defname, sizeof (defname))))
+	return code;
+      name = defname;
+    }
+    path = keytab_path(name);
+    if (path && !stat(path, &st))
+      mtime = st.st_mtime;
+
+    if (k5->kt && k5->kt_name && !strcmp(k5->kt_name, name) &&
+	mtime == k5->kt_mtime) {
+      *ktp = k5->kt;
+      return 0;
+    }
+  }
+
+  if (name && !path) {
+    /* Not a file, keep a handle to the keytab itself */
+    if ((code = krb5_kt_resolve(k5->ctx, name, &kt)))
+      return code;
+  } else {
+    /* Each load gets a new name, MEMORY: keytabs are shared by name */
+    snprintf(memname, sizeof (memname), "MEMORY:libk5-%p-%u",
+	     (void *)k5, ++k5->kt_generation);
+    if ((code = krb5_kt_resolve(k5->ctx, memname, &kt)))
+      return code;
+    if (name)
+      code = keytab_copy(k5, name, kt);
+    else
+      code = keytab_load_buffer(k5, req->keytab_data, req->keytab_size, kt);
+    if (code) {
+      krb5_kt_close(k5->ctx, kt);
+      return code;
+    }
+  }
+
+  k5_keytab_free(k5);
+  k5->kt = kt;
+  k5->kt_mtime = mtime;
+  if (name) {
+    k5->kt_name = strdup(name);
+  } else {
+    k5->kt_data = malloc(req->keytab_size);
+    if (k5->kt_data) {
+      memcpy(k5->kt_data, req->keytab_data, req->keytab_size);
+      k5->kt_size = req->keytab_size;
+    }
+  }
+
+  *ktp = kt;
+  return 0;
+}
+
+/*
+ * Keytab index for k5_accept(). The keytab file is read and parsed
+ * once into a snapshot: keys copied out of the file and an open
+ * addressing hash table on (principal, kvno, enctype). Principals are
+ * compared in their keytab encoding, realm then components, each with a
+ * 16 bits length; kvno 0 stands for the latest kvno of the enctype.
+ *
+ * Snapshots are reference counted and never modified. At most once a
+ * second, one lookup checks the file; if it changed, that thread builds
+ * a new snapshot while the others keep using the current one, then
+ * swaps it in. Verifications holding the old one finish with it.
+ */
+#if defined(_WIN32)
+
+krb5_error_code
+k5_keytab_index_open(k5_context k5)
+{
+  return ENOSYS;
+}
+
+krb5_error_code
+k5_keytab_index_get(k5_context k5, struct k5_kt_snapshot **snapshot)
+{
+  return ENOSYS;
+}
+
+krb5_error_code
+k5_keytab_index_find(struct k5_kt_snapshot *snapshot,
+		     const unsigned char *principal, size_t len,
+		     krb5_kvno kvno, krb5_enctype enctype,
+		     krb5_keyblock **key)
+{
+  return ENOSYS;
+}
+
+void
+k5_keytab_index_release(struct k5_kt_snapshot *snapshot)
+{
+}
+
+void
+k5_keytab_index_free(k5_context k5)
+{
+}
+
+#else
+
+struct kt_slot {
+  const unsigned char *principal;
+  size_t len;
+  krb5_kvno kvno;
+  krb5_enctype enctype;
+  krb5_keyblock key;
+};
+
+struct k5_kt_snapshot {
+  volatile int refs;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  unsigned int mask;
+  /* See index_lookup(), 0 is empty */
+  unsigned int *table;
+  struct kt_slot *slots;
+  int count;
+  /* Principals and keys */
+  unsigned char *arena;
+  size_t arena_size;
+};
+
+struct k5_kt_index {
+  k5_context owner;
+  char *name;
+  const char *path;
+  pthread_mutex_t lock;
+  struct k5_kt_snapshot *current;
+  time_t checked;
+  int reloading;
+};
+
+static unsigned int
+index_hash(const unsigned char *p, size_t len, krb5_kvno kvno,
+	   krb5_enctype enctype)
+{
+  unsigned int h = 2166136261U;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 16777619U;
+  }
+  h ^= kvno * 0x9e3779b1U;
+  h ^= (unsigned int)enctype * 0x85ebca6bU;
+  return h ^ (h >> 15);
+}
+
+/*
+ * Table entries are (slot + 1) << 1, the low bit marks the entry for the
+ * latest kvno. Returns where the key is, or where it would go.
+ */
+static unsigned int *
+index_lookup(struct k5_kt_snapshot *s, const unsigned char *p, size_t len,
+	     krb5_kvno kvno, krb5_enctype enctype)
+{
+  unsigned int i = index_hash(p, len, kvno, enctype) & s->mask;
+
+  for (; s->table[i]; i = (i + 1) & s->mask) {
+    unsigned int v = s->table[i];
+    struct kt_slot *slot = &s->slots[(v >> 1) - 1];
+
+    if ((int)(v & 1) == !kvno && (!kvno || slot->kvno == kvno) &&
+	slot->enctype == enctype && slot->len == len &&
+	!memcmp(slot->principal, p, len))
+      break ;
+  }
+  return &s->table[i];
+}
+
+#define INDEX_SLOT(s, v) (&(s)->slots[((v) >> 1) - 1])
+
+static void
+snapshot_free(struct k5_kt_snapshot *s)
+{
+  if (!s)
+    return ;
+  free(s->table);
+  free(s->slots);
+  wipe(s->arena, s->arena_size);
+  free(s->arena);
+  free(s);
+}
+
+static void
+snapshot_release(struct k5_kt_snapshot *s)
+{
+  if (s && !__sync_sub_and_fetch(&s->refs, 1))
+    snapshot_free(s);
+}
+
+/* First pass counts entries and bytes, second one fills the slots */
+static int
+snapshot_parse(struct k5_kt_snapshot *s, const unsigned char *data,
+	       size_t size, size_t *arena_size)
+{
+  struct reader r;
+  unsigned int version;
+  unsigned char *arena = s->arena;
+
+  r.p = data;
+  r.left = size;
+  s->count = 0;
+  *arena_size = 0;
+
+  if (read_u16(&r, &version) || version != 0x0502)
+    return -1;
+
+  while (r.left) {
+    struct reader rec;
+    const unsigned char *principal;
+    unsigned int count, vno8, type, len, i;
+    unsigned long rlen, name_type, timestamp, vno32;
+    long reclen;
+
+    if (read_u32(&r, &rlen))
+      return -1;
+    reclen = (long)(krb5_int32)rlen;
+    if (reclen < 0)
+      reclen = -reclen;
+    if ((size_t)reclen > r.left)
+      return -1;
+    rec.p = r.p;
+    rec.left = reclen;
+    r.p += reclen;
+    r.left -= reclen;
+    if ((krb5_int32)rlen <= 0)
+      continue ;
+
+    /* Realm and components, as they are */
+    if (read_u16(&rec, &count))
+      return -1;
+    principal = rec.p;
+    for (i = 0; i <= count; ++i) {
+      if (read_u16(&rec, &len) || rec.left < len)
+	return -1;
+      rec.p += len;
+      rec.left -= len;
+    }
+    len = rec.p - principal;
+
+    if (read_u32(&rec, &name_type) || read_u32(&rec, &timestamp) ||
+	read_u8(&rec, &vno8) || read_u16(&rec, &type) ||
+	read_u16(&rec, &i) || rec.left < i)
+      return -1;
+    /* i is now the key size */
+
+    if (s->slots) {
+      struct kt_slot *slot = &s->slots[s->count];
+
+      memcpy(arena, principal, len);
+      slot->principal = arena;
+      slot->len = len;
+      arena += len;
+      slot->key.magic = KV5M_KEYBLOCK;
+      slot->key.enctype = type;
+      slot->key.length = i;
+      slot->key.contents = arena;
+      memcpy(arena, rec.p, i);
+      arena += i;
+      slot->enctype = slot->key.enctype;
+      slot->kvno = vno8;
+    }
+    *arena_size += len + i;
+    rec.p += i;
+    rec.left -= i;
+    /* The 32 bits kvno, if present, overrides the 8 bits one */
+    if (s->slots && !read_u32(&rec, &vno32) && vno32)
+      s->slots[s->count].kvno = vno32;
+    s->count++;
+  }
+  return 0;
+}
+
+static krb5_error_code
+snapshot_build(const void *data, size_t size, struct k5_kt_snapshot **sp)
+{
+  struct k5_kt_snapshot *s;
+  size_t arena_size;
+  unsigned int buckets = 16, *where;
+  int i;
+
+  s = calloc(1, sizeof (*s));
+  if (!s)
+    return ENOMEM;
+  if (snapshot_parse(s, data, size, &arena_size)) {
+    free(s);
+    return KRB5_KT_FORMAT;
+  }
+
+  /* Two table entries per key at most, keep it half empty */
+  while (buckets < 4U * s->count)
+    buckets <<= 1;
+  s->mask = buckets - 1;
+  s->table = calloc(buckets, sizeof (*s->table));
+  s->slots = calloc(s->count ? s->count : 1, sizeof (*s->slots));
+  s->arena = malloc(arena_size ? arena_size : 1);
+  if (s->arena)
+    s->arena_size = arena_size;
+  if (!s->table || !s->slots || !s->arena ||
+      snapshot_parse(s, data, size, &arena_size)) {
+    snapshot_free(s);
+    return ENOMEM;
+  }
+
+  for (i = 0; i < s->count; ++i) {
+    struct kt_slot *slot = &s->slots[i];
+    unsigned int v = (i + 1) << 1;
+
+    /* Keep the first of duplicate entries, like krb5_kt_get_entry() */
+    if (slot->kvno) {
+      where = index_lookup(s, slot->principal, slot->len, slot->kvno,
+			   slot->enctype);
+      if (!*where)
+	*where = v;
+    }
+    where = index_lookup(s, slot->principal, slot->len, 0, slot->enctype);
+    if (!*where || INDEX_SLOT(s, *where)->kvno < slot->kvno)
+      *where = v | 1;
+  }
+
+  s->refs = 1;
+  *sp = s;
+  return 0;
+}
+
+/*
+ * The file is read into a private buffer: it may be rewritten or
+ * truncated in place while we parse it, which would make a mapping
+ * fault, or differ between the two passes of snapshot_parse().
+ */
+static krb5_error_code
+snapshot_load(const char *path, struct k5_kt_snapshot **sp)
+{
+  struct stat st;
+  unsigned char *data = NULL;
+  size_t size = 0;
+  ssize_t n;
+  krb5_error_code code;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return errno;
+  if (fstat(fd, &st)) {
+    code = errno;
+    goto cleanup;
+  }
+  if (!st.st_size) {
+    code = KRB5_KT_END;
+    goto cleanup;
+  }
+  if (!(data = malloc(st.st_size))) {
+    code = ENOMEM;
+    goto cleanup;
+  }
+  while (size < (size_t)st.st_size) {
+    n = read(fd, data + size, st.st_size - size);
+    if (n < 0 && errno == EINTR)
+      continue ;
+    if (n < 0) {
+      code = errno;
+      goto cleanup;
+    }
+    if (!n)
+      break ;
+    size += n;
+  }
+
+  /* Truncated since fstat(), parse what is left */
+  if (!(code = snapshot_build(data, size, sp))) {
+    (*sp)->dev = st.st_dev;
+    (*sp)->ino = st.st_ino;
+    (*sp)->size = st.st_size;
+    (*sp)->mtime = st.st_mtime;
+  }
+
+ cleanup:
+  wipe(data, size);
+  free(data);
+  close(fd);
+  return code;
+}
+
+/* The file was rewritten, or replaced by a rename */
+static int
+snapshot_stale(struct k5_kt_snapshot *s, const char *path)
+{
+  struct stat st;
+
+  if (stat(path, &st))
+    return 0;
+  return st.st_dev != s->dev || st.st_ino != s->ino ||
+    st.st_size != s->size || st.st_mtime != s->mtime;
+}
+
+static void
+index_free(struct k5_kt_index *idx)
+{
+  snapshot_release(idx->current);
+  pthread_mutex_destroy(&idx->lock);
+  free(idx->name);
+  free(idx);
+}
+
+krb5_error_code
+k5_keytab_index_open(k5_context k5)
+{
+  struct k5_kt_index *idx = k5->kt_index;
+  char defname[1024];
+  const char *name = k5->kt_default, *path;
+  krb5_error_code code;
+
+  /* Borrowed from another context, which keeps it up to date */
+  if (idx && idx->owner != k5)
+    return 0;
+
+  if (!name) {
+    if ((code = krb5_kt_default_name(k5->ctx, defname, sizeof (defname))))
+      return code;
+    name = defname;
+  }
+  if (idx && !strcmp(idx->name, name))
+    return 0;
+
+  k5_keytab_index_free(k5);
+  if (!(path = keytab_path(name)))
+    return ENOENT;
+
+  idx = calloc(1, sizeof (*idx));
+  if (!idx)
+    return ENOMEM;
+  if (!(idx->name = strdup(name))) {
+    free(idx);
+    return ENOMEM;
+  }
+  idx->owner = k5;
+  idx->path = keytab_path(idx->name);
+  pthread_mutex_init(&idx->lock, NULL);
+  if ((code = snapshot_load(idx->path, &idx->current))) {
+    index_free(idx);
+    return code;
+  }
+  idx->checked = time(NULL);
+  k5->kt_index = idx;
+  return 0;
+}
+
+krb5_error_code
+k5_keytab_index_get(k5_context k5, struct k5_kt_snapshot **sp)
+{
+  struct k5_kt_index *idx = k5->kt_index;
+  struct k5_kt_snapshot *s, *fresh = NULL, *old = NULL;
+  time_t now = time(NULL);
+  int check = 0;
+
+  pthread_mutex_lock(&idx->lock);
+  if (now != idx->checked && !idx->reloading) {
+    idx->checked = now;
+    idx->reloading = check = 1;
+  }
+  s = idx->current;
+  __sync_add_and_fetch(&s->refs, 1);
+  pthread_mutex_unlock(&idx->lock);
+
+  if (!check) {
+    *sp = s;
+    return 0;
+  }
+
+  /* A keytab being rewritten may not parse, keep the old keys then */
+  if (snapshot_stale(s, idx->path))
+    snapshot_load(idx->path, &fresh);
+
+  pthread_mutex_lock(&idx->lock);
+  if (fresh) {
+    old = idx->current;
+    idx->current = fresh;
+    __sync_add_and_fetch(&fresh->refs, 1);
+  }
+  idx->reloading = 0;
+  pthread_mutex_unlock(&idx->lock);
+
+  if (fresh) {
+    snapshot_release(old);
+    snapshot_release(s);
+    s = fresh;
+  }
+  *sp = s;
+  return 0;
+}
+
+krb5_error_code
+k5_keytab_index_find(struct k5_kt_snapshot *s, const unsigned char *principal,
+		     size_t len, krb5_kvno kvno, krb5_enctype enctype,
+		     krb5_keyblock **key)
+{
+  unsigned int v;
+
+  v = *index_lookup(s, principal, len, kvno, enctype);
+  /* Old keytabs only have the low 8 bits of the kvno */
+  if (!v && kvno > 255 && (kvno & 0xff))
+    v = *index_lookup(s, principal, len, kvno & 0xff, enctype);
+  if (!v)
+    return *index_lookup(s, principal, len, 0, enctype) ?
+      KRB5_KT_KVNONOTFOUND : KRB5_KT_NOTFOUND;
+  *key = &INDEX_SLOT(s, v)->key;
+  return 0;
+}
+
+void
+k5_keytab_index_release(struct k5_kt_snapshot *s)
+{
+  snapshot_release(s);
+}
+
+void
+k5_keytab_index_free(k5_context k5)
+{
+  struct k5_kt_index *idx = k5->kt_index;
+
+  k5->kt_index = NULL;
+  if (idx && idx->owner == k5)
+    index_free(idx);
+}
+
+#endif
@@ -152,19 +152,22 @@ K5_EXPORT k5_ms2mit(k5_context k5)
   krb5_principal princ = NULL;
   int initial_ticket = 0;
 
+  if ((code = k5_cc_open(k5)))
+    return code;
+
   if ((code = krb5_cc_resolve(k5->ctx, "MSLSA:", &mslsa_ccache))) {
-    com_err("k5_ms2mit", code, "while opening MS LSA ccache");
+    k5_err(k5, "k5_ms2mit", code, NULL, "while opening MS LSA ccache");
     goto cleanup;
   }
 
   if ((code = krb5_cc_set_flags(k5->ctx, mslsa_ccache, KRB5_TC_NOTICKET))) {
-    com_err("k5_ms2mit", code, "while setting KRB5_TC_NOTICKET flag");
+    k5_err(k5, "k5_ms2mit", code, NULL, "while setting KRB5_TC_NOTICKET flag");
     goto cleanup;
   }
 
   /* Enumerate tickets from cache looking for an initial ticket */
   if ((code = krb5_cc_start_seq_get(k5->ctx, mslsa_ccache, &cursor))) {
-    com_err("k5_ms2mit", code, "while initiating the cred sequence of MS LSA ccache");
+    k5_err(k5, "k5_ms2mit", code, NULL, "while initiating the cred sequence of MS LSA ccache");
     goto cleanup;
   }
 
@@ -180,7 +183,7 @@ K5_EXPORT k5_ms2mit(k5_context k5)
   krb5_cc_end_seq_get(k5->ctx, mslsa_ccache, &cursor);
 
   if ((code = krb5_cc_set_flags(k5->ctx, mslsa_ccache, 0))) {
-    com_err("k5_ms2mit", code, "while clearing flags");
+    k5_err(k5, "k5_ms2mit", code, NULL, "while clearing flags");
     goto cleanup;
   }
 
@@ -193,17 +196,18 @@ K5_EXPORT k5_ms2mit(k5_context k5)
   }
 
   if ((code = krb5_cc_get_principal(k5->ctx, mslsa_ccache, &princ))) {
-    com_err("k5_ms2mit", code, "while obtaining MS LSA principal");
+    k5_err(k5, "k5_ms2mit", code, NULL, "while obtaining MS LSA principal");
     goto cleanup;
   }
 
+  k5_princ_set_client(k5, NULL);
   if ((code = krb5_cc_initialize(k5->ctx, k5->cc, princ))) {
-    com_err ("k5_ms2mit", code, "when initializing ccache");
+    k5_err(k5, "k5_ms2mit", code, NULL, "when initializing ccache");
     goto cleanup;
   }
 
   if ((code = krb5_cc_copy_creds(k5->ctx, mslsa_ccache, k5->cc))) {
-    com_err ("k5_ms2mit", code, "while copying MS LSA ccache to default ccache");
+    k5_err(k5, "k5_ms2mit", code, NULL, "while copying MS LSA ccache to default ccache");
     goto cleanup;
   }
 
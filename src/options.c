@@ -0,0 +1,302 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "k5_priv.h"
+
+#if defined(HAVE_KRB5_INIT_CONTEXT_PROFILE)
+
+#include <strings.h>
+#include <profile.h>
+
+/*
+ * k5_context_options as a profile layered over krb5.conf: [libdefaults]
+ * relations set by the options are answered from here, everything else
+ * (lookups, sections, iteration) goes to the base profile. The profile
+ * is read-only and each context gets a reference on it.
+ */
+
+#define OVERLAY_MAX 8
+
+struct overlay {
+  int refs;
+  profile_t base;
+  int count;
+  char *names[OVERLAY_MAX];
+  char *values[OVERLAY_MAX];
+};
+
+static int
+overlay_set(struct overlay *o, const char *name, const char *value)
+{
+  if (o->count == OVERLAY_MAX ||
+      !(o->names[o->count] = strdup(name)))
+    return -1;
+  if (!(o->values[o->count] = strdup(value))) {
+    free(o->names[o->count]);
+    return -1;
+  }
+  o->count++;
+  return 0;
+}
+
+static int
+overlay_set_int(struct overlay *o, const char *name, int value)
+{
+  char buf[16];
+
+  snprintf(buf, sizeof (buf), "%d", value);
+  return overlay_set(o, name, buf);
+}
+
+static void
+overlay_cleanup(void *data)
+{
+  struct overlay *o = data;
+  int i;
+
+  if (__sync_sub_and_fetch(&o->refs, 1))
+    return ;
+  for (i = 0; i < o->count; ++i) {
+    free(o->names[i]);
+    free(o->values[i]);
+  }
+  if (o->base)
+    profile_release(o->base);
+  free(o);
+}
+
+static long
+overlay_copy(void *data, void **copy)
+{
+  struct overlay *o = data;
+
+  __sync_add_and_fetch(&o->refs, 1);
+  *copy = o;
+  return 0;
+}
+
+static char **
+values_dup(char **values)
+{
+  char **out;
+  int i, n;
+
+  for (n = 0; values[n]; ++n)
+    ;
+  if (!(out = calloc(n + 1, sizeof (*out))))
+    return NULL;
+  for (i = 0; i < n; ++i) {
+    if (!(out[i] = strdup(values[i]))) {
+      while (i--)
+	free(out[i]);
+      free(out);
+      return NULL;
+    }
+  }
+  return out;
+}
+
+static long
+overlay_get_values(void *data, const char *const *names, char ***values)
+{
+  struct overlay *o = data;
+  char *one[2] = { NULL, NULL };
+  char **base;
+  long code;
+  int i;
+
+  *values = NULL;
+  if (names[0] && names[1] && !names[2] &&
+      !strcmp(names[0], "libdefaults")) {
+    for (i = 0; i < o->count; ++i) {
+      if (strcmp(names[1], o->names[i]))
+	continue ;
+      one[0] = o->values[i];
+      *values = values_dup(one);
+      return *values ? 0 : ENOMEM;
+    }
+  }
+
+  /* Ours are freed with free() */
+  if ((code = profile_get_values(o->base, names, &base)))
+    return code;
+  *values = values_dup(base);
+  profile_free_list(base);
+  return *values ? 0 : ENOMEM;
+}
+
+static void
+overlay_free_values(void *data, char **values)
+{
+  int i;
+
+  for (i = 0; values && values[i]; ++i)
+    free(values[i]);
+  free(values);
+}
+
+static long
+overlay_iterator_create(void *data, const char *const *names, int flags,
+			void **iter)
+{
+  struct overlay *o = data;
+  void **it;
+  long code;
+
+  if (!(it = malloc(sizeof (*it))))
+    return ENOMEM;
+  if ((code = profile_iterator_create(o->base, names, flags, it))) {
+    free(it);
+    return code;
+  }
+  *iter = it;
+  return 0;
+}
+
+static long
+overlay_iterator(void *data, void *iter, char **name, char **value)
+{
+  return profile_iterator(iter, name, value);
+}
+
+static void
+overlay_iterator_free(void *data, void *iter)
+{
+  profile_iterator_free(iter);
+  free(iter);
+}
+
+static void
+overlay_free_string(void *data, char *s)
+{
+  profile_release_string(s);
+}
+
+static struct profile_vtable overlay_vtable = {
+  1,
+  overlay_get_values,
+  overlay_free_values,
+  overlay_cleanup,
+  overlay_copy,
+  overlay_iterator_create,
+  overlay_iterator,
+  overlay_iterator_free,
+  overlay_free_string,
+};
+
+static const char *
+option_string(enum k5_option value)
+{
+  switch (value) {
+  case K5_OPTION_TRUE:
+    return "true";
+  case K5_OPTION_FALSE:
+    return "false";
+  case K5_OPTION_FALLBACK:
+    return "fallback";
+  default:
+    return NULL;
+  }
+}
+
+/* Usual default names for ccache types */
+static const char *
+ccache_name(const char *type)
+{
+  static const struct {
+    const char *type;
+    const char *name;
+  } names[] = {
+    { "FILE", "FILE:%{TEMP}/krb5cc_%{uid}" },
+    { "DIR", "DIR:%{TEMP}/krb5cc_%{uid}_dir" },
+    { "KEYRING", "KEYRING:persistent:%{uid}" },
+    { "KCM", "KCM:" },
+    { "MEMORY", "MEMORY:libk5" },
+  };
+  size_t i;
+
+  if (strchr(type, ':'))
+    return type;
+  for (i = 0; i < sizeof (names) / sizeof (names[0]); ++i)
+    if (!strcasecmp(type, names[i].type))
+      return names[i].name;
+  return NULL;
+}
+
+krb5_error_code
+k5_options_profile(profile_t base, const k5_context_options *options,
+		   profile_t *profile)
+{
+  struct overlay *o;
+  const char *s;
+  krb5_error_code code = ENOMEM;
+  int err = 0;
+
+  *profile = NULL;
+  if (!(o = calloc(1, sizeof (*o))))
+    return ENOMEM;
+  o->refs = 1;
+
+  if ((s = option_string(options->dns_canonicalize_hostname)))
+    err |= overlay_set(o, "dns_canonicalize_hostname", s);
+  /* rdns has no fallback */
+  if (options->rdns == K5_OPTION_FALLBACK) {
+    code = EINVAL;
+    goto cleanup;
+  }
+  if ((s = option_string(options->rdns)))
+    err |= overlay_set(o, "rdns", s);
+  if (options->udp_preference_limit > 0)
+    err |= overlay_set_int(o, "udp_preference_limit",
+			   options->udp_preference_limit);
+  if (options->kdc_timeout > 0) {
+    /* MIT krb5 1.21 calls it request_timeout */
+    err |= overlay_set_int(o, "kdc_timeout", options->kdc_timeout);
+    err |= overlay_set_int(o, "request_timeout", options->kdc_timeout);
+  }
+  if (options->ccache_type) {
+    if (!(s = ccache_name(options->ccache_type))) {
+      code = EINVAL;
+      goto cleanup;
+    }
+    err |= overlay_set(o, "default_ccache_name", s);
+  }
+  if (err)
+    goto cleanup;
+
+  if ((code = profile_copy(base, &o->base)))
+    goto cleanup;
+  if ((code = profile_init_vtable(&overlay_vtable, o, profile)))
+    goto cleanup;
+  return 0;
+
+ cleanup:
+  overlay_cleanup(o);
+  return code;
+}
+
+#endif
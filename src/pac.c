@@ -0,0 +1,634 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#endif
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+#include "k5_priv.h"
+
+/*
+ * PAC decoding for k5_accept(). The PAC is checked with krb5_pac_verify()
+ * and its KERB_VALIDATION_INFO buffer (MS-PAC 2.5, NDR encoded) is
+ * turned into a k5_pac: a single reference counted allocation holding
+ * the sorted group RIDs and SIDs.
+ *
+ * Decoded PACs are cached by the ticket's ciphertext, until the ticket's
+ * endtime. The cache is a hash table of 4-way sets; a new entry takes
+ * the place of the one which expires first. Keys are compared in full,
+ * a hash collision can't hand out someone else's groups.
+ */
+#if defined(_WIN32)
+# define cache_lock(c) do { } while (0)
+# define cache_unlock(c) do { } while (0)
+#else
+# define cache_lock(c) pthread_mutex_lock(&(c)->lock)
+# define cache_unlock(c) pthread_mutex_unlock(&(c)->lock)
+#endif
+#if defined(_MSC_VER)
+# define pac_ref(p) InterlockedIncrement((volatile LONG *)(p))
+# define pac_unref(p) InterlockedDecrement((volatile LONG *)(p))
+#else
+# define pac_ref(p) __sync_add_and_fetch((p), 1)
+# define pac_unref(p) __sync_sub_and_fetch((p), 1)
+#endif
+
+#define PAC_WAYS 4
+/* S-1-<48 bits>-<15 x 32 bits> */
+#define SID_MAX 192
+/* Group membership attributes, SE_GROUP_ENABLED */
+#define GROUP_ENABLED 0x4
+
+struct pac_blob {
+  volatile int refs;
+  k5_pac pac;
+};
+
+struct pac_entry {
+  unsigned long long hash;
+  void *key;
+  size_t key_size;
+  time_t endtime;
+  struct pac_blob *blob;
+};
+
+struct k5_pac_cache {
+#if !defined(_WIN32)
+  pthread_mutex_t lock;
+#endif
+  int sets;
+  struct pac_entry *entries;
+};
+
+struct ndr {
+  const unsigned char *base;
+  const unsigned char *p;
+  size_t left;
+};
+
+static int
+ndr_u32(struct ndr *r, unsigned int *v)
+{
+  if (r->left < 4)
+    return -1;
+  *v = r->p[0] | (r->p[1] << 8) | (r->p[2] << 16) |
+    ((unsigned int)r->p[3] << 24);
+  r->p += 4;
+  r->left -= 4;
+  return 0;
+}
+
+static int
+ndr_skip(struct ndr *r, size_t n)
+{
+  if (r->left < n)
+    return -1;
+  r->p += n;
+  r->left -= n;
+  return 0;
+}
+
+static int
+ndr_align(struct ndr *r)
+{
+  return ndr_skip(r, (4 - (r->p - r->base) % 4) % 4);
+}
+
+static unsigned int
+ndr_at(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/* Deferred RPC_UNICODE_STRING: max count, offset, count, UTF-16 */
+static int
+ndr_skip_string(struct ndr *r)
+{
+  unsigned int max, offset, count;
+
+  if (ndr_u32(r, &max) || ndr_u32(r, &offset) || ndr_u32(r, &count) ||
+      count > max || ndr_skip(r, count * 2ULL))
+    return -1;
+  return ndr_align(r);
+}
+
+/* Deferred RPC_SID: max count, revision, count, authority, sub authorities */
+static int
+ndr_sid(struct ndr *r, char *sid)
+{
+  unsigned long long authority = 0;
+  unsigned int max, count, sub;
+  int i, n;
+
+  if (ndr_u32(r, &max) || r->left < 8)
+    return -1;
+  count = r->p[1];
+  if (count > 15 || count != max)
+    return -1;
+  for (i = 2; i < 8; ++i)
+    authority = (authority << 8) | r->p[i];
+  n = sprintf(sid, "S-%u-%llu", r->p[0], authority);
+  ndr_skip(r, 8);
+  for (i = 0; i < (int)count; ++i) {
+    if (ndr_u32(r, &sub))
+      return -1;
+    n += sprintf(sid + n, "-%u", sub);
+  }
+  return 0;
+}
+
+/* Groups, RIDs and SIDs being collected */
+struct groups {
+  unsigned int *rids;
+  int rid_count;
+  char (*sids)[SID_MAX];
+  int sid_count;
+};
+
+static int
+cmp_rid(const void *a, const void *b)
+{
+  unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static int
+cmp_sid(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* GROUP_MEMBERSHIP array: max count, then (RID, attributes) pairs */
+static int
+ndr_groups(struct ndr *r, unsigned int count, unsigned int *rids, int *n)
+{
+  unsigned int max, rid, attributes, i;
+
+  if (ndr_u32(r, &max) || max != count)
+    return -1;
+  for (i = 0; i < count; ++i) {
+    if (ndr_u32(r, &rid) || ndr_u32(r, &attributes))
+      return -1;
+    if (attributes & GROUP_ENABLED)
+      rids[(*n)++] = rid;
+  }
+  return 0;
+}
+
+/*
+ * KERB_VALIDATION_INFO. The fixed part has the counts and pointers
+ * (non zero when the deferred data follows); deferred data comes after
+ * it, in field order.
+ */
+#define KVI_FIXED 216
+#define KVI_STRING(off) ((off) + 4)
+#define KVI_USER_ID 100
+#define KVI_PRIMARY_GROUP 104
+#define KVI_GROUP_COUNT 108
+#define KVI_GROUP_IDS 112
+#define KVI_LOGON_SERVER 136
+#define KVI_LOGON_DOMAIN 144
+#define KVI_DOMAIN_ID 152
+#define KVI_SID_COUNT 196
+#define KVI_EXTRA_SIDS 200
+#define KVI_RESOURCE_DOMAIN 204
+#define KVI_RESOURCE_COUNT 208
+#define KVI_RESOURCE_IDS 212
+
+static krb5_error_code
+decode_logon_info(const krb5_data *data, k5_pac *out, char *domain,
+		  struct groups *g)
+{
+  struct ndr r;
+  const unsigned char *f;
+  unsigned int group_count, sid_count, resource_count, i, v;
+  char resource[SID_MAX];
+  unsigned int *resource_rids = NULL;
+  int n = 0, string;
+  krb5_error_code code = EINVAL;
+  static const int strings[] = { 48, 56, 64, 72, 80, 88 };
+
+  r.base = (const unsigned char *)data->data;
+  r.p = r.base;
+  r.left = data->length;
+
+  /* Type serialization version 1, little endian, then the referent */
+  if (r.left < 20 + KVI_FIXED || r.p[0] != 1 || r.p[1] != 0x10)
+    return EINVAL;
+  ndr_skip(&r, 20);
+  f = r.p;
+  ndr_skip(&r, KVI_FIXED);
+
+  out->user_rid = ndr_at(f + KVI_USER_ID);
+  out->primary_group_rid = ndr_at(f + KVI_PRIMARY_GROUP);
+  group_count = ndr_at(f + KVI_GROUP_COUNT);
+  sid_count = ndr_at(f + KVI_SID_COUNT);
+  resource_count = ndr_at(f + KVI_RESOURCE_COUNT);
+  if (group_count > 65536 || sid_count > 65536 || resource_count > 65536)
+    return EINVAL;
+
+  g->rids = malloc((group_count + 1) * sizeof (*g->rids));
+  g->sids = malloc((sid_count + resource_count + 1) * sizeof (*g->sids));
+  resource_rids = malloc((resource_count + 1) * sizeof (*resource_rids));
+  if (!g->rids || !g->sids || !resource_rids) {
+    free(resource_rids);
+    return ENOMEM;
+  }
+
+  for (string = 0; string < 6; ++string)
+    if (ndr_at(f + KVI_STRING(strings[string])) && ndr_skip_string(&r))
+      goto bad;
+
+  g->rids[g->rid_count++] = out->primary_group_rid;
+  if (ndr_at(f + KVI_GROUP_IDS) &&
+      ndr_groups(&r, group_count, g->rids, &g->rid_count))
+    goto bad;
+
+  if ((ndr_at(f + KVI_STRING(KVI_LOGON_SERVER)) && ndr_skip_string(&r)) ||
+      (ndr_at(f + KVI_STRING(KVI_LOGON_DOMAIN)) && ndr_skip_string(&r)))
+    goto bad;
+
+  domain[0] = '\0';
+  if (ndr_at(f + KVI_DOMAIN_ID) && ndr_sid(&r, domain))
+    goto bad;
+
+  /* KERB_SID_AND_ATTRIBUTES array, then each SID */
+  if (ndr_at(f + KVI_EXTRA_SIDS)) {
+    unsigned int *attributes = malloc((sid_count + 1) * 2 * sizeof (v));
+
+    if (!attributes) {
+      code = ENOMEM;
+      goto bad;
+    }
+    if (ndr_u32(&r, &v) || v != sid_count) {
+      free(attributes);
+      goto bad;
+    }
+    for (i = 0; i < sid_count; ++i)
+      if (ndr_u32(&r, &attributes[2 * i]) ||
+	  ndr_u32(&r, &attributes[2 * i + 1])) {
+	free(attributes);
+	goto bad;
+      }
+    for (i = 0; i < sid_count; ++i) {
+      char sid[SID_MAX];
+
+      if (!attributes[2 * i])
+	continue ;
+      if (ndr_sid(&r, sid)) {
+	free(attributes);
+	goto bad;
+      }
+      if (attributes[2 * i + 1] & GROUP_ENABLED)
+	strcpy(g->sids[g->sid_count++], sid);
+    }
+    free(attributes);
+  }
+
+  /* Resource groups are RIDs of another domain */
+  if (ndr_at(f + KVI_RESOURCE_DOMAIN) && ndr_sid(&r, resource))
+    goto bad;
+  if (ndr_at(f + KVI_RESOURCE_IDS) && ndr_at(f + KVI_RESOURCE_DOMAIN)) {
+    if (ndr_groups(&r, resource_count, resource_rids, &n))
+      goto bad;
+    for (i = 0; i < (unsigned int)n; ++i)
+      snprintf(g->sids[g->sid_count++], SID_MAX, "%s-%u", resource,
+	       resource_rids[i]);
+  }
+
+  free(resource_rids);
+  return 0;
+
+ bad:
+  free(resource_rids);
+  return code;
+}
+
+/* One allocation: blob, SID pointers, RIDs, then strings */
+static struct pac_blob *
+build_blob(const k5_pac *pac, const char *domain, struct groups *g)
+{
+  struct pac_blob *blob;
+  size_t size;
+  char *p;
+  int i, n;
+
+  qsort(g->rids, g->rid_count, sizeof (*g->rids), cmp_rid);
+  for (i = n = 0; i < g->rid_count; ++i)
+    if (!n || g->rids[n - 1] != g->rids[i])
+      g->rids[n++] = g->rids[i];
+  g->rid_count = n;
+
+  size = sizeof (*blob) + g->rid_count * sizeof (unsigned int) +
+    g->sid_count * sizeof (char *) + strlen(domain) + 1;
+  for (i = 0; i < g->sid_count; ++i)
+    size += strlen(g->sids[i]) + 1;
+
+  blob = malloc(size);
+  if (!blob)
+    return NULL;
+  blob->refs = 1;
+  blob->pac = *pac;
+  /* Pointers first, they need the strictest alignment */
+  blob->pac.sids = (char **)(blob + 1);
+  blob->pac.groups = (unsigned int *)(blob->pac.sids + g->sid_count);
+  memcpy(blob->pac.groups, g->rids, g->rid_count * sizeof (unsigned int));
+  blob->pac.group_count = g->rid_count;
+  p = (char *)(blob->pac.groups + g->rid_count);
+  blob->pac.domain_sid = p;
+  p += sprintf(p, "%s", domain) + 1;
+  for (i = 0; i < g->sid_count; ++i) {
+    blob->pac.sids[i] = p;
+    p += sprintf(p, "%s", g->sids[i]) + 1;
+  }
+
+  qsort(blob->pac.sids, g->sid_count, sizeof (char *), cmp_sid);
+  for (i = n = 0; i < g->sid_count; ++i)
+    if (!n || strcmp(blob->pac.sids[n - 1], blob->pac.sids[i]))
+      blob->pac.sids[n++] = blob->pac.sids[i];
+  blob->pac.sid_count = n;
+  return blob;
+}
+
+/* Find the PAC inside the AD-IF-RELEVANT containers */
+static krb5_error_code
+find_pac(k5_context k5, krb5_authdata **authdata, krb5_pac *pac)
+{
+  krb5_error_code code = ENOENT;
+  int i, j;
+
+  for (i = 0; authdata && authdata[i] && code == ENOENT; ++i) {
+    krb5_authdata **inner = NULL;
+
+    if (authdata[i]->ad_type != KRB5_AUTHDATA_IF_RELEVANT ||
+	krb5_decode_authdata_container(k5->ctx, KRB5_AUTHDATA_IF_RELEVANT,
+				       authdata[i], &inner))
+      continue ;
+    for (j = 0; inner[j]; ++j) {
+      if (inner[j]->ad_type == KRB5_AUTHDATA_WIN2K_PAC) {
+	code = krb5_pac_parse(k5->ctx, inner[j]->contents,
+			      inner[j]->length, pac);
+	break ;
+      }
+    }
+    krb5_free_authdata(k5->ctx, inner);
+  }
+  return code;
+}
+
+static krb5_error_code
+decode_pac(k5_context k5, krb5_ticket *ticket, krb5_keytab keytab,
+	   krb5_keyblock *server_key, struct pac_blob **blobp)
+{
+  krb5_enc_tkt_part *enc = ticket->enc_part2;
+  krb5_keytab_entry entry;
+  krb5_pac pac = NULL;
+  krb5_data info;
+  krb5_error_code code;
+  struct groups g;
+  k5_pac out;
+  char domain[SID_MAX];
+
+  memset(&g, 0, sizeof (g));
+  memset(&out, 0, sizeof (out));
+  memset(&info, 0, sizeof (info));
+
+  if ((code = find_pac(k5, enc->authorization_data, &pac)))
+    return code;
+
+  /* The ticket was decrypted with this key, it signs the PAC too */
+  memset(&entry, 0, sizeof (entry));
+  if (!server_key) {
+    code = krb5_kt_get_entry(k5->ctx, keytab, ticket->server,
+			     ticket->enc_part.kvno, ticket->enc_part.enctype,
+			     &entry);
+    if (code)
+      goto cleanup;
+    server_key = &entry.key;
+  }
+  code = krb5_pac_verify(k5->ctx, pac, enc->times.authtime, enc->client,
+			 server_key, NULL);
+  if (entry.key.contents)
+    krb5_free_keytab_entry_contents(k5->ctx, &entry);
+  if (code)
+    goto cleanup;
+
+  if ((code = krb5_pac_get_buffer(k5->ctx, pac, KRB5_PAC_LOGON_INFO, &info)))
+    goto cleanup;
+  if ((code = decode_logon_info(&info, &out, domain, &g)))
+    goto cleanup;
+
+  *blobp = build_blob(&out, domain, &g);
+  if (!*blobp)
+    code = ENOMEM;
+
+ cleanup:
+  free(g.rids);
+  free(g.sids);
+  krb5_free_data_contents(k5->ctx, &info);
+  krb5_pac_free(k5->ctx, pac);
+  return code;
+}
+
+static unsigned long long
+key_hash(const unsigned char *p, size_t len)
+{
+  unsigned long long h = 0xcbf29ce484222325ULL;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static void
+entry_clear(struct pac_entry *e)
+{
+  if (e->blob)
+    k5_pac_release(&e->blob->pac);
+  free(e->key);
+  memset(e, 0, sizeof (*e));
+}
+
+/* Look the ticket up, returns a new reference */
+static struct pac_blob *
+cache_get(struct k5_pac_cache *c, unsigned long long h, const void *key,
+	  size_t key_size, time_t now)
+{
+  struct pac_entry *set = &c->entries[(h % c->sets) * PAC_WAYS];
+  struct pac_blob *blob = NULL;
+  int i;
+
+  cache_lock(c);
+  for (i = 0; i < PAC_WAYS; ++i) {
+    struct pac_entry *e = &set[i];
+
+    if (e->blob && e->hash == h && e->key_size == key_size &&
+	e->endtime > now && !memcmp(e->key, key, key_size)) {
+      blob = e->blob;
+      pac_ref(&blob->refs);
+      break ;
+    }
+  }
+  cache_unlock(c);
+  return blob;
+}
+
+static void
+cache_put(struct k5_pac_cache *c, unsigned long long h, const void *key,
+	  size_t key_size, time_t endtime, struct pac_blob *blob)
+{
+  struct pac_entry *set = &c->entries[(h % c->sets) * PAC_WAYS], *victim;
+  void *copy = malloc(key_size);
+  int i;
+
+  if (!copy)
+    return ;
+  memcpy(copy, key, key_size);
+
+  cache_lock(c);
+  victim = &set[0];
+  for (i = 0; i < PAC_WAYS; ++i) {
+    if (!set[i].blob) {
+      victim = &set[i];
+      break ;
+    }
+    if (set[i].endtime < victim->endtime)
+      victim = &set[i];
+  }
+  entry_clear(victim);
+  victim->hash = h;
+  victim->key = copy;
+  victim->key_size = key_size;
+  victim->endtime = endtime;
+  victim->blob = blob;
+  pac_ref(&blob->refs);
+  cache_unlock(c);
+}
+
+krb5_error_code
+k5_pac_get(k5_context k5, krb5_ticket *ticket, krb5_keytab keytab,
+	   krb5_keyblock *server_key, const void *key, size_t key_size,
+	   const k5_pac **pac)
+{
+  struct k5_pac_cache *c = k5->pac_cache;
+  struct pac_blob *blob = NULL;
+  unsigned long long h = 0;
+  krb5_error_code code;
+  time_t endtime = ticket->enc_part2->times.endtime;
+
+  *pac = NULL;
+  if (c && key) {
+    h = key_hash(key, key_size);
+    blob = cache_get(c, h, key, key_size, time(NULL));
+  }
+
+  if (!blob) {
+    if ((code = decode_pac(k5, ticket, keytab, server_key, &blob)))
+      return code == ENOENT ? 0 : code;
+    if (c && key)
+      cache_put(c, h, key, key_size, endtime, blob);
+  }
+
+  *pac = &blob->pac;
+  return 0;
+}
+
+void
+k5_pac_release(const k5_pac *pac)
+{
+  struct pac_blob *blob;
+
+  if (!pac)
+    return ;
+  blob = (struct pac_blob *)((char *)pac - offsetof(struct pac_blob, pac));
+  if (!pac_unref(&blob->refs))
+    free(blob);
+}
+
+void
+k5_pac_cache_free(k5_context k5)
+{
+  struct k5_pac_cache *c = k5->pac_cache;
+  int i;
+
+  k5->pac_cache = NULL;
+  if (!c)
+    return ;
+  for (i = 0; i < c->sets * PAC_WAYS; ++i)
+    entry_clear(&c->entries[i]);
+#if !defined(_WIN32)
+  pthread_mutex_destroy(&c->lock);
+#endif
+  free(c->entries);
+  free(c);
+}
+
+krb5_error_code K5_EXPORT
+k5_set_pac_cache(k5_context k5, int entries)
+{
+  struct k5_pac_cache *c = NULL;
+
+  assert(k5);
+
+  if (entries > 0) {
+    c = calloc(1, sizeof (*c));
+    if (!c)
+      return ENOMEM;
+    c->sets = (entries + PAC_WAYS - 1) / PAC_WAYS;
+    c->entries = calloc(c->sets * PAC_WAYS, sizeof (*c->entries));
+    if (!c->entries) {
+      free(c);
+      return ENOMEM;
+    }
+#if !defined(_WIN32)
+    pthread_mutex_init(&c->lock, NULL);
+#endif
+  }
+
+  k5_pac_cache_free(k5);
+  k5->pac_cache = c;
+  k5->pac_enabled = entries >= 0;
+  return 0;
+}
+
+int K5_EXPORT
+k5_pac_has_group(const k5_pac *pac, unsigned int rid)
+{
+  assert(pac);
+
+  return bsearch(&rid, pac->groups, pac->group_count,
+		 sizeof (*pac->groups), cmp_rid) != NULL;
+}
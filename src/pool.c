@@ -0,0 +1,398 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "k5_priv.h"
+
+#if defined(_WIN32)
+
+krb5_error_code K5_EXPORT
+k5_accept_pool_create(k5_context k5, int threads, k5_accept_pool *pool)
+{
+  return ENOSYS;
+}
+
+krb5_error_code K5_EXPORT
+k5_accept_batch(k5_accept_pool pool, const void *const *tokens,
+		const size_t *lens, int n, k5_accepted *out,
+		krb5_error_code *codes)
+{
+  return ENOSYS;
+}
+
+int K5_EXPORT
+k5_accept_pool_stats(k5_accept_pool pool, k5_accept_worker_stats *stats,
+		     int n)
+{
+  return 0;
+}
+
+void K5_EXPORT
+k5_accept_pool_free(k5_accept_pool pool)
+{
+}
+
+#else
+
+/*
+ * Workers have their own k5_context, in quiet mode, sharing the parent
+ * context's keytab index, replay and PAC caches. Keytabs which aren't
+ * files are loaded by the parent context before each batch and resolved
+ * by name in the workers: MEMORY: keytabs are shared by name, so there's
+ * a single copy of the keys.
+ *
+ * A batch is published under the lock, then workers claim tokens one
+ * at a time with an atomic counter, so slow tokens don't hold others
+ * back. Results are written at the token's index. The batch ends once
+ * every token is done and every worker has left it.
+ */
+
+struct worker {
+  k5_accept_pool pool;
+  k5_context k5;
+  krb5_keytab kt;
+  unsigned int generation;
+  pthread_t thread;
+  k5_accept_worker_stats stats;
+};
+
+struct _k5_accept_pool {
+  k5_context k5;
+  int count;
+  struct worker *workers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  int stopping;
+
+  /* Current batch */
+  unsigned long batch;
+  int busy;
+  const void *const *tokens;
+  const size_t *lens;
+  k5_accepted *out;
+  krb5_error_code *codes;
+  int n;
+  volatile int next;
+  int finished;
+  /* Workers in the current batch */
+  int active;
+
+  /* Keytab to use, changes when the parent reloads it */
+  char kt_name[1024];
+  unsigned int generation;
+};
+
+static double
+thread_cpu(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+    return 0;
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Follow the parent's keytab, called at the start of each batch */
+static void
+worker_keytab(struct worker *w)
+{
+  k5_accept_pool pool = w->pool;
+
+  if (w->kt && w->generation == pool->generation)
+    return ;
+  if (w->kt)
+    krb5_kt_close(w->k5->ctx, w->kt);
+  w->kt = NULL;
+  if (!krb5_kt_resolve(w->k5->ctx, pool->kt_name, &w->kt))
+    w->generation = pool->generation;
+}
+
+static void *
+worker_thread(void *arg)
+{
+  struct worker *w = arg;
+  k5_accept_pool pool = w->pool;
+  unsigned long batch = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    double start, cpu;
+    int i, accepted = 0, failed = 0;
+
+    while (!pool->stopping && batch == pool->batch)
+      pthread_cond_wait(&pool->work, &pool->lock);
+    if (pool->stopping)
+      break ;
+    batch = pool->batch;
+    /* Woken once the batch was done, don't join it */
+    if (pool->finished >= pool->n)
+      continue ;
+    /* Drops an index the worker may have opened on its own */
+    k5_keytab_index_free(w->k5);
+    w->k5->kt_index = pool->k5->kt_index;
+    if (!w->k5->kt_index)
+      worker_keytab(w);
+    w->k5->rcache = pool->k5->rcache;
+    w->k5->rcache_skew = pool->k5->rcache_skew;
+    w->k5->pac_cache = pool->k5->pac_cache;
+    w->k5->pac_enabled = pool->k5->pac_enabled;
+    pool->active++;
+    pthread_mutex_unlock(&pool->lock);
+
+    start = k5_now();
+    cpu = thread_cpu();
+    while ((i = __sync_fetch_and_add(&pool->next, 1)) < pool->n) {
+      krb5_error_code code;
+
+      if (w->kt || w->k5->kt_index)
+	code = k5_accept_keytab(w->k5, w->kt, pool->tokens[i],
+				pool->lens[i], &pool->out[i]);
+      else
+	code = k5_accept(w->k5, pool->tokens[i], pool->lens[i],
+			 &pool->out[i]);
+      if (pool->codes)
+	pool->codes[i] = code;
+      if (code)
+	failed++;
+      else
+	accepted++;
+    }
+    start = k5_now() - start;
+    cpu = thread_cpu() - cpu;
+
+    pthread_mutex_lock(&pool->lock);
+    /*
+     * The parent may replace and free its index before the next batch:
+     * drop the borrowed pointer now, k5_keytab_index_free() would read it
+     */
+    if (w->k5->kt_index == pool->k5->kt_index)
+      w->k5->kt_index = NULL;
+    w->stats.accepted += accepted;
+    w->stats.failed += failed;
+    w->stats.busy += start;
+    w->stats.cpu += cpu;
+    pool->finished += accepted + failed;
+    pool->active--;
+    if (pool->finished == pool->n && !pool->active)
+      pthread_cond_broadcast(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static void
+worker_free(struct worker *w)
+{
+  if (!w->k5)
+    return ;
+  if (w->kt)
+    krb5_kt_close(w->k5->ctx, w->kt);
+  /* The keytab index, replay and PAC caches belong to the parent */
+  w->k5->kt_index = NULL;
+  w->k5->rcache = NULL;
+  w->k5->pac_cache = NULL;
+  k5_free_context(w->k5);
+}
+
+krb5_error_code K5_EXPORT
+k5_accept_pool_create(k5_context k5, int threads, k5_accept_pool *poolp)
+{
+  k5_accept_pool pool;
+  krb5_error_code code = 0;
+  int i;
+
+  assert(k5);
+  assert(poolp);
+
+  *poolp = NULL;
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0)
+    threads = 1;
+
+  pool = calloc(1, sizeof (*pool));
+  if (!pool)
+    return ENOMEM;
+  pool->k5 = k5;
+  pool->workers = calloc(threads, sizeof (*pool->workers));
+  if (!pool->workers) {
+    free(pool);
+    return ENOMEM;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (i = 0; i < threads; ++i) {
+    struct worker *w = &pool->workers[i];
+
+    w->pool = pool;
+    if ((code = k5_init_context(&w->k5, NULL)))
+      break ;
+    k5_set_quiet(w->k5, 1);
+    if ((k5->kt_default && (code = k5_set_keytab(w->k5, k5->kt_default))) ||
+	(code = pthread_create(&w->thread, NULL, worker_thread, w))) {
+      worker_free(w);
+      break ;
+    }
+    pool->count++;
+  }
+
+  if (code) {
+    k5_err(k5, "k5_accept_pool_create", code, NULL,
+	   "while starting acceptor threads");
+    k5_accept_pool_free(pool);
+    return code;
+  }
+
+  *poolp = pool;
+  return 0;
+}
+
+krb5_error_code K5_EXPORT
+k5_accept_batch(k5_accept_pool pool, const void *const *tokens,
+		const size_t *lens, int n, k5_accepted *out,
+		krb5_error_code *codes)
+{
+  k5_context k5;
+  krb5_keytab kt;
+  k5_kinit_req req;
+  krb5_error_code code;
+  char name[sizeof (pool->kt_name)];
+
+  assert(pool);
+  assert(tokens || !n);
+  assert(lens || !n);
+  assert(out || !n);
+
+  if (n <= 0)
+    return 0;
+  k5 = pool->k5;
+
+  /*
+   * Wait for workers still in the previous batch too: they use the
+   * parent's index, which may be replaced below, and claim tokens
+   * outside the lock.
+   */
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy || pool->active)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pool->busy = 1;
+
+  /*
+   * FILE: keytabs are shared through the parent's index, which reloads
+   * itself. Others are reloaded in the parent context if they changed.
+   */
+  code = k5_keytab_index_open(k5);
+  if (code) {
+    memset(&req, 0, sizeof (req));
+    req.action = K5_KINIT_KEYTAB;
+    code = k5_keytab_get(k5, &req, &kt);
+    if (!code)
+      code = krb5_kt_get_name(k5->ctx, kt, name, sizeof (name));
+    /* Each reload gets a new MEMORY: name */
+    if (!code && strcmp(name, pool->kt_name)) {
+      strcpy(pool->kt_name, name);
+      pool->generation++;
+    }
+  }
+  if (code) {
+    k5_err(k5, "k5_accept_batch", code, k5->kt_default,
+	   "while loading keytab %s");
+    pool->busy = 0;
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+    return code;
+  }
+
+  pool->tokens = tokens;
+  pool->lens = lens;
+  pool->out = out;
+  pool->codes = codes;
+  pool->n = n;
+  pool->finished = 0;
+  pool->batch++;
+  pool->next = 0;
+  pthread_cond_broadcast(&pool->work);
+
+  while (pool->finished < n || pool->active)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pool->busy = 0;
+  pthread_cond_broadcast(&pool->done);
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+int K5_EXPORT
+k5_accept_pool_stats(k5_accept_pool pool, k5_accept_worker_stats *stats,
+		     int n)
+{
+  int i;
+
+  assert(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  for (i = 0; i < n && i < pool->count; ++i)
+    stats[i] = pool->workers[i].stats;
+  pthread_mutex_unlock(&pool->lock);
+  return i;
+}
+
+void K5_EXPORT
+k5_accept_pool_free(k5_accept_pool pool)
+{
+  int i;
+
+  if (!pool)
+    return ;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->count; ++i)
+    pthread_join(pool->workers[i].thread, NULL);
+  for (i = 0; i < pool->count; ++i)
+    worker_free(&pool->workers[i]);
+
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->workers);
+  free(pool);
+}
+
+#endif
@@ -0,0 +1,229 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include "k5_priv.h"
+
+/*
+ * Principal cache for k5_get_service_ticket(). krb5_sname_to_principal()
+ * may canonicalize the host name with forward and reverse DNS and look
+ * the realm up in [domain_realm]; the result, with its unparsed name, is
+ * kept for ttl seconds keyed by (service, host), or by the principal
+ * name when there's no service. The ccache's client principal is kept
+ * too, until k5_kinit() or k5_kdestroy() changes it.
+ *
+ * The table is made of 4-way sets, like the PAC cache; a new entry takes
+ * the place of the one which expires first. Entries are owned by the
+ * cache: callers borrow them until their next call on the context.
+ */
+
+#define PRINC_WAYS 4
+#define PRINC_TTL 300
+
+struct princ_entry {
+  unsigned int hash;
+  char *service;
+  char *host;
+  krb5_principal principal;
+  char *name;
+  time_t expires;
+};
+
+struct k5_princ_cache {
+  int sets;
+  int ttl;
+  struct princ_entry *entries;
+  krb5_principal client;
+  time_t client_expires;
+};
+
+static unsigned int
+princ_hash(const char *service, const char *host)
+{
+  unsigned int h = 2166136261u;
+
+  /* FNV-1a, with the service's NUL as separator */
+  if (service) {
+    for (; *service; ++service)
+      h = (h ^ (unsigned char)*service) * 16777619u;
+    h = (h ^ 0xff) * 16777619u;
+  }
+  for (; *host; ++host)
+    h = (h ^ (unsigned char)*host) * 16777619u;
+  return h;
+}
+
+static int
+princ_match(const struct princ_entry *e, unsigned int h,
+	    const char *service, const char *host)
+{
+  if (!e->principal || e->hash != h || strcmp(e->host, host))
+    return 0;
+  if (!service || !e->service)
+    return !service && !e->service;
+  return !strcmp(e->service, service);
+}
+
+static void
+entry_clear(k5_context k5, struct princ_entry *e)
+{
+  if (e->principal)
+    krb5_free_principal(k5->ctx, e->principal);
+  if (e->name)
+    krb5_free_unparsed_name(k5->ctx, e->name);
+  free(e->service);
+  free(e->host);
+  memset(e, 0, sizeof (*e));
+}
+
+krb5_error_code
+k5_princ_find(k5_context k5, const char *service, const char *host,
+	      krb5_principal *principal, char **name)
+{
+  struct k5_princ_cache *c = k5->princ_cache;
+  struct princ_entry *set;
+  unsigned int h;
+  time_t now = time(NULL);
+  int i;
+
+  h = princ_hash(service, host);
+  set = &c->entries[(h % c->sets) * PRINC_WAYS];
+  for (i = 0; i < PRINC_WAYS; ++i) {
+    if (princ_match(&set[i], h, service, host) && set[i].expires > now) {
+      *principal = set[i].principal;
+      *name = set[i].name;
+      return 0;
+    }
+  }
+  return ENOENT;
+}
+
+krb5_error_code
+k5_princ_add(k5_context k5, const char *service, const char *host,
+	     krb5_principal principal, char *name)
+{
+  struct k5_princ_cache *c = k5->princ_cache;
+  struct princ_entry *set, *victim;
+  char *service_copy = NULL, *host_copy;
+  unsigned int h;
+  int i;
+
+  if ((service && !(service_copy = strdup(service))) ||
+      !(host_copy = strdup(host))) {
+    free(service_copy);
+    return ENOMEM;
+  }
+
+  h = princ_hash(service, host);
+  set = &c->entries[(h % c->sets) * PRINC_WAYS];
+  victim = &set[0];
+  for (i = 0; i < PRINC_WAYS; ++i) {
+    /* An expired copy of this one, or a free way */
+    if (princ_match(&set[i], h, service, host) || !set[i].principal) {
+      victim = &set[i];
+      break ;
+    }
+    if (set[i].expires < victim->expires)
+      victim = &set[i];
+  }
+  entry_clear(k5, victim);
+  victim->hash = h;
+  victim->service = service_copy;
+  victim->host = host_copy;
+  victim->principal = principal;
+  victim->name = name;
+  victim->expires = time(NULL) + c->ttl;
+  return 0;
+}
+
+krb5_error_code
+k5_princ_client(k5_context k5, krb5_principal *client)
+{
+  struct k5_princ_cache *c = k5->princ_cache;
+
+  if (!c->client || c->client_expires <= time(NULL))
+    return ENOENT;
+  *client = c->client;
+  return 0;
+}
+
+void
+k5_princ_set_client(k5_context k5, krb5_principal client)
+{
+  struct k5_princ_cache *c = k5->princ_cache;
+
+  if (!c)
+    return ;
+  if (c->client)
+    krb5_free_principal(k5->ctx, c->client);
+  c->client = client;
+  c->client_expires = client ? time(NULL) + c->ttl : 0;
+}
+
+void
+k5_princ_cache_free(k5_context k5)
+{
+  struct k5_princ_cache *c = k5->princ_cache;
+  int i;
+
+  if (!c)
+    return ;
+  k5_princ_set_client(k5, NULL);
+  k5->princ_cache = NULL;
+  for (i = 0; i < c->sets * PRINC_WAYS; ++i)
+    entry_clear(k5, &c->entries[i]);
+  free(c->entries);
+  free(c);
+}
+
+krb5_error_code K5_EXPORT
+k5_set_principal_cache(k5_context k5, int entries, int ttl)
+{
+  struct k5_princ_cache *c = NULL;
+
+  assert(k5);
+
+  if (entries < 0 || ttl < 0)
+    return EINVAL;
+
+  if (entries > 0) {
+    c = calloc(1, sizeof (*c));
+    if (!c)
+      return ENOMEM;
+    c->sets = (entries + PRINC_WAYS - 1) / PRINC_WAYS;
+    c->ttl = ttl ? ttl : PRINC_TTL;
+    c->entries = calloc(c->sets * PRINC_WAYS, sizeof (*c->entries));
+    if (!c->entries) {
+      free(c);
+      return ENOMEM;
+    }
+  }
+
+  k5_princ_cache_free(k5);
+  k5->princ_cache = c;
+  return 0;
+}
@@ -0,0 +1,424 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#endif
+#if !defined(_WIN32)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "k5_priv.h"
+#if defined(HAVE_PROFILE_H)
+#include <profile.h>
+#endif
+
+/*
+ * Replay cache for k5_accept(). Authenticators are hashed with a
+ * per-cache random seed, and each hash maps to one 64 bytes bucket of 8
+ * slots. A slot is a single 64 bits word, tag << 22 | expiry, updated
+ * with compare and swap, so lookups and inserts never take a lock and
+ * the table can live in shared memory. Expired slots are reused in
+ * place; when a bucket is full of live entries the authenticator is
+ * refused rather than evicting one that could then be replayed.
+ *
+ * Two concurrent inserts of the same authenticator may pick different
+ * slots. Each one scans the bucket again after its compare and swap,
+ * and at least one of them sees the other, so they can't both succeed.
+ */
+#if defined(_MSC_VER)
+# define rc_cas(p, o, n) \
+  (InterlockedCompareExchange64((volatile LONGLONG *)(p), (n), (o)) == (LONGLONG)(o))
+# define rc_cas_ptr(p, o, n) \
+  (InterlockedCompareExchangePointer((volatile PVOID *)(p), (n), (o)) == (o))
+#else
+# define rc_cas(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+# define rc_cas_ptr(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#endif
+
+#define RC_SLOTS 8
+#define RC_TIME_BITS 22
+#define RC_TIME_MASK ((1ULL << RC_TIME_BITS) - 1)
+#define RC_MAGIC 0x6b35726361636865ULL	/* "k5rcache" */
+#define RC_DEFAULT_SIZE (4 << 20)
+#define RC_MIN_BUCKETS 64
+
+struct rc_header {
+  volatile unsigned long long magic;
+  unsigned long long size;
+  unsigned long long buckets;
+  unsigned long long seed;
+  char pad[32];
+};
+
+struct rc_bucket {
+  volatile unsigned long long slots[RC_SLOTS];
+};
+
+struct k5_rcache {
+  struct rc_header *hdr;
+  struct rc_bucket *buckets;
+  int shared;
+};
+
+/* K5_RCACHE_MEMORY table, shared by every context of the process */
+static struct k5_rcache *process_cache;
+
+static unsigned long long
+rc_mix(unsigned long long h)
+{
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+static unsigned long long
+rc_hash(unsigned long long seed, const unsigned char *p, size_t len)
+{
+  unsigned long long h = seed ^ (len * 0x9e3779b97f4a7c15ULL), w;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    h = rc_mix(h ^ w);
+  }
+  w = 0;
+  memcpy(&w, p, len);
+  return rc_mix(h ^ w ^ ((unsigned long long)len << 56));
+}
+
+/* Expiry times wrap every 2^22 seconds, compare them within half that */
+static int
+rc_expired(unsigned long long slot, time_t now)
+{
+  unsigned long long d = ((unsigned long long)now - slot) & RC_TIME_MASK;
+
+  return d < (1ULL << (RC_TIME_BITS - 1));
+}
+
+static void
+rc_layout(struct k5_rcache *rc, void *base)
+{
+  rc->hdr = base;
+  rc->buckets = (struct rc_bucket *)((char *)base + sizeof (struct rc_header));
+}
+
+static size_t
+rc_size(size_t size)
+{
+  size_t buckets;
+
+  if (!size)
+    size = RC_DEFAULT_SIZE;
+  buckets = (size - sizeof (struct rc_header)) / sizeof (struct rc_bucket);
+  if (size < sizeof (struct rc_header) || buckets < RC_MIN_BUCKETS)
+    buckets = RC_MIN_BUCKETS;
+  return sizeof (struct rc_header) + buckets * sizeof (struct rc_bucket);
+}
+
+static void
+rc_init_header(k5_context k5, struct rc_header *hdr, size_t size)
+{
+  krb5_data seed;
+
+  hdr->size = size;
+  hdr->buckets = (size - sizeof (*hdr)) / sizeof (struct rc_bucket);
+  seed.magic = KV5M_DATA;
+  seed.length = sizeof (hdr->seed);
+  seed.data = (char *)&hdr->seed;
+  if (krb5_c_random_make_octets(k5->ctx, &seed))
+    hdr->seed = rc_mix((unsigned long long)time(NULL) ^ (size_t)hdr);
+}
+
+static krb5_error_code
+rc_memory(k5_context k5, size_t size, struct k5_rcache **rcp)
+{
+  struct k5_rcache *rc;
+  void *base;
+
+  if (process_cache) {
+    *rcp = process_cache;
+    return 0;
+  }
+
+  size = rc_size(size);
+  rc = calloc(1, sizeof (*rc));
+  base = calloc(1, size);
+  if (!rc || !base) {
+    free(rc);
+    free(base);
+    return ENOMEM;
+  }
+  rc_layout(rc, base);
+  rc_init_header(k5, rc->hdr, size);
+  rc->hdr->magic = RC_MAGIC;
+
+  /* Another thread may have been faster */
+  if (!rc_cas_ptr(&process_cache, NULL, rc)) {
+    free(base);
+    free(rc);
+  }
+  *rcp = process_cache;
+  return 0;
+}
+
+#if defined(_WIN32)
+
+static krb5_error_code
+rc_shared(k5_context k5, const char *name, size_t size,
+	  struct k5_rcache **rcp)
+{
+  return ENOSYS;
+}
+
+static void
+rc_unmap(struct k5_rcache *rc)
+{
+}
+
+#else
+
+/*
+ * The creator sizes and initializes the segment, then sets the magic
+ * number; the others wait for it. The segment stays until shm_unlink().
+ */
+static krb5_error_code
+rc_shared(k5_context k5, const char *name, size_t size,
+	  struct k5_rcache **rcp)
+{
+  struct k5_rcache *rc;
+  struct stat st;
+  void *base = MAP_FAILED;
+  int fd, created = 1, tries;
+  krb5_error_code code = 0;
+
+  size = rc_size(size);
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = 0;
+    fd = shm_open(name, O_RDWR, 0);
+  }
+  if (fd < 0)
+    return errno;
+
+  /* Anyone else could forge the header or wipe slots to allow replays */
+  if (fstat(fd, &st)) {
+    code = errno;
+    goto cleanup;
+  }
+  if (st.st_uid != geteuid() || (st.st_mode & 077)) {
+    code = EACCES;
+    goto cleanup;
+  }
+
+  if (created) {
+    if (ftruncate(fd, size)) {
+      code = errno;
+      goto cleanup;
+    }
+  } else {
+    /* Wait for the creator to size the segment */
+    for (tries = 0; tries < 1000; ++tries) {
+      if (fstat(fd, &st)) {
+	code = errno;
+	goto cleanup;
+      }
+      if ((size_t)st.st_size >= sizeof (struct rc_header))
+	break ;
+      usleep(1000);
+    }
+    size = st.st_size;
+    if (size < sizeof (struct rc_header)) {
+      code = EAGAIN;
+      goto cleanup;
+    }
+  }
+
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    code = errno;
+    goto cleanup;
+  }
+
+  rc = calloc(1, sizeof (*rc));
+  if (!rc) {
+    code = ENOMEM;
+    goto cleanup;
+  }
+  rc_layout(rc, base);
+  rc->shared = 1;
+
+  if (created) {
+    rc_init_header(k5, rc->hdr, size);
+    __sync_synchronize();
+    rc->hdr->magic = RC_MAGIC;
+  } else {
+    for (tries = 0; tries < 1000 && rc->hdr->magic != RC_MAGIC; ++tries)
+      usleep(1000);
+    __sync_synchronize();
+    if (rc->hdr->magic != RC_MAGIC || rc->hdr->size != size ||
+	!rc->hdr->buckets || rc->hdr->buckets !=
+	(size - sizeof (struct rc_header)) / sizeof (struct rc_bucket)) {
+      code = rc->hdr->magic != RC_MAGIC ? EAGAIN : EINVAL;
+      free(rc);
+      goto cleanup;
+    }
+  }
+
+  *rcp = rc;
+  base = MAP_FAILED;
+
+ cleanup:
+  if (base != MAP_FAILED)
+    munmap(base, size);
+  if (code && created)
+    shm_unlink(name);
+  close(fd);
+  return code;
+}
+
+static void
+rc_unmap(struct k5_rcache *rc)
+{
+  munmap(rc->hdr, rc->hdr->size);
+  free(rc);
+}
+
+#endif
+
+krb5_error_code
+k5_rcache_check(k5_context k5, const void *data, size_t len, time_t ctime)
+{
+  struct k5_rcache *rc = k5->rcache;
+  struct rc_bucket *b;
+  unsigned long long h, tag, value, slot, old = 0;
+  time_t now = time(NULL);
+  int i, free_slot;
+
+  if (ctime > now + k5->rcache_skew || ctime < now - k5->rcache_skew)
+    return KRB5KRB_AP_ERR_SKEW;
+
+  h = rc_hash(rc->hdr->seed, data, len);
+  b = &rc->buckets[h % rc->hdr->buckets];
+  tag = rc_mix(h ^ rc->hdr->seed) >> RC_TIME_BITS;
+  value = (tag << RC_TIME_BITS) |
+    ((unsigned long long)(ctime + k5->rcache_skew) & RC_TIME_MASK);
+  /* 0 is an empty slot */
+  if (!value)
+    value = 1ULL << RC_TIME_BITS;
+
+ retry:
+  free_slot = -1;
+  for (i = 0; i < RC_SLOTS; ++i) {
+    slot = b->slots[i];
+    if (!slot || rc_expired(slot, now)) {
+      if (free_slot < 0) {
+	free_slot = i;
+	old = slot;
+      }
+      continue ;
+    }
+    if (slot >> RC_TIME_BITS == value >> RC_TIME_BITS)
+      return KRB5KRB_AP_ERR_REPEAT;
+  }
+
+  if (free_slot < 0)
+    return KRB5_RC_IO_SPACE;
+  if (!rc_cas(&b->slots[free_slot], old, value))
+    goto retry;
+
+  for (i = 0; i < RC_SLOTS; ++i) {
+    slot = b->slots[i];
+    if (i != free_slot && slot && !rc_expired(slot, now) &&
+	slot >> RC_TIME_BITS == value >> RC_TIME_BITS)
+      return KRB5KRB_AP_ERR_REPEAT;
+  }
+  return 0;
+}
+
+void
+k5_rcache_free(k5_context k5)
+{
+  if (k5->rcache && k5->rcache->shared)
+    rc_unmap(k5->rcache);
+  k5->rcache = NULL;
+}
+
+krb5_error_code K5_EXPORT
+k5_set_replay_cache(k5_context k5, enum k5_rcache_type type,
+		    const char *name, size_t size)
+{
+  struct k5_rcache *rc = NULL;
+#if defined(HAVE_PROFILE_H)
+  profile_t profile;
+#endif
+  krb5_error_code code = 0;
+  int skew = 300;
+
+  assert(k5);
+
+  switch (type) {
+  case K5_RCACHE_DEFAULT:
+    break ;
+  case K5_RCACHE_MEMORY:
+    code = rc_memory(k5, size, &rc);
+    break ;
+  case K5_RCACHE_SHARED:
+    if (!name)
+      return EINVAL;
+    code = rc_shared(k5, name, size, &rc);
+    break ;
+  default:
+    return EINVAL;
+  }
+  if (code) {
+    k5_err(k5, "k5_set_replay_cache", code, name,
+	   "while opening replay cache %s");
+    return code;
+  }
+
+#if defined(HAVE_PROFILE_H)
+  if (!krb5_get_profile(k5->ctx, &profile)) {
+    profile_get_integer(profile, "libdefaults", "clockskew", NULL, skew,
+			&skew);
+    profile_release(profile);
+  }
+#endif
+
+  k5_rcache_free(k5);
+  k5->rcache = rc;
+  k5->rcache_skew = skew;
+  return 0;
+}
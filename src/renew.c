@@ -0,0 +1,529 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "k5_priv.h"
+
+#if defined(_WIN32)
+
+krb5_error_code K5_EXPORT
+k5_auto_renew_start(k5_context k5, k5_kinit_req *req)
+{
+  return ENOSYS;
+}
+
+void K5_EXPORT
+k5_auto_renew_stop(k5_context k5)
+{
+}
+
+#else
+
+/*
+ * One thread per process renews the TGT of every registered context.
+ * Entries sit in a min-heap ordered by their next check. Each entry has
+ * its own k5_context on the same ccache, so the renewal thread never
+ * touches the application's krb5_context.
+ *
+ * lock protects the heap and the thread state. control serializes
+ * k5_auto_renew_start() and k5_auto_renew_stop(), which may have to
+ * join the thread. fork() waits for the renewal in progress, if any, so
+ * that no krb5 call is interrupted halfway in the child.
+ */
+
+/* Renew once 80% of the lifetime is gone, +/- 5% */
+#define RENEW_AT 0.8
+#define RENEW_JITTER 0.05
+/* Retry delays after a failure, doubled each time */
+#define BACKOFF_MIN 5
+#define BACKOFF_MAX 600
+
+struct k5_renew {
+  k5_context owner;
+  k5_context k5;
+  k5_kinit_req req;
+  int has_req;
+  time_t next;
+  int failures;
+  int index;
+};
+
+static pthread_mutex_t control = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_t thread;
+static int running;
+static int stopping;
+static int forking;
+/* Entry being renewed, out of the heap */
+static struct k5_renew *current;
+static struct k5_renew **heap;
+static int heap_count;
+static int heap_size;
+static unsigned long long seed;
+
+static double
+jitter(void)
+{
+  /* xorshift, only called with lock held */
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (double)(seed >> 11) / (double)(1ULL << 53) * 2 - 1;
+}
+
+static void
+heap_swap(int a, int b)
+{
+  struct k5_renew *tmp = heap[a];
+
+  heap[a] = heap[b];
+  heap[b] = tmp;
+  heap[a]->index = a;
+  heap[b]->index = b;
+}
+
+static void
+heap_up(int i)
+{
+  while (i > 0 && heap[(i - 1) / 2]->next > heap[i]->next) {
+    heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void
+heap_down(int i)
+{
+  while (1) {
+    int l = 2 * i + 1, r = l + 1, m = i;
+
+    if (l < heap_count && heap[l]->next < heap[m]->next)
+      m = l;
+    if (r < heap_count && heap[r]->next < heap[m]->next)
+      m = r;
+    if (m == i)
+      break ;
+    heap_swap(i, m);
+    i = m;
+  }
+}
+
+static int
+heap_push(struct k5_renew *e)
+{
+  if (heap_count == heap_size) {
+    int size = heap_size ? heap_size * 2 : 16;
+    struct k5_renew **tmp = realloc(heap, size * sizeof (*heap));
+
+    if (!tmp)
+      return ENOMEM;
+    heap = tmp;
+    heap_size = size;
+  }
+  heap[heap_count] = e;
+  e->index = heap_count++;
+  heap_up(e->index);
+  return 0;
+}
+
+static void
+heap_remove(struct k5_renew *e)
+{
+  int i = e->index;
+
+  if (i < 0)
+    return ;
+  heap_count--;
+  if (i != heap_count) {
+    heap[i] = heap[heap_count];
+    heap[i]->index = i;
+    heap_down(i);
+    heap_up(heap[i]->index);
+  }
+  e->index = -1;
+}
+
+static void
+entry_free(struct k5_renew *e)
+{
+  free(e->req.principal_name);
+  free(e->req.service_name);
+  free(e->req.keytab_name);
+  free((void *)e->req.keytab_data);
+  k5_free_context(e->k5);
+  free(e);
+}
+
+static int
+tgt_times(k5_context k5, time_t *start, time_t *end, time_t *renew_till,
+	  int *renewable)
+{
+  k5_klist_entries klist;
+  const char *realm;
+  char *tgt;
+  int i, found = 0;
+
+  if (k5_klist(k5, &klist))
+    return 0;
+
+  /* krbtgt/REALM@REALM for the client's realm, not a cross-realm TGT */
+  realm = klist.defname ? strrchr(klist.defname, '@') : NULL;
+  realm = realm ? realm + 1 : "";
+  tgt = malloc(2 * strlen(realm) + 9);
+  if (!tgt) {
+    k5_clear_klist(k5, &klist);
+    return 0;
+  }
+  sprintf(tgt, "krbtgt/%s@%s", realm, realm);
+
+  for (i = 0; i < klist.count; ++i) {
+    k5_ticket *t = &klist.tickets[i];
+
+    if (!t->server_name || strcmp(t->server_name, tgt))
+      continue ;
+    *start = t->starttime;
+    *end = t->endtime;
+    *renew_till = t->renew_till;
+    *renewable = strchr(t->flags, 'R') != NULL;
+    found = 1;
+    break ;
+  }
+  free(tgt);
+  k5_clear_klist(k5, &klist);
+  return found;
+}
+
+/*
+ * Check the TGT of one entry, renew it or get a new one if it's due.
+ * Called without the lock. Returns the time of the next check, or 0 to
+ * retry with backoff.
+ */
+static time_t
+renew_one(struct k5_renew *e, double jitter_factor)
+{
+  time_t start, end, renew_till, now = time(NULL), due;
+  k5_kinit_req req;
+  k5_ticket ticket;
+  int renewable, valid;
+
+  valid = tgt_times(e->k5, &start, &end, &renew_till, &renewable) &&
+    end > now;
+
+  if (valid) {
+    due = start + (end - start) * (RENEW_AT + RENEW_JITTER * jitter_factor);
+    if (due > now)
+      return due;
+  }
+
+  if (valid && renewable && renew_till > end) {
+    memset(&req, 0, sizeof (req));
+    req.action = K5_RENEW;
+    req.principal_name = e->req.principal_name;
+  } else if (e->has_req) {
+    req = e->req;
+  } else {
+    /* Nothing left to do but wait for the application */
+    return valid ? end : 0;
+  }
+
+  if (k5_kinit(e->k5, &req, &ticket))
+    return 0;
+
+  start = ticket.starttime;
+  end = ticket.endtime;
+  k5_clear_ticket(e->k5, &ticket);
+
+  due = start + (end - start) * (RENEW_AT + RENEW_JITTER * jitter_factor);
+  return due > now ? due : now + 1;
+}
+
+static void *
+renew_thread(void *arg)
+{
+  pthread_mutex_lock(&lock);
+  while (!stopping) {
+    struct k5_renew *e;
+    struct timespec ts;
+    time_t now = time(NULL), next;
+    double factor;
+
+    if (!heap_count || forking) {
+      pthread_cond_wait(&cond, &lock);
+      continue ;
+    }
+
+    e = heap[0];
+    if (e->next > now) {
+      ts.tv_sec = e->next;
+      ts.tv_nsec = 0;
+      pthread_cond_timedwait(&cond, &lock, &ts);
+      continue ;
+    }
+
+    heap_remove(e);
+    current = e;
+    factor = jitter();
+    pthread_mutex_unlock(&lock);
+
+    next = renew_one(e, factor);
+
+    pthread_mutex_lock(&lock);
+    current = NULL;
+    pthread_cond_broadcast(&cond);
+    if (!e->owner)
+      continue ;
+
+    if (next) {
+      e->failures = 0;
+    } else {
+      int delay = BACKOFF_MIN << (e->failures < 10 ? e->failures : 10);
+
+      if (delay > BACKOFF_MAX)
+	delay = BACKOFF_MAX;
+      delay += delay * RENEW_JITTER * jitter();
+      next = time(NULL) + (delay > 1 ? delay : 1);
+      e->failures++;
+    }
+    e->next = next;
+    heap_push(e);
+  }
+  running = 0;
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+static void
+atfork_prepare(void)
+{
+  pthread_mutex_lock(&control);
+  pthread_mutex_lock(&lock);
+  forking = 1;
+  while (current)
+    pthread_cond_wait(&cond, &lock);
+}
+
+static void
+atfork_parent(void)
+{
+  forking = 0;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&control);
+}
+
+/*
+ * Only the forking thread survives. The child doesn't renew the
+ * parent's contexts, which the parent keeps renewing on the same
+ * ccaches; k5_auto_renew_start() in the child registers a context again
+ * and starts a thread there.
+ */
+static void
+atfork_child(void)
+{
+  int i;
+
+  pthread_mutex_init(&control, NULL);
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+  forking = 0;
+  running = 0;
+  stopping = 0;
+  seed ^= (unsigned long long)getpid() << 32;
+
+  /* Entries stay with their contexts, freed by k5_auto_renew_stop() */
+  for (i = 0; i < heap_count; ++i)
+    heap[i]->index = -1;
+  heap_count = 0;
+}
+
+static void
+renew_init(void)
+{
+  seed = ((unsigned long long)time(NULL) << 20) ^ getpid() ^
+    0x9e3779b97f4a7c15ULL;
+  pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+}
+
+static char *
+strdup_null(const char *s)
+{
+  return s ? strdup(s) : NULL;
+}
+
+/* Called with control held */
+static void
+renew_stop(k5_context k5)
+{
+  struct k5_renew *e = k5->renew;
+  int last;
+
+  if (!e)
+    return ;
+
+  pthread_mutex_lock(&lock);
+  k5->renew = NULL;
+  e->owner = NULL;
+  heap_remove(e);
+  while (current == e)
+    pthread_cond_wait(&cond, &lock);
+
+  last = !heap_count && !current && running;
+  if (last) {
+    stopping = 1;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (last)
+    pthread_join(thread, NULL);
+  entry_free(e);
+}
+
+krb5_error_code K5_EXPORT
+k5_auto_renew_start(k5_context k5, k5_kinit_req *req)
+{
+  struct k5_renew *e;
+  krb5_error_code code;
+  char *name;
+
+  assert(k5);
+
+  if ((code = k5_cc_open(k5)))
+    return code;
+
+  pthread_once(&once, renew_init);
+  pthread_mutex_lock(&control);
+  renew_stop(k5);
+
+  e = calloc(1, sizeof (*e));
+  if (!e) {
+    pthread_mutex_unlock(&control);
+    return ENOMEM;
+  }
+  e->owner = k5;
+  e->index = -1;
+
+  name = malloc(strlen(krb5_cc_get_type(k5->ctx, k5->cc)) +
+		strlen(krb5_cc_get_name(k5->ctx, k5->cc)) + 2);
+  if (!name) {
+    free(e);
+    pthread_mutex_unlock(&control);
+    return ENOMEM;
+  }
+  sprintf(name, "%s:%s", krb5_cc_get_type(k5->ctx, k5->cc),
+	  krb5_cc_get_name(k5->ctx, k5->cc));
+  code = k5_init_context(&e->k5, name);
+  free(name);
+  if (code) {
+    free(e);
+    pthread_mutex_unlock(&control);
+    return code;
+  }
+  k5_set_quiet(e->k5, 1);
+  /* K5_KINIT_KEYTAB without a keytab name uses the context's keytab */
+  if (k5->kt_default && (code = k5_set_keytab(e->k5, k5->kt_default))) {
+    k5_free_context(e->k5);
+    free(e);
+    pthread_mutex_unlock(&control);
+    return code;
+  }
+
+  if (req && (req->action == K5_KINIT_PW || req->action == K5_KINIT_KEYTAB)) {
+    e->req = *req;
+    e->req.principal_name = strdup_null(req->principal_name);
+    e->req.service_name = strdup_null(req->service_name);
+    e->req.keytab_name = strdup_null(req->keytab_name);
+    e->req.keytab_data = NULL;
+    if (req->keytab_data) {
+      void *data = malloc(req->keytab_size ? req->keytab_size : 1);
+
+      if (data)
+	memcpy(data, req->keytab_data, req->keytab_size);
+      e->req.keytab_data = data;
+    }
+    e->has_req = 1;
+    if ((req->principal_name && !e->req.principal_name) ||
+	(req->service_name && !e->req.service_name) ||
+	(req->keytab_name && !e->req.keytab_name) ||
+	(req->keytab_data && !e->req.keytab_data))
+      code = ENOMEM;
+  } else if (req) {
+    e->req.principal_name = strdup_null(req->principal_name);
+    if (req->principal_name && !e->req.principal_name)
+      code = ENOMEM;
+  }
+  if (code) {
+    pthread_mutex_unlock(&control);
+    entry_free(e);
+    return code;
+  }
+
+  pthread_mutex_lock(&lock);
+  e->next = time(NULL);
+  code = heap_push(e);
+  if (!code && !running) {
+    stopping = 0;
+    code = pthread_create(&thread, NULL, renew_thread, NULL);
+    if (!code)
+      running = 1;
+    else
+      heap_remove(e);
+  }
+  if (!code) {
+    k5->renew = e;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&control);
+
+  if (code)
+    entry_free(e);
+  return code;
+}
+
+void K5_EXPORT
+k5_auto_renew_stop(k5_context k5)
+{
+  assert(k5);
+
+  if (!k5->renew)
+    return ;
+
+  pthread_mutex_lock(&control);
+  renew_stop(k5);
+  pthread_mutex_unlock(&control);
+}
+
+#endif
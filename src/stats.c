@@ -0,0 +1,242 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include "k5_priv.h"
+
+/* Upper bounds in seconds, the last bucket is +Inf */
+static const double bounds[K5_STAT_BUCKETS - 1] = {
+  0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0
+};
+
+static const char *op_names[K5_STAT_MAX] = {
+  "as", "tgs", "renew", "validate", "klist", "cc_read", "cc_write", "gss",
+  "accept"
+};
+
+double
+k5_now(void)
+{
+#if defined(_WIN32)
+  LARGE_INTEGER freq, count;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / freq.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+void
+k5_stat_record(k5_context k5, enum k5_stat_op op, double start,
+	       krb5_error_code code)
+{
+  k5_stat_counter *c = &k5->stats.ops[op];
+  double elapsed = k5_now() - start;
+  int i;
+
+  for (i = 0; i < K5_STAT_BUCKETS - 1; ++i)
+    if (elapsed <= bounds[i])
+      break ;
+  c->buckets[i]++;
+  c->sum += elapsed;
+
+  if (!code) {
+    c->success++;
+    return ;
+  }
+  c->failure++;
+
+  for (i = 0; i < K5_STAT_ERRORS; ++i) {
+    k5_stat_error *e = &k5->stats.errors[i];
+
+    if (e->count && e->code != code)
+      continue ;
+    e->code = code;
+    e->count++;
+    return ;
+  }
+  k5->stats.other_errors++;
+}
+
+krb5_error_code K5_EXPORT
+k5_get_stats(k5_context k5, k5_stats *stats)
+{
+  assert(k5);
+  assert(stats);
+
+  memcpy(stats, &k5->stats, sizeof (*stats));
+  return 0;
+}
+
+void K5_EXPORT
+k5_reset_stats(k5_context k5)
+{
+  assert(k5);
+
+  memset(&k5->stats, 0, sizeof (k5->stats));
+}
+
+double K5_EXPORT
+k5_stats_bucket_bound(int bucket)
+{
+  if (bucket < 0 || bucket >= K5_STAT_BUCKETS - 1)
+    return -1;
+  return bounds[bucket];
+}
+
+struct buf {
+  char *data;
+  size_t len;
+  size_t size;
+  int failed;
+};
+
+static void
+buf_printf(struct buf *b, const char *fmt, ...)
+{
+  va_list ap;
+  char *tmp;
+  int n;
+
+  if (b->failed)
+    return ;
+
+  while (1) {
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0) {
+      b->failed = 1;
+      return ;
+    }
+    if ((size_t)n < b->size - b->len)
+      break ;
+
+    tmp = realloc(b->data, (b->size + n) * 2);
+    if (!tmp) {
+      b->failed = 1;
+      return ;
+    }
+    b->data = tmp;
+    b->size = (b->size + n) * 2;
+  }
+  b->len += n;
+}
+
+/* Label values can't hold raw quotes, backslashes or newlines */
+static void
+buf_label(struct buf *b, const char *value)
+{
+  for (; *value; ++value) {
+    if (*value == '"' || *value == '\\')
+      buf_printf(b, "\\%c", *value);
+    else if (*value == '\n')
+      buf_printf(b, "\\n");
+    else
+      buf_printf(b, "%c", *value);
+  }
+}
+
+krb5_error_code K5_EXPORT
+k5_stats_prometheus(k5_context k5, char **out)
+{
+  struct buf b;
+  int op, i;
+
+  assert(k5);
+  assert(out);
+
+  memset(&b, 0, sizeof (b));
+  b.size = 4096;
+  b.data = malloc(b.size);
+  if (!b.data)
+    return ENOMEM;
+
+  buf_printf(&b, "# HELP libk5_operations_total libk5 operations by result.\n"
+	     "# TYPE libk5_operations_total counter\n");
+  for (op = 0; op < K5_STAT_MAX; ++op) {
+    buf_printf(&b, "libk5_operations_total{op=\"%s\",result=\"success\"} %lu\n",
+	       op_names[op], k5->stats.ops[op].success);
+    buf_printf(&b, "libk5_operations_total{op=\"%s\",result=\"failure\"} %lu\n",
+	       op_names[op], k5->stats.ops[op].failure);
+  }
+
+  buf_printf(&b, "# HELP libk5_operation_duration_seconds libk5 operation latency.\n"
+	     "# TYPE libk5_operation_duration_seconds histogram\n");
+  for (op = 0; op < K5_STAT_MAX; ++op) {
+    k5_stat_counter *c = &k5->stats.ops[op];
+    unsigned long total = 0;
+
+    for (i = 0; i < K5_STAT_BUCKETS; ++i) {
+      total += c->buckets[i];
+      if (i < K5_STAT_BUCKETS - 1)
+	buf_printf(&b, "libk5_operation_duration_seconds_bucket"
+		   "{op=\"%s\",le=\"%g\"} %lu\n", op_names[op], bounds[i], total);
+      else
+	buf_printf(&b, "libk5_operation_duration_seconds_bucket"
+		   "{op=\"%s\",le=\"+Inf\"} %lu\n", op_names[op], total);
+    }
+    buf_printf(&b, "libk5_operation_duration_seconds_sum{op=\"%s\"} %.9f\n",
+	       op_names[op], c->sum);
+    buf_printf(&b, "libk5_operation_duration_seconds_count{op=\"%s\"} %lu\n",
+	       op_names[op], total);
+  }
+
+  buf_printf(&b, "# HELP libk5_errors_total libk5 errors by code.\n"
+	     "# TYPE libk5_errors_total counter\n");
+  for (i = 0; i < K5_STAT_ERRORS; ++i) {
+    k5_stat_error *e = &k5->stats.errors[i];
+
+    if (!e->count)
+      continue ;
+    buf_printf(&b, "libk5_errors_total{code=\"%ld\",message=\"",
+	       (long)e->code);
+    buf_label(&b, error_message(e->code));
+    buf_printf(&b, "\"} %lu\n", e->count);
+  }
+  buf_printf(&b, "libk5_errors_total{code=\"other\",message=\"\"} %lu\n",
+	     k5->stats.other_errors);
+
+  if (b.failed) {
+    free(b.data);
+    return ENOMEM;
+  }
+  *out = b.data;
+  return 0;
+}
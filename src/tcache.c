@@ -0,0 +1,555 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "k5_priv.h"
+
+/*
+ * Credentials as client \0 server \0 then the fields, in native byte
+ * order: they don't leave the host. Used by the shared ticket cache and
+ * k5d.
+ */
+struct buf {
+  unsigned char *p;
+  size_t left;
+};
+
+static int
+put(struct buf *b, const void *data, size_t len)
+{
+  if (b->left < len)
+    return -1;
+  if (len)
+    memcpy(b->p, data, len);
+  b->p += len;
+  b->left -= len;
+  return 0;
+}
+
+static int
+put_u32(struct buf *b, krb5_int32 v)
+{
+  return put(b, &v, sizeof (v));
+}
+
+static int
+put_data(struct buf *b, const void *data, unsigned int len)
+{
+  return put_u32(b, len) || put(b, data, len);
+}
+
+static int
+get(struct buf *b, void *data, size_t len)
+{
+  if (b->left < len)
+    return -1;
+  memcpy(data, b->p, len);
+  b->p += len;
+  b->left -= len;
+  return 0;
+}
+
+static int
+get_u32(struct buf *b, krb5_int32 *v)
+{
+  return get(b, v, sizeof (*v));
+}
+
+static int
+get_data(struct buf *b, krb5_data *data)
+{
+  krb5_int32 len;
+
+  if (get_u32(b, &len) || len < 0 || (size_t)len > b->left)
+    return -1;
+  data->magic = KV5M_DATA;
+  data->length = len;
+  data->data = malloc(len ? len : 1);
+  return !data->data || get(b, data->data, len);
+}
+
+static int
+creds_put(struct buf *b, krb5_creds *creds)
+{
+  return put_u32(b, creds->keyblock.enctype) ||
+    put_data(b, creds->keyblock.contents, creds->keyblock.length) ||
+    put_u32(b, creds->times.authtime) ||
+    put_u32(b, creds->times.starttime) ||
+    put_u32(b, creds->times.endtime) ||
+    put_u32(b, creds->times.renew_till) ||
+    put_u32(b, creds->is_skey) || put_u32(b, creds->ticket_flags) ||
+    put_data(b, creds->ticket.data, creds->ticket.length) ||
+    put_data(b, creds->second_ticket.data, creds->second_ticket.length);
+}
+
+static krb5_error_code
+creds_get(k5_context k5, struct buf *b, const char *client,
+	  const char *server, krb5_creds **credsp)
+{
+  krb5_creds *creds;
+  krb5_data key;
+  krb5_int32 v;
+  krb5_error_code code;
+
+  creds = calloc(1, sizeof (*creds));
+  if (!creds)
+    return ENOMEM;
+  creds->magic = KV5M_CREDS;
+
+  if ((code = krb5_parse_name(k5->ctx, client, &creds->client)) ||
+      (code = krb5_parse_name(k5->ctx, server, &creds->server)))
+    goto cleanup;
+
+  code = KRB5_CC_FORMAT;
+  if (get_u32(b, &v))
+    goto cleanup;
+  creds->keyblock.magic = KV5M_KEYBLOCK;
+  creds->keyblock.enctype = v;
+  if (get_data(b, &key))
+    goto cleanup;
+  creds->keyblock.contents = (krb5_octet *)key.data;
+  creds->keyblock.length = key.length;
+  if (get_u32(b, &creds->times.authtime) ||
+      get_u32(b, &creds->times.starttime) ||
+      get_u32(b, &creds->times.endtime) ||
+      get_u32(b, &creds->times.renew_till) || get_u32(b, &v))
+    goto cleanup;
+  creds->is_skey = v;
+  if (get_u32(b, &creds->ticket_flags) || get_data(b, &creds->ticket) ||
+      get_data(b, &creds->second_ticket))
+    goto cleanup;
+
+  *credsp = creds;
+  return 0;
+
+ cleanup:
+  krb5_free_creds(k5->ctx, creds);
+  return code;
+}
+
+size_t
+k5_creds_size(const char *client, const char *server, krb5_creds *creds)
+{
+  return strlen(client) + strlen(server) + 2 + 10 * 4 +
+    creds->keyblock.length + creds->ticket.length +
+    creds->second_ticket.length;
+}
+
+krb5_error_code
+k5_creds_encode(const char *client, const char *server, krb5_creds *creds,
+		void *data, size_t size, size_t *len)
+{
+  struct buf b;
+
+  b.p = data;
+  b.left = size;
+  if (put(&b, client, strlen(client) + 1) ||
+      put(&b, server, strlen(server) + 1) || creds_put(&b, creds))
+    return KRB5_CC_NOMEM;
+  *len = size - b.left;
+  return 0;
+}
+
+krb5_error_code
+k5_creds_decode(k5_context k5, const void *data, size_t len,
+		krb5_creds **creds)
+{
+  const char *client = data, *server, *end;
+  struct buf b;
+
+  /* Two strings first */
+  end = memchr(client, '\0', len);
+  if (!end)
+    return KRB5_CC_FORMAT;
+  server = end + 1;
+  end = memchr(server, '\0', len - (server - client));
+  if (!end)
+    return KRB5_CC_FORMAT;
+
+  b.p = (unsigned char *)end + 1;
+  b.left = len - (b.p - (const unsigned char *)data);
+  return creds_get(k5, &b, client, server, creds);
+}
+
+#if defined(_WIN32)
+
+krb5_error_code K5_EXPORT
+k5_set_ticket_cache(k5_context k5, const char *name, size_t size)
+{
+  return name ? ENOSYS : 0;
+}
+
+krb5_error_code
+k5_tcache_get(k5_context k5, const char *client, const char *server,
+	      krb5_creds **creds)
+{
+  return KRB5_CC_NOTFOUND;
+}
+
+void
+k5_tcache_put(k5_context k5, const char *client, const char *server,
+	      krb5_creds *creds)
+{
+}
+
+void
+k5_tcache_free(k5_context k5)
+{
+}
+
+#else
+
+/*
+ * Service tickets shared by the processes of one user, in a POSIX shared
+ * memory segment. The table is open addressing over fixed size slots,
+ * keyed by client and server principal; a key lives in one of
+ * TC_PROBES slots from its hash.
+ *
+ * Each slot has a sequence number, odd while it is written. Writers
+ * take a slot by moving its sequence from even to odd with compare and
+ * swap, and give up if another one has it: the ticket will be shared by
+ * the next fetch. Readers copy the slot out and retry if the sequence
+ * moved meanwhile, so they never wait on a writer. A writer which died
+ * in the middle leaves the slot odd; it is taken over after a while.
+ * The writer's start time is in the high 32 bits of the sequence, so
+ * the takeover check and the compare and swap see the same write. A
+ * writer publishes with compare and swap too, and drops its write when
+ * it was taken over.
+ */
+
+#define TC_MAGIC 0x6b35746b63616332ULL	/* "k5tkcac2" */
+#define TC_SLOT_SIZE 8192
+#define TC_DEFAULT_SIZE (4 << 20)
+#define TC_MIN_SLOTS 16
+#define TC_PROBES 8
+#define TC_READ_TRIES 4
+/* Seconds after which an unfinished write is abandoned */
+#define TC_STALE 5
+
+struct tc_header {
+  volatile unsigned long long magic;
+  unsigned long long size;
+  unsigned long long slots;
+  unsigned long long slot_size;
+  char pad[32];
+};
+
+struct tc_slot {
+  /* Start time of the last write << 32 | count, odd while written */
+  volatile unsigned long long seq;
+  unsigned long long hash;
+  long long endtime;
+  unsigned int len;
+  unsigned int key_len;
+  /* client \0 server \0, then the serialized credentials */
+  unsigned char data[TC_SLOT_SIZE - 32];
+};
+
+struct k5_tcache {
+  struct tc_header *hdr;
+  struct tc_slot *slots;
+};
+
+static unsigned long long
+tc_hash(const char *client, const char *server)
+{
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  const unsigned char *p;
+
+  for (p = (const unsigned char *)client; *p; ++p)
+    h = (h ^ *p) * 0x100000001b3ULL;
+  h = (h ^ 0xff) * 0x100000001b3ULL;
+  for (p = (const unsigned char *)server; *p; ++p)
+    h = (h ^ *p) * 0x100000001b3ULL;
+  /* 0 is an empty slot */
+  return h ? h : 1;
+}
+
+static size_t
+tc_size(size_t size)
+{
+  size_t slots;
+
+  if (!size)
+    size = TC_DEFAULT_SIZE;
+  slots = size > sizeof (struct tc_header) ?
+    (size - sizeof (struct tc_header)) / sizeof (struct tc_slot) : 0;
+  if (slots < TC_MIN_SLOTS)
+    slots = TC_MIN_SLOTS;
+  return sizeof (struct tc_header) + slots * sizeof (struct tc_slot);
+}
+
+/*
+ * Same dance as the shared replay cache: the creator sizes the segment
+ * and sets the magic number last. The segment must belong to us and be
+ * closed to everyone else, it holds session keys.
+ */
+static krb5_error_code
+tc_open(const char *name, size_t size, struct k5_tcache **tcp)
+{
+  struct k5_tcache *tc;
+  struct stat st;
+  void *base = MAP_FAILED;
+  int fd, created = 1, tries;
+  krb5_error_code code = 0;
+
+  size = tc_size(size);
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = 0;
+    fd = shm_open(name, O_RDWR, 0);
+  }
+  if (fd < 0)
+    return errno;
+
+  if (fstat(fd, &st)) {
+    code = errno;
+    goto cleanup;
+  }
+  if (st.st_uid != geteuid() || (st.st_mode & 077)) {
+    code = EACCES;
+    goto cleanup;
+  }
+
+  if (created) {
+    if (ftruncate(fd, size)) {
+      code = errno;
+      goto cleanup;
+    }
+  } else {
+    for (tries = 0; tries < 1000; ++tries) {
+      if ((size_t)st.st_size >= sizeof (struct tc_header))
+	break ;
+      usleep(1000);
+      if (fstat(fd, &st)) {
+	code = errno;
+	goto cleanup;
+      }
+    }
+    size = st.st_size;
+    if (size < sizeof (struct tc_header)) {
+      code = EAGAIN;
+      goto cleanup;
+    }
+  }
+
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    code = errno;
+    goto cleanup;
+  }
+
+  tc = calloc(1, sizeof (*tc));
+  if (!tc) {
+    code = ENOMEM;
+    goto cleanup;
+  }
+  tc->hdr = base;
+  tc->slots = (struct tc_slot *)((char *)base + sizeof (struct tc_header));
+
+  if (created) {
+    tc->hdr->size = size;
+    tc->hdr->slot_size = sizeof (struct tc_slot);
+    tc->hdr->slots = (size - sizeof (struct tc_header)) /
+      sizeof (struct tc_slot);
+    __sync_synchronize();
+    tc->hdr->magic = TC_MAGIC;
+  } else {
+    for (tries = 0; tries < 1000 && tc->hdr->magic != TC_MAGIC; ++tries)
+      usleep(1000);
+    __sync_synchronize();
+    if (tc->hdr->magic != TC_MAGIC || tc->hdr->size != size ||
+	tc->hdr->slot_size != sizeof (struct tc_slot)) {
+      code = tc->hdr->magic != TC_MAGIC ? EAGAIN : EINVAL;
+      free(tc);
+      goto cleanup;
+    }
+  }
+
+  *tcp = tc;
+  base = MAP_FAILED;
+
+ cleanup:
+  if (base != MAP_FAILED)
+    munmap(base, size);
+  if (code && created)
+    shm_unlink(name);
+  close(fd);
+  return code;
+}
+
+/* Copy a slot out, 0 if it was stable and holds key */
+static int
+tc_read(struct tc_slot *slot, unsigned long long hash, const char *key,
+	size_t key_len, struct tc_slot *copy)
+{
+  unsigned long long seq;
+  int tries;
+
+  for (tries = 0; tries < TC_READ_TRIES; ++tries) {
+    seq = slot->seq;
+    __sync_synchronize();
+    if (seq & 1)
+      return -1;
+    if (slot->hash != hash)
+      return -1;
+    copy->endtime = slot->endtime;
+    copy->len = slot->len;
+    copy->key_len = slot->key_len;
+    if (copy->len <= sizeof (copy->data))
+      memcpy(copy->data, slot->data, copy->len);
+    __sync_synchronize();
+    if (slot->seq != seq)
+      continue ;
+    return copy->len > sizeof (copy->data) || copy->key_len != key_len ||
+      memcmp(copy->data, key, key_len);
+  }
+  return -1;
+}
+
+krb5_error_code
+k5_tcache_get(k5_context k5, const char *client, const char *server,
+	      krb5_creds **creds)
+{
+  struct k5_tcache *tc = k5->tcache;
+  unsigned long long h = tc_hash(client, server);
+  size_t cl = strlen(client) + 1, key_len = cl + strlen(server) + 1;
+  struct tc_slot *copy;
+  char *key;
+  time_t now = time(NULL);
+  krb5_error_code code = KRB5_CC_NOTFOUND;
+  int i;
+
+  if (key_len > sizeof (copy->data))
+    return KRB5_CC_NOTFOUND;
+  copy = malloc(sizeof (*copy) + key_len);
+  if (!copy)
+    return ENOMEM;
+  key = (char *)(copy + 1);
+  memcpy(key, client, cl);
+  memcpy(key + cl, server, key_len - cl);
+
+  for (i = 0; i < TC_PROBES; ++i) {
+    struct tc_slot *slot = &tc->slots[(h + i) % tc->hdr->slots];
+
+    if (tc_read(slot, h, key, key_len, copy))
+      continue ;
+    if (copy->endtime <= now)
+      break ;
+    code = k5_creds_decode(k5, copy->data, copy->len, creds);
+    break ;
+  }
+
+  free(copy);
+  return code;
+}
+
+void
+k5_tcache_put(k5_context k5, const char *client, const char *server,
+	      krb5_creds *creds)
+{
+  struct k5_tcache *tc = k5->tcache;
+  unsigned long long h = tc_hash(client, server), seq, writing, count;
+  struct tc_slot *slot, *victim = NULL;
+  size_t len;
+  time_t now = time(NULL);
+  int i;
+
+  /* Same key, else empty or expired, else the one expiring first */
+  for (i = 0; i < TC_PROBES; ++i) {
+    slot = &tc->slots[(h + i) % tc->hdr->slots];
+    if (slot->hash == h) {
+      victim = slot;
+      break ;
+    }
+    if (!victim || victim->endtime > slot->endtime)
+      victim = slot;
+  }
+
+  /* Taking over an abandoned write moves the sequence too */
+  seq = victim->seq;
+  if ((seq & 1) && now - (long long)(seq >> 32) < TC_STALE)
+    return ;
+  count = (seq & 0xffffffffULL) + ((seq & 1) ? 2 : 1);
+  writing = ((unsigned long long)now << 32) | (count & 0xffffffffULL);
+  if (!__sync_bool_compare_and_swap(&victim->seq, seq, writing))
+    return ;
+
+  victim->hash = 0;
+  if (!k5_creds_encode(client, server, creds, victim->data,
+		       sizeof (victim->data), &len)) {
+    victim->hash = h;
+    victim->endtime = creds->times.endtime;
+    victim->key_len = strlen(client) + strlen(server) + 2;
+    victim->len = len;
+  }
+
+  /* Fails if the write was taken over, the new writer publishes */
+  __sync_bool_compare_and_swap(&victim->seq, writing, writing + 1);
+}
+
+void
+k5_tcache_free(k5_context k5)
+{
+  struct k5_tcache *tc = k5->tcache;
+
+  k5->tcache = NULL;
+  if (!tc)
+    return ;
+  munmap(tc->hdr, tc->hdr->size);
+  free(tc);
+}
+
+krb5_error_code K5_EXPORT
+k5_set_ticket_cache(k5_context k5, const char *name, size_t size)
+{
+  struct k5_tcache *tc = NULL;
+  krb5_error_code code;
+
+  assert(k5);
+
+  if (name && (code = tc_open(name, size, &tc))) {
+    k5_err(k5, "k5_set_ticket_cache", code, name,
+	   "while opening ticket cache %s");
+    return code;
+  }
+
+  k5_tcache_free(k5);
+  k5->tcache = tc;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,257 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#endif
+
+#include "k5_priv.h"
+
+/*
+ * Finished spans are published in a ring of slots, each one guarded by
+ * a sequence number: odd while the slot is being written, 2 * (id + 1)
+ * once span id is complete. Readers (k5_get_trace() may be called from
+ * another thread) check the sequence again after copying a slot: if it
+ * changed, the span was overwritten in the meantime and is skipped.
+ */
+#if defined(_MSC_VER)
+# define ring_claim(p) (InterlockedIncrement((volatile LONG *)(p)) - 1)
+# define ring_barrier() MemoryBarrier()
+#else
+# define ring_claim(p) __sync_fetch_and_add((p), 1)
+# define ring_barrier() __sync_synchronize()
+#endif
+
+struct slot {
+  volatile unsigned long seq;
+  k5_trace_span span;
+};
+
+struct k5_trace {
+  volatile unsigned long head;
+  int size;
+  /* Span being built, only touched by the thread using the context */
+  int depth;
+  k5_trace_span cur;
+  struct slot slots[1];
+};
+
+static void
+copy_message(char *dst, const char *src)
+{
+  size_t len = strlen(src);
+
+  if (len >= K5_TRACE_MESSAGE)
+    len = K5_TRACE_MESSAGE - 1;
+  /* krb5 trace messages don't end with a newline, but be safe */
+  while (len && (src[len - 1] == '\n' || src[len - 1] == '\r'))
+    len--;
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+}
+
+static void
+trace_callback(krb5_context ctx, const krb5_trace_info *info, void *data)
+{
+  k5_context k5 = data;
+
+  /* Called with NULL info when the krb5 context goes away */
+  if (!info || !k5->trace || !k5->trace->depth)
+    return ;
+  k5_span_event(k5, info->message);
+}
+
+void
+k5_span_begin(k5_context k5, const char *op, const char *service,
+	      const char *name)
+{
+  struct k5_trace *t = k5->trace;
+  k5_trace_span *s = &t->cur;
+
+  if (t->depth++) {
+    /* Nested call (k5_get_service_ticket_gss), keep the outer span */
+    k5_span_event(k5, op);
+    return ;
+  }
+
+  s->count = 0;
+  s->dropped = 0;
+  s->code = 0;
+  s->elapsed = 0;
+  s->start = k5_now();
+  s->op = op;
+  if (!name)
+    name = "<default>";
+  if (service)
+    snprintf(s->principal, sizeof (s->principal), "%s/%s", service, name);
+  else
+    copy_message(s->principal, name);
+}
+
+void
+k5_span_event(k5_context k5, const char *message)
+{
+  k5_trace_span *s = &k5->trace->cur;
+  k5_trace_event *e;
+
+  if (s->count == K5_TRACE_EVENTS) {
+    s->dropped++;
+    return ;
+  }
+  e = &s->events[s->count++];
+  e->offset = k5_now() - s->start;
+  copy_message(e->message, message);
+}
+
+void
+k5_span_end(k5_context k5, krb5_error_code code)
+{
+  struct k5_trace *t = k5->trace;
+  struct slot *slot;
+  unsigned long id;
+
+  if (--t->depth)
+    return ;
+
+  t->cur.elapsed = k5_now() - t->cur.start;
+  t->cur.code = code;
+
+  id = ring_claim(&t->head);
+  t->cur.id = id;
+  slot = &t->slots[id % t->size];
+
+  slot->seq = 2 * id + 1;
+  ring_barrier();
+  memcpy(&slot->span, &t->cur,
+	 offsetof(k5_trace_span, events) +
+	 t->cur.count * sizeof (t->cur.events[0]));
+  ring_barrier();
+  slot->seq = 2 * (id + 1);
+}
+
+krb5_error_code K5_EXPORT
+k5_set_trace(k5_context k5, int spans)
+{
+  struct k5_trace *t = NULL;
+  krb5_error_code code;
+
+  assert(k5);
+
+  if (spans < 0)
+    return EINVAL;
+
+  if (spans) {
+    t = calloc(1, sizeof (*t) + (spans - 1) * sizeof (t->slots[0]));
+    if (!t)
+      return ENOMEM;
+    t->size = spans;
+  }
+
+  code = krb5_set_trace_callback(k5->ctx, spans ? trace_callback : NULL, k5);
+  if (code) {
+    k5_err(k5, "k5_set_trace", code, NULL, "while setting trace callback");
+    free(t);
+    return code;
+  }
+
+  free(k5->trace);
+  k5->trace = t;
+  return 0;
+}
+
+int K5_EXPORT
+k5_get_trace(k5_context k5, k5_trace_span *spans, int n)
+{
+  struct k5_trace *t;
+  unsigned long head, id, first;
+  int count = 0;
+
+  assert(k5);
+
+  t = k5->trace;
+  if (!t || n <= 0)
+    return 0;
+
+  head = t->head;
+  ring_barrier();
+  if (n > t->size)
+    n = t->size;
+  first = head > (unsigned long)n ? head - n : 0;
+
+  for (id = first; id < head; ++id) {
+    struct slot *slot = &t->slots[id % t->size];
+    unsigned long seq = slot->seq;
+
+    if (seq != 2 * (id + 1))
+      continue ;
+    ring_barrier();
+    memcpy(&spans[count], &slot->span, sizeof (spans[count]));
+    ring_barrier();
+    if (slot->seq != seq)
+      continue ;
+    count++;
+  }
+  return count;
+}
+
+void K5_EXPORT
+k5_trace_dump(k5_context k5, FILE *out, int n)
+{
+  k5_trace_span *spans;
+  int count, i, j;
+
+  assert(k5);
+  assert(out);
+
+  if (!k5->trace || n <= 0)
+    return ;
+  if (n > k5->trace->size)
+    n = k5->trace->size;
+
+  spans = malloc(n * sizeof (*spans));
+  if (!spans)
+    return ;
+
+  count = k5_get_trace(k5, spans, n);
+  for (i = 0; i < count; ++i) {
+    k5_trace_span *s = &spans[i];
+
+    fprintf(out, "#%lu %s %s: %.3f ms", s->id, s->op, s->principal,
+	    s->elapsed * 1000);
+    if (s->code)
+      fprintf(out, " (%s)", error_message(s->code));
+    fprintf(out, "\n");
+    for (j = 0; j < s->count; ++j)
+      fprintf(out, "  +%9.3f ms  %s\n", s->events[j].offset * 1000,
+	      s->events[j].message);
+    if (s->dropped)
+      fprintf(out, "  (%d more events dropped)\n", s->dropped);
+  }
+  free(spans);
+}
@@ -0,0 +1,280 @@
+/* This file is part of libk5
+ *
+ * Copyright (C) 2009-2010 commonIT
+ *
+ * Author: Corentin Chary <cchary@commonit.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(HAVE_SYS_TIMERFD_H)
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+#include "k5_priv.h"
+
+/*
+ * The descriptor is a timerfd on the realtime clock (ticket times are
+ * wall clock times), armed at the earliest endtime - threshold among the
+ * watched tickets. The ccache is only scanned when the watch is set up,
+ * when the timer fires and when the TGT changes; new service tickets
+ * only move the timer earlier.
+ */
+
+#if defined(HAVE_SYS_TIMERFD_H)
+
+static int
+is_tgt(krb5_creds *creds)
+{
+  krb5_principal p = creds->server;
+
+  return p->length == 2 && p->data[0].length == 6 &&
+    !memcmp(p->data[0].data, "krbtgt", 6);
+}
+
+static int
+watched(k5_context k5, krb5_creds *creds)
+{
+  if (krb5_is_config_principal(k5->ctx, creds->server))
+    return 0;
+  return !(k5->watch_flags & K5_WATCH_TGT) || is_tgt(creds);
+}
+
+static krb5_error_code
+watch_arm(k5_context k5, time_t when)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof (its));
+  /* A zero it_value disarms the timer */
+  its.it_value.tv_sec = when;
+  if (timerfd_settime(k5->watch_fd, TFD_TIMER_ABSTIME, &its, NULL))
+    return errno;
+  k5->watch_armed = when;
+  return 0;
+}
+
+/*
+ * Arm the timer for the earliest watched ticket whose notification time
+ * is after `after'. Tickets which already expired are ignored.
+ */
+static krb5_error_code
+watch_scan(k5_context k5, time_t after)
+{
+  krb5_cc_cursor cur;
+  krb5_creds creds;
+  krb5_error_code code;
+  time_t now = time(NULL), next = 0;
+
+  if ((code = krb5_cc_start_seq_get(k5->ctx, k5->cc, &cur))) {
+    k5_err(k5, "k5_watch_expiry", code, NULL,
+	   "while starting to retrieve tickets");
+    return code;
+  }
+
+  while (!(code = krb5_cc_next_cred(k5->ctx, k5->cc, &cur, &creds))) {
+    time_t end = creds.times.endtime, when = end - k5->watch_threshold;
+
+    if (watched(k5, &creds) && end > now && when > after &&
+	(!next || when < next))
+      next = when;
+    krb5_free_cred_contents(k5->ctx, &creds);
+  }
+  krb5_cc_end_seq_get(k5->ctx, k5->cc, &cur);
+  if (code != KRB5_CC_END) {
+    k5_err(k5, "k5_watch_expiry", code, NULL, "while retrieving a ticket");
+    return code;
+  }
+
+  /* Below the threshold already, fire at once */
+  if (next && next <= now)
+    next = now;
+  /* With nothing to watch, the timer stays disarmed until a new ticket */
+  return watch_arm(k5, next);
+}
+
+void
+k5_watch_update(k5_context k5, krb5_creds *creds)
+{
+  time_t when;
+
+  if (!watched(k5, creds))
+    return ;
+
+  /* A new TGT replaces the old one, which may have been the next one */
+  if (is_tgt(creds)) {
+    watch_scan(k5, 0);
+    return ;
+  }
+
+  when = creds->times.endtime - k5->watch_threshold;
+  if (!k5->watch_armed || when < k5->watch_armed)
+    watch_arm(k5, when > time(NULL) ? when : time(NULL));
+}
+
+krb5_error_code K5_EXPORT
+k5_watch_expiry(k5_context k5, int threshold, int flags, int *fd)
+{
+  krb5_error_code code;
+
+  assert(k5);
+  assert(k5->ctx);
+  assert(fd);
+
+  if (threshold < 0)
+    return EINVAL;
+  if ((code = k5_cc_open(k5)))
+    return code;
+
+  if (k5->watch_fd < 0) {
+    k5->watch_fd = timerfd_create(CLOCK_REALTIME,
+				  TFD_NONBLOCK | TFD_CLOEXEC);
+    if (k5->watch_fd < 0) {
+      code = errno;
+      k5_err(k5, "k5_watch_expiry", code, NULL, "while creating timer");
+      return code;
+    }
+  }
+
+  k5->watch_threshold = threshold;
+  k5->watch_flags = flags;
+  if ((code = watch_scan(k5, 0))) {
+    k5_watch_close(k5);
+    return code;
+  }
+
+  *fd = k5->watch_fd;
+  return 0;
+}
+
+krb5_error_code K5_EXPORT
+k5_watch_query(k5_context k5, k5_klist_entries *expiring)
+{
+  krb5_cc_cursor cur;
+  krb5_creds creds;
+  krb5_error_code code;
+  unsigned long long expirations;
+  time_t now = time(NULL);
+
+  assert(k5);
+  assert(k5->ctx);
+  assert(expiring);
+
+  memset(expiring, 0, sizeof (*expiring));
+  if (k5->watch_fd < 0)
+    return EINVAL;
+  if ((code = k5_cc_open(k5)))
+    return code;
+
+  /* Non blocking, fails with EAGAIN if the timer didn't fire */
+  if (read(k5->watch_fd, &expirations, sizeof (expirations)) < 0 &&
+      errno != EAGAIN)
+    return errno;
+
+  if ((code = krb5_cc_start_seq_get(k5->ctx, k5->cc, &cur))) {
+    k5_err(k5, "k5_watch_query", code, NULL,
+	   "while starting to retrieve tickets");
+    return code;
+  }
+
+  while (!(code = krb5_cc_next_cred(k5->ctx, k5->cc, &cur, &creds))) {
+    krb5_creds *ccreds = NULL;
+    krb5_ticket *ticket = NULL;
+    k5_ticket *tmp;
+
+    if (!watched(k5, &creds) ||
+	creds.times.endtime - k5->watch_threshold > now) {
+      krb5_free_cred_contents(k5->ctx, &creds);
+      continue ;
+    }
+
+    code = krb5_copy_creds(k5->ctx, &creds, &ccreds);
+    krb5_free_cred_contents(k5->ctx, &creds);
+    if (!code && (code = krb5_decode_ticket(&ccreds->ticket, &ticket)))
+      krb5_free_creds(k5->ctx, ccreds);
+    if (code)
+      break ;
+
+    tmp = realloc(expiring->tickets,
+		  sizeof (*expiring->tickets) * (expiring->count + 1));
+    if (!tmp ||
+	(code = k5_parse_ticket(k5, ccreds, ticket,
+				&tmp[expiring->count]))) {
+      krb5_free_creds(k5->ctx, ccreds);
+      krb5_free_ticket(k5->ctx, ticket);
+      if (tmp)
+	expiring->tickets = tmp;
+      code = tmp ? code : ENOMEM;
+      break ;
+    }
+    expiring->tickets = tmp;
+    expiring->count++;
+  }
+  krb5_cc_end_seq_get(k5->ctx, k5->cc, &cur);
+
+  if (code != KRB5_CC_END) {
+    k5_err(k5, "k5_watch_query", code, NULL, "while retrieving a ticket");
+    k5_clear_klist(k5, expiring);
+    return code;
+  }
+
+  /* Those were reported, wait for the next one */
+  return watch_scan(k5, now);
+}
+
+void
+k5_watch_close(k5_context k5)
+{
+  if (k5->watch_fd >= 0)
+    close(k5->watch_fd);
+  k5->watch_fd = -1;
+  k5->watch_armed = 0;
+}
+
+#else
+
+void
+k5_watch_update(k5_context k5, krb5_creds *creds)
+{
+}
+
+krb5_error_code K5_EXPORT
+k5_watch_expiry(k5_context k5, int threshold, int flags, int *fd)
+{
+  return ENOSYS;
+}
+
+krb5_error_code K5_EXPORT
+k5_watch_query(k5_context k5, k5_klist_entries *expiring)
+{
+  memset(expiring, 0, sizeof (*expiring));
+  return ENOSYS;
+}
+
+void
+k5_watch_close(k5_context k5)
+{
+}
+
+#endif
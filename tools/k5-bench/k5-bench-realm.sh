@@ -0,0 +1,136 @@
+#!/bin/sh
+#
+# Run k5-bench against a throwaway realm.
+#
+# Creates a temporary KDC database, adds a client principal and
+# $SPNS host/<prefix><n>.<domain> services with kadmin.local, starts
+# krb5kdc on 127.0.0.1:$PORT and runs k5-bench with any extra
+# arguments, e.g.:
+#
+#   ./k5-bench-realm.sh -t 1,4,16 -i 500 -z 1.2 -o results.json
+#
+# With RECORD=file, the client talks to k5-kdc-replay in record mode
+# in front of the KDC, and krb5's random source is seeded from
+# K5_REPLAY_SEED so the file can be replayed by k5-bench-replay.sh.
+# Keep to one thread (-t 1) so the exchanges happen in a stable order.
+#
+# Everything but the recording is removed on exit.
+
+set -e
+
+BENCH=${BENCH:-@CMAKE_CURRENT_BINARY_DIR@/k5-bench}
+REALM=${REALM:-K5BENCH.TEST}
+PORT=${PORT:-18888}
+SPNS=${SPNS:-100}
+PREFIX=${PREFIX:-bench}
+DOMAIN=${DOMAIN:-bench.test}
+SERVICE=${SERVICE:-host}
+USER_PW=${USER_PW:-k5bench}
+REPLAY_DIR=${REPLAY_DIR:-@CMAKE_BINARY_DIR@/tools/k5-kdc-replay}
+SHIM_PORT=${SHIM_PORT:-18889}
+K5_REPLAY_SEED=${K5_REPLAY_SEED:-1}
+
+for prog in kdb5_util kadmin.local krb5kdc; do
+  if ! command -v $prog >/dev/null 2>&1 &&
+     ! test -x /usr/sbin/$prog; then
+    echo "$prog not found, install the MIT KDC (krb5-kdc, krb5-admin-server)" >&2
+    exit 1
+  fi
+done
+PATH=$PATH:/usr/sbin
+export PATH
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/k5-bench.XXXXXX")
+kdc_pid=
+shim_pid=
+client_port=$PORT
+if [ -n "$RECORD" ]; then
+  client_port=$SHIM_PORT
+fi
+
+cleanup() {
+  for pid in $shim_pid $kdc_pid; do
+    kill $pid 2>/dev/null || true
+    wait $pid 2>/dev/null || true
+  done
+  rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+cat > "$dir/krb5.conf" <<EOC
+[libdefaults]
+  default_realm = $REALM
+  dns_lookup_kdc = false
+  dns_lookup_realm = false
+  dns_canonicalize_hostname = false
+  rdns = false
+
+[realms]
+  $REALM = {
+    kdc = 127.0.0.1:$client_port
+  }
+
+[domain_realm]
+  .$DOMAIN = $REALM
+EOC
+
+cat > "$dir/kdc.conf" <<EOC
+[kdcdefaults]
+  kdc_ports = $PORT
+  kdc_tcp_ports = $PORT
+
+[realms]
+  $REALM = {
+    database_name = $dir/principal
+    key_stash_file = $dir/stash
+    acl_file = $dir/kadm5.acl
+    max_life = 1d
+    max_renewable_life = 7d
+  }
+
+[logging]
+  kdc = FILE:$dir/kdc.log
+EOC
+
+: > "$dir/kadm5.acl"
+
+KRB5_CONFIG=$dir/krb5.conf
+KRB5_KDC_PROFILE=$dir/kdc.conf
+export KRB5_CONFIG KRB5_KDC_PROFILE
+
+kdb5_util create -s -r "$REALM" -P "k5bench-master" >/dev/null
+
+{
+  echo "addprinc -pw $USER_PW bench@$REALM"
+  i=0
+  while [ $i -lt $SPNS ]; do
+    echo "addprinc -randkey $SERVICE/$PREFIX$i.$DOMAIN@$REALM"
+    i=$((i + 1))
+  done
+} | kadmin.local -r "$REALM" >/dev/null 2>"$dir/kadmin.log"
+
+krb5kdc -n -r "$REALM" &
+kdc_pid=$!
+
+i=0
+until grep -q "commencing operation" "$dir/kdc.log" 2>/dev/null; do
+  i=$((i + 1))
+  if [ $i -gt 100 ] || ! kill -0 $kdc_pid 2>/dev/null; then
+    echo "krb5kdc failed to start:" >&2
+    cat "$dir/kdc.log" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+if [ -n "$RECORD" ]; then
+  "$REPLAY_DIR/k5-kdc-replay" -r "$RECORD" -u "127.0.0.1:$PORT" \
+    -l "$SHIM_PORT" &
+  shim_pid=$!
+  sleep 0.5
+  LD_PRELOAD="$REPLAY_DIR/libk5-replay-random.so${LD_PRELOAD:+:$LD_PRELOAD}"
+  export LD_PRELOAD K5_REPLAY_SEED
+fi
+
+"$BENCH" -p "bench@$REALM" -w "$USER_PW" -S "$SERVICE" -P "$PREFIX" \
+  -D "$DOMAIN" -n "$SPNS" "$@"
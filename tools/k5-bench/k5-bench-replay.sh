@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Run k5-bench against a recording made with RECORD=file
+# k5-bench-realm.sh, without any KDC:
+#
+#   ./k5-bench-replay.sh kdc.rec -t 1 -i 200 -m kinit,service-cold
+#
+# LATENCY and JITTER (milliseconds) are injected before every reply.
+# REALM, SPNS, PREFIX, DOMAIN, SERVICE, USER_PW and K5_REPLAY_SEED must
+# match the recording run, as must the k5-bench arguments that change
+# which requests are sent.
+
+set -e
+
+if [ $# -lt 1 ]; then
+  echo "Usage: $0 recording [k5-bench options]" >&2
+  exit 1
+fi
+RECORDING=$1
+shift
+
+BENCH=${BENCH:-@CMAKE_CURRENT_BINARY_DIR@/k5-bench}
+REPLAY_DIR=${REPLAY_DIR:-@CMAKE_BINARY_DIR@/tools/k5-kdc-replay}
+REALM=${REALM:-K5BENCH.TEST}
+SHIM_PORT=${SHIM_PORT:-18889}
+SPNS=${SPNS:-100}
+PREFIX=${PREFIX:-bench}
+DOMAIN=${DOMAIN:-bench.test}
+SERVICE=${SERVICE:-host}
+USER_PW=${USER_PW:-k5bench}
+LATENCY=${LATENCY:-0}
+JITTER=${JITTER:-0}
+K5_REPLAY_SEED=${K5_REPLAY_SEED:-1}
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/k5-bench.XXXXXX")
+shim_pid=
+
+cleanup() {
+  if [ -n "$shim_pid" ]; then
+    kill $shim_pid 2>/dev/null || true
+    wait $shim_pid 2>/dev/null || true
+  fi
+  rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+cat > "$dir/krb5.conf" <<EOC
+[libdefaults]
+  default_realm = $REALM
+  dns_lookup_kdc = false
+  dns_lookup_realm = false
+  dns_canonicalize_hostname = false
+  rdns = false
+  kdc_timesync = true
+
+[realms]
+  $REALM = {
+    kdc = 127.0.0.1:$SHIM_PORT
+  }
+
+[domain_realm]
+  .$DOMAIN = $REALM
+EOC
+
+KRB5_CONFIG=$dir/krb5.conf
+export KRB5_CONFIG
+
+"$REPLAY_DIR/k5-kdc-replay" -R "$RECORDING" -l "$SHIM_PORT" \
+  -L "$LATENCY" -J "$JITTER" &
+shim_pid=$!
+sleep 0.5
+
+LD_PRELOAD="$REPLAY_DIR/libk5-replay-random.so${LD_PRELOAD:+:$LD_PRELOAD}"
+export LD_PRELOAD K5_REPLAY_SEED
+
+"$BENCH" -p "bench@$REALM" -w "$USER_PW" -S "$SERVICE" -P "$PREFIX" \
+  -D "$DOMAIN" -n "$SPNS" "$@"
@@ -0,0 +1,1132 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <k5.h>
+
+#if defined(__linux__)
+#include <et/com_err.h>
+#else
+#include <com_err.h>
+#endif
+
+/*
+ * k5-bench: measure libk5 throughput and latency against a real KDC.
+ *
+ * Each worker thread owns its k5_context and MEMORY: cache, so the
+ * numbers reflect libk5/krb5 and KDC cost rather than contention on
+ * a shared cache. Service names are drawn from a Zipf distribution
+ * over --spns hosts (<service>/<prefix><n>.<domain>).
+ *
+ * With --backends, compares ccache types instead (see run_backends()).
+ *
+ * See k5-bench-realm.sh to run it against a throwaway KDC.
+ */
+
+#define BENCH_MAX_THREADS 256
+
+struct bench;
+struct worker;
+
+struct mode {
+  const char *name;
+  /* Called once in the main thread before workers are spawned */
+  int (*global_setup)(struct bench *b);
+  /* Called in each worker, not timed */
+  int (*setup)(struct worker *w);
+  /* Called before each operation, not timed */
+  krb5_error_code (*prepare)(struct worker *w);
+  /* One timed operation */
+  krb5_error_code (*op)(struct worker *w);
+  void (*teardown)(struct worker *w);
+};
+
+struct bench {
+  char *principal;
+  char *password;
+  char *service;
+  char *prefix;
+  char *domain;
+  char *modes;
+  char *backends;
+  char *output;
+  int fork;
+  int write_pct;
+  int spns;
+  double zipf;
+  int iterations;
+  int threads[32];
+  int nthreads;
+
+  char **hosts;
+  double *cdf;
+
+  /* start barrier */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int waiting;
+  int parties;
+  struct timespec start;
+};
+
+struct worker {
+  struct bench *b;
+  const struct mode *mode;
+  int id;
+  pthread_t thread;
+
+  k5_context k5;
+  k5_context cold;
+  krb5_context ctx;
+  krb5_ccache tgt_cc;
+  krb5_ccache cold_cc;
+  krb5_principal me;
+
+  unsigned long long rng;
+  double *lat;
+  int count;
+  int errors;
+  krb5_error_code last_error;
+  struct timespec end;
+};
+
+static const char *password;
+
+static void usage()
+{
+  fprintf(stderr, "Usage: k5-bench [options]\n"
+	  "\n"
+	  "-p, --principal       client principal (required)\n"
+	  "-w, --password        client password (or K5_BENCH_PASSWORD)\n"
+	  "-S, --service-name    service name (default: host)\n"
+	  "-P, --host-prefix     service host prefix (default: bench)\n"
+	  "-D, --domain          service host domain (default: bench.test)\n"
+	  "-n, --spns            number of service hosts (default: 100)\n"
+	  "-z, --zipf            zipf exponent for service hosts (default: 1.0)\n"
+	  "-t, --threads         comma separated worker counts (default: 1,2,4,8)\n"
+	  "-i, --iterations      operations per thread (default: 1000)\n"
+	  "-m, --modes           comma separated modes (default: all)\n"
+	  "                      kinit,service-cold,service-warm,gss\n"
+	  "-B, --backends        compare ccache backends instead of modes\n"
+	  "                      all or FILE,DIR,KEYRING,MEMORY,KCM\n"
+	  "-F, --fork            backends: use processes instead of threads\n"
+	  "-W, --writers         backends: percentage of writers (default: 50)\n"
+	  "-o, --output          JSON output file (default: stdout)\n");
+  exit(1);
+}
+
+static const struct option long_options[] =
+  {
+    {"principal", required_argument, NULL, 'p'},
+    {"password", required_argument, NULL, 'w'},
+    {"service-name", required_argument, NULL, 'S'},
+    {"host-prefix", required_argument, NULL, 'P'},
+    {"domain", required_argument, NULL, 'D'},
+    {"spns", required_argument, NULL, 'n'},
+    {"zipf", required_argument, NULL, 'z'},
+    {"threads", required_argument, NULL, 't'},
+    {"iterations", required_argument, NULL, 'i'},
+    {"modes", required_argument, NULL, 'm'},
+    {"backends", required_argument, NULL, 'B'},
+    {"fork", no_argument, NULL, 'F'},
+    {"writers", required_argument, NULL, 'W'},
+    {"output", required_argument, NULL, 'o'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+static void parse_threads(struct bench *b, const char *arg)
+{
+  const char *p = arg;
+
+  b->nthreads = 0;
+  while (*p) {
+    char *end;
+    long n = strtol(p, &end, 10);
+
+    if (end == p || n <= 0 || n > BENCH_MAX_THREADS
+	|| b->nthreads == sizeof (b->threads) / sizeof (b->threads[0]))
+      usage();
+    b->threads[b->nthreads++] = n;
+    p = end;
+    if (*p == ',')
+      p++;
+    else if (*p)
+      usage();
+  }
+}
+
+static void parse_args(int argc, char *argv[], struct bench *b)
+{
+  while (1) {
+    int c = getopt_long(argc, argv, "p:w:S:P:D:n:z:t:i:m:B:FW:o:h",
+			long_options, NULL);
+
+    if (c == -1)
+      break ;
+
+    switch(c) {
+    case 'p':
+      b->principal = strdup(optarg);
+      break;
+    case 'w':
+      b->password = strdup(optarg);
+      break;
+    case 'S':
+      free(b->service);
+      b->service = strdup(optarg);
+      break;
+    case 'P':
+      free(b->prefix);
+      b->prefix = strdup(optarg);
+      break;
+    case 'D':
+      free(b->domain);
+      b->domain = strdup(optarg);
+      break;
+    case 'n':
+      b->spns = atoi(optarg);
+      break;
+    case 'z':
+      b->zipf = atof(optarg);
+      break;
+    case 't':
+      parse_threads(b, optarg);
+      break;
+    case 'i':
+      b->iterations = atoi(optarg);
+      break;
+    case 'm':
+      free(b->modes);
+      b->modes = strdup(optarg);
+      break;
+    case 'B':
+      b->backends = strdup(optarg);
+      break;
+    case 'F':
+      b->fork = 1;
+      break;
+    case 'W':
+      b->write_pct = atoi(optarg);
+      break;
+    case 'o':
+      b->output = strdup(optarg);
+      break;
+    case 'h':
+    case '?':
+    default:
+      usage();
+    }
+  }
+
+  if (!b->password && getenv("K5_BENCH_PASSWORD"))
+    b->password = strdup(getenv("K5_BENCH_PASSWORD"));
+
+  if (!b->principal || !b->password) {
+    fprintf(stderr, "no principal or password specified (see --help)\n");
+    exit(1);
+  }
+  if (b->spns <= 0 || b->iterations <= 0 || b->zipf < 0
+      || b->write_pct < 0 || b->write_pct > 100)
+    usage();
+}
+
+static double elapsed_us(const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) / 1e3;
+}
+
+/* xorshift64*, one state per worker */
+static double next_uniform(unsigned long long *s)
+{
+  unsigned long long x = *s;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *s = x;
+  return ((x * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(struct bench *b)
+{
+  double sum = 0;
+  int i;
+
+  b->cdf = malloc(sizeof (*b->cdf) * b->spns);
+  b->hosts = malloc(sizeof (*b->hosts) * b->spns);
+  if (!b->cdf || !b->hosts) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  for (i = 0; i < b->spns; ++i) {
+    sum += 1.0 / pow(i + 1, b->zipf);
+    b->cdf[i] = sum;
+  }
+  for (i = 0; i < b->spns; ++i) {
+    char host[256];
+
+    b->cdf[i] /= sum;
+    snprintf(host, sizeof (host), "%s%d.%s", b->prefix, i, b->domain);
+    b->hosts[i] = strdup(host);
+  }
+}
+
+static const char *zipf_host(struct worker *w)
+{
+  double u = next_uniform(&w->rng);
+  int lo = 0, hi = w->b->spns - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+
+    if (w->b->cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return w->b->hosts[lo];
+}
+
+static krb5_error_code
+bench_prompter(krb5_context ctx, void *data, const char *name,
+	       const char *banner, int num_prompts, krb5_prompt prompts[])
+{
+  int i;
+
+  for (i = 0; i < num_prompts; ++i) {
+    size_t len = strlen(password);
+
+    if (len > prompts[i].reply->length)
+      return KRB5_LIBOS_CANTREADPWD;
+    memcpy(prompts[i].reply->data, password, len);
+    prompts[i].reply->length = len;
+  }
+  return 0;
+}
+
+static krb5_error_code bench_kinit(struct bench *b, k5_context k5)
+{
+  k5_kinit_req req;
+
+  memset(&req, 0, sizeof (req));
+  req.action = K5_KINIT_PW;
+  req.principal_name = b->principal;
+  req.prompter = bench_prompter;
+  return k5_kinit(k5, &req, NULL);
+}
+
+static int open_cache(struct worker *w, k5_context *k5, const char *what)
+{
+  char name[128];
+
+  snprintf(name, sizeof (name), "MEMORY:k5bench-%s-%d", what, w->id);
+  return k5_init_context(k5, name);
+}
+
+/* kinit: one AS exchange per operation */
+
+static int kinit_setup(struct worker *w)
+{
+  return open_cache(w, &w->k5, "kinit");
+}
+
+static krb5_error_code kinit_op(struct worker *w)
+{
+  return bench_kinit(w->b, w->k5);
+}
+
+/* service-warm: TGS requests answered from the cache */
+
+static int warm_setup(struct worker *w)
+{
+  int i;
+
+  if (open_cache(w, &w->k5, "warm") || bench_kinit(w->b, w->k5))
+    return -1;
+
+  for (i = 0; i < w->b->spns; ++i)
+    if (k5_get_service_ticket(w->k5, w->b->service, w->b->hosts[i], NULL))
+      return -1;
+  return 0;
+}
+
+static krb5_error_code warm_op(struct worker *w)
+{
+  return k5_get_service_ticket(w->k5, w->b->service, zipf_host(w), NULL);
+}
+
+/*
+ * service-cold: every operation starts from a cache holding only the
+ * TGT, so each request goes to the KDC. The TGT is copied back in
+ * through a plain krb5 context outside of the timed section.
+ */
+
+static int cold_setup(struct worker *w)
+{
+  char name[128];
+
+  if (open_cache(w, &w->k5, "tgt") || bench_kinit(w->b, w->k5))
+    return -1;
+  if (open_cache(w, &w->cold, "cold"))
+    return -1;
+
+  if (krb5_init_context(&w->ctx))
+    return -1;
+  snprintf(name, sizeof (name), "MEMORY:k5bench-tgt-%d", w->id);
+  if (krb5_cc_resolve(w->ctx, name, &w->tgt_cc))
+    return -1;
+  snprintf(name, sizeof (name), "MEMORY:k5bench-cold-%d", w->id);
+  if (krb5_cc_resolve(w->ctx, name, &w->cold_cc))
+    return -1;
+  if (krb5_cc_get_principal(w->ctx, w->tgt_cc, &w->me))
+    return -1;
+  return 0;
+}
+
+static krb5_error_code cold_prepare(struct worker *w)
+{
+  krb5_error_code code;
+
+  if ((code = krb5_cc_initialize(w->ctx, w->cold_cc, w->me)))
+    return code;
+  return krb5_cc_copy_creds(w->ctx, w->tgt_cc, w->cold_cc);
+}
+
+static krb5_error_code cold_op(struct worker *w)
+{
+  return k5_get_service_ticket(w->cold, w->b->service, zipf_host(w), NULL);
+}
+
+/*
+ * gss: token generation. GSSAPI reads the default cache, so every
+ * worker shares the process-wide MEMORY: cache set up by main().
+ */
+
+static int gss_global_setup(struct bench *b)
+{
+  k5_context k5;
+  int ret;
+
+  if (k5_init_context(&k5, NULL))
+    return -1;
+  ret = bench_kinit(b, k5);
+  k5_free_context(k5);
+  return ret;
+}
+
+static int gss_setup(struct worker *w)
+{
+  int i;
+
+  if (k5_init_context(&w->k5, NULL))
+    return -1;
+  for (i = 0; i < w->b->spns; ++i)
+    if (k5_get_service_ticket(w->k5, w->b->service, w->b->hosts[i], NULL))
+      return -1;
+  return 0;
+}
+
+static krb5_error_code gss_op(struct worker *w)
+{
+  k5_ticket ticket;
+  krb5_error_code code;
+
+  code = k5_get_service_ticket_gss(w->k5, w->b->service, zipf_host(w),
+				   &ticket);
+  if (!code)
+    k5_clear_ticket(w->k5, &ticket);
+  return code;
+}
+
+static void worker_teardown(struct worker *w)
+{
+  if (w->me)
+    krb5_free_principal(w->ctx, w->me);
+  if (w->tgt_cc)
+    krb5_cc_close(w->ctx, w->tgt_cc);
+  if (w->cold_cc)
+    krb5_cc_close(w->ctx, w->cold_cc);
+  if (w->ctx)
+    krb5_free_context(w->ctx);
+  k5_free_context(w->cold);
+  k5_free_context(w->k5);
+}
+
+static const struct mode modes[] = {
+  { "kinit", NULL, kinit_setup, NULL, kinit_op, worker_teardown },
+  { "service-cold", NULL, cold_setup, cold_prepare, cold_op,
+    worker_teardown },
+  { "service-warm", NULL, warm_setup, NULL, warm_op, worker_teardown },
+  { "gss", gss_global_setup, gss_setup, NULL, gss_op, worker_teardown },
+  { NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+static void barrier_wait(struct bench *b)
+{
+  pthread_mutex_lock(&b->lock);
+  if (++b->waiting == b->parties) {
+    clock_gettime(CLOCK_MONOTONIC, &b->start);
+    pthread_cond_broadcast(&b->cond);
+  } else {
+    while (b->waiting < b->parties)
+      pthread_cond_wait(&b->cond, &b->lock);
+  }
+  pthread_mutex_unlock(&b->lock);
+}
+
+static void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+  int i, ready;
+
+  ready = !w->mode->setup(w);
+  barrier_wait(w->b);
+
+  for (i = 0; ready && i < w->b->iterations; ++i) {
+    struct timespec t0, t1;
+    krb5_error_code code = 0;
+
+    if (w->mode->prepare)
+      code = w->mode->prepare(w);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (!code)
+      code = w->mode->op(w);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (code) {
+      w->errors++;
+      w->last_error = code;
+      continue ;
+    }
+    w->lat[w->count++] = elapsed_us(&t0, &t1);
+  }
+  if (!ready)
+    w->errors = w->b->iterations;
+
+  clock_gettime(CLOCK_MONOTONIC, &w->end);
+  w->mode->teardown(w);
+  return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *v, int n, double p)
+{
+  int i;
+
+  if (!n)
+    return 0;
+  i = (int)ceil(p / 100.0 * n) - 1;
+  if (i < 0)
+    i = 0;
+  if (i >= n)
+    i = n - 1;
+  return v[i];
+}
+
+static void report(FILE *out, const struct mode *mode, int nthreads,
+		   struct worker *workers, const struct timespec *start,
+		   int first)
+{
+  double *all, sum = 0, wall = 0;
+  krb5_error_code last_error = 0;
+  int i, n = 0, errors = 0;
+
+  for (i = 0; i < nthreads; ++i) {
+    n += workers[i].count;
+    errors += workers[i].errors;
+    if (workers[i].last_error)
+      last_error = workers[i].last_error;
+    if (elapsed_us(start, &workers[i].end) > wall)
+      wall = elapsed_us(start, &workers[i].end);
+  }
+
+  all = malloc(sizeof (*all) * (n ? n : 1));
+  if (!all) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (n = 0, i = 0; i < nthreads; ++i) {
+    memcpy(all + n, workers[i].lat, sizeof (*all) * workers[i].count);
+    n += workers[i].count;
+  }
+  for (i = 0; i < n; ++i)
+    sum += all[i];
+  qsort(all, n, sizeof (*all), cmp_double);
+
+  fprintf(out, "%s    {\"mode\": \"%s\", \"threads\": %d, \"ops\": %d, "
+	  "\"errors\": %d, \"last_error\": %ld, \"seconds\": %.6f, "
+	  "\"ops_per_sec\": %.2f,\n",
+	  first ? "" : ",\n", mode->name, nthreads, n, errors,
+	  (long)last_error, wall / 1e6, wall > 0 ? n / (wall / 1e6) : 0);
+  fprintf(out, "     \"latency_us\": {\"min\": %.1f, \"mean\": %.1f, "
+	  "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+	  "\"max\": %.1f}}",
+	  n ? all[0] : 0, n ? sum / n : 0,
+	  percentile(all, n, 50), percentile(all, n, 90),
+	  percentile(all, n, 99), percentile(all, n, 99.9),
+	  n ? all[n - 1] : 0);
+  free(all);
+}
+
+static int run(struct bench *b, const struct mode *mode, int nthreads,
+	       FILE *out, int first)
+{
+  struct worker *workers;
+  int i;
+
+  workers = calloc(nthreads, sizeof (*workers));
+  if (!workers)
+    return ENOMEM;
+
+  b->waiting = 0;
+  b->parties = nthreads;
+  for (i = 0; i < nthreads; ++i) {
+    workers[i].b = b;
+    workers[i].mode = mode;
+    workers[i].id = i;
+    workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+    workers[i].lat = malloc(sizeof (double) * b->iterations);
+    if (!workers[i].lat) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; ++i)
+    pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+  for (i = 0; i < nthreads; ++i)
+    pthread_join(workers[i].thread, NULL);
+
+  report(out, mode, nthreads, workers, &b->start, first);
+
+  for (i = 0; i < nthreads; ++i)
+    free(workers[i].lat);
+  free(workers);
+  return 0;
+}
+
+/*
+ * Backend comparison (--backends). All workers share one cache per
+ * backend: writers loop over k5_init_context(), k5_kinit(),
+ * k5_get_service_ticket() and k5_kdestroy(), readers loop over
+ * k5_klist(). Workers are threads, or processes with --fork.
+ *
+ * libk5 can't see ccache locks, so lock wait is estimated as the mean
+ * latency in excess of the single worker run for the same backend and
+ * operation.
+ */
+
+enum { OP_KINIT, OP_SERVICE, OP_KLIST, OP_KDESTROY, OP_MAX };
+
+static const char *op_names[OP_MAX] = {
+  "k5_kinit", "k5_get_service_ticket", "k5_klist", "k5_kdestroy"
+};
+
+struct backend {
+  const char *type;
+  char name[1024];
+  /* set for caches created with krb5_cc_new_unique() */
+  int unique;
+  /* MEMORY: caches are private to each process */
+  int per_process;
+  double baseline[OP_MAX];
+};
+
+struct slot {
+  int count[OP_MAX];
+  int errors[OP_MAX];
+  int empty;
+  krb5_error_code last_error;
+  struct timespec end;
+};
+
+/* Shared with the workers, MAP_SHARED so --fork works too */
+struct region {
+  volatile int ready;
+  volatile int go;
+  struct timespec start;
+  int workers;
+  int iterations;
+  struct slot *slots;
+  double *lat;
+};
+
+static double *region_lat(struct region *r, int id, int op)
+{
+  return r->lat + ((size_t)id * OP_MAX + op) * r->iterations;
+}
+
+static struct region *region_alloc(int workers, int iterations)
+{
+  struct region *r;
+  size_t size;
+
+  size = sizeof (*r) + sizeof (struct slot) * workers +
+    sizeof (double) * workers * OP_MAX * iterations;
+  r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+	   -1, 0);
+  if (r == MAP_FAILED) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  r->workers = workers;
+  r->iterations = iterations;
+  r->slots = (struct slot *)(r + 1);
+  r->lat = (double *)(r->slots + workers);
+  return r;
+}
+
+static void region_free(struct region *r)
+{
+  munmap(r, sizeof (*r) + sizeof (struct slot) * r->workers +
+	 sizeof (double) * r->workers * OP_MAX * r->iterations);
+}
+
+static void record(struct region *r, int id, int op,
+		   const struct timespec *t0, krb5_error_code code)
+{
+  struct slot *s = &r->slots[id];
+  struct timespec t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (code) {
+    s->errors[op]++;
+    s->last_error = code;
+    return ;
+  }
+  region_lat(r, id, op)[s->count[op]++] = elapsed_us(t0, &t1);
+}
+
+static void backend_worker(struct bench *b, struct backend *be,
+			   struct region *r, int id, int writer)
+{
+  struct worker w;
+  k5_context k5 = NULL;
+  int i;
+
+  memset(&w, 0, sizeof (w));
+  w.b = b;
+  w.rng = 0x9e3779b97f4a7c15ULL * (id + 1);
+
+  if (!writer && k5_init_context(&k5, be->name))
+    r->slots[id].errors[OP_KLIST] = r->iterations;
+
+  __sync_fetch_and_add(&r->ready, 1);
+  while (!r->go)
+    usleep(50);
+
+  for (i = 0; i < r->iterations; ++i) {
+    struct timespec t0;
+    krb5_error_code code;
+
+    if (writer) {
+      if ((code = k5_init_context(&k5, be->name))) {
+	r->slots[id].errors[OP_KINIT]++;
+	continue ;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      code = bench_kinit(b, k5);
+      record(r, id, OP_KINIT, &t0, code);
+      if (!code) {
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	code = k5_get_service_ticket(k5, b->service, zipf_host(&w), NULL);
+	record(r, id, OP_SERVICE, &t0, code);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      code = k5_kdestroy(k5);
+      record(r, id, OP_KDESTROY, &t0, code);
+      k5_free_context(k5);
+      k5 = NULL;
+    } else if (k5) {
+      k5_klist_entries klist;
+
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      code = k5_klist(k5, &klist);
+      if (code == KRB5_FCC_NOFILE || code == KRB5_CC_NOTFOUND) {
+	/* a writer destroyed the cache, not an error */
+	r->slots[id].empty++;
+	continue ;
+      }
+      record(r, id, OP_KLIST, &t0, code);
+      if (!code)
+	k5_clear_klist(k5, &klist);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &r->slots[id].end);
+  k5_free_context(k5);
+}
+
+struct backend_thread {
+  struct bench *b;
+  struct backend *be;
+  struct region *r;
+  int id;
+  int writer;
+};
+
+static void *backend_thread_main(void *arg)
+{
+  struct backend_thread *t = arg;
+
+  backend_worker(t->b, t->be, t->r, t->id, t->writer);
+  return NULL;
+}
+
+static void backend_run(struct bench *b, struct backend *be, int writers,
+			int readers, int use_fork, FILE *out, int *first,
+			double *mean)
+{
+  int n = writers + readers;
+  struct backend_thread *threads;
+  pthread_t *tids;
+  pid_t *pids;
+  struct region *r;
+  double wall = 0;
+  int i, op, empty = 0;
+
+  r = region_alloc(n, b->iterations);
+  threads = calloc(n, sizeof (*threads));
+  tids = calloc(n, sizeof (*tids));
+  pids = calloc(n, sizeof (*pids));
+  if (!threads || !tids || !pids) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  fflush(NULL);
+  for (i = 0; i < n; ++i) {
+    threads[i].b = b;
+    threads[i].be = be;
+    threads[i].r = r;
+    threads[i].id = i;
+    threads[i].writer = i < writers;
+    if (!use_fork) {
+      pthread_create(&tids[i], NULL, backend_thread_main, &threads[i]);
+    } else if ((pids[i] = fork()) == 0) {
+      backend_worker(b, be, r, i, i < writers);
+      _exit(0);
+    } else if (pids[i] < 0) {
+      fprintf(stderr, "fork: %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+
+  while (r->ready < n)
+    usleep(100);
+  clock_gettime(CLOCK_MONOTONIC, &r->start);
+  r->go = 1;
+
+  for (i = 0; i < n; ++i) {
+    if (use_fork)
+      waitpid(pids[i], NULL, 0);
+    else
+      pthread_join(tids[i], NULL);
+    if (elapsed_us(&r->start, &r->slots[i].end) > wall)
+      wall = elapsed_us(&r->start, &r->slots[i].end);
+  }
+
+  for (i = 0; i < n; ++i)
+    empty += r->slots[i].empty;
+
+  fprintf(out, "%s    {\"backend\": \"%s\", \"cache\": \"%s\", "
+	  "\"workers\": \"%s\", \"per_process_cache\": %s, "
+	  "\"concurrency\": %d, \"writers\": %d, \"readers\": %d, "
+	  "\"seconds\": %.6f, \"empty_reads\": %d,\n     \"ops\": {",
+	  *first ? "" : ",\n", be->type, be->name,
+	  use_fork ? "processes" : "threads",
+	  use_fork && be->per_process ? "true" : "false",
+	  n, writers, readers, wall / 1e6, empty);
+  *first = 0;
+
+  for (op = 0; op < OP_MAX; ++op) {
+    double *all, sum = 0;
+    int count = 0, errors = 0;
+    krb5_error_code last_error = 0;
+
+    for (i = 0; i < n; ++i) {
+      count += r->slots[i].count[op];
+      errors += r->slots[i].errors[op];
+      if (r->slots[i].last_error)
+	last_error = r->slots[i].last_error;
+    }
+    all = malloc(sizeof (*all) * (count ? count : 1));
+    if (!all) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    for (count = 0, i = 0; i < n; ++i) {
+      memcpy(all + count, region_lat(r, i, op),
+	     sizeof (*all) * r->slots[i].count[op]);
+      count += r->slots[i].count[op];
+    }
+    for (i = 0; i < count; ++i)
+      sum += all[i];
+    qsort(all, count, sizeof (*all), cmp_double);
+    if (mean)
+      mean[op] = count ? sum / count : 0;
+
+    fprintf(out, "%s\n       \"%s\": {\"ops\": %d, \"errors\": %d, "
+	    "\"last_error\": %ld, \"ops_per_sec\": %.2f, \"mean_us\": %.1f, "
+	    "\"p50_us\": %.1f, \"p99_us\": %.1f, \"lock_wait_us\": %.1f}",
+	    op ? "," : "", op_names[op], count, errors, (long)last_error,
+	    wall > 0 ? count / (wall / 1e6) : 0,
+	    count ? sum / count : 0,
+	    percentile(all, count, 50), percentile(all, count, 99),
+	    count && be->baseline[op] && sum / count > be->baseline[op] ?
+	    sum / count - be->baseline[op] : 0);
+    free(all);
+  }
+  fprintf(out, "}}");
+
+  free(threads);
+  free(tids);
+  free(pids);
+  region_free(r);
+}
+
+/* Check that the backend works here and pick a cache name */
+static int backend_probe(struct bench *b, struct backend *be,
+			 const char *dir)
+{
+  krb5_context ctx;
+  krb5_ccache cc = NULL;
+  krb5_principal me = NULL;
+  krb5_error_code code;
+  char *name = NULL;
+
+  if (krb5_init_context(&ctx))
+    return -1;
+
+  if (!strcmp(be->type, "FILE")) {
+    snprintf(be->name, sizeof (be->name), "FILE:%s/file", dir);
+  } else if (!strcmp(be->type, "DIR")) {
+    snprintf(be->name, sizeof (be->name), "%s/dir", dir);
+    mkdir(be->name, 0700);
+    snprintf(be->name, sizeof (be->name), "DIR:%s/dir", dir);
+  } else if (!strcmp(be->type, "MEMORY")) {
+    snprintf(be->name, sizeof (be->name), "MEMORY:k5bench-backend");
+    be->per_process = 1;
+  } else {
+    be->unique = 1;
+  }
+
+  if (be->unique)
+    code = krb5_cc_new_unique(ctx, be->type, NULL, &cc);
+  else
+    code = krb5_cc_resolve(ctx, be->name, &cc);
+  if (!code)
+    code = krb5_parse_name(ctx, b->principal, &me);
+  if (!code)
+    code = krb5_cc_initialize(ctx, cc, me);
+  if (!code && be->unique && !(code = krb5_cc_get_full_name(ctx, cc, &name))) {
+    snprintf(be->name, sizeof (be->name), "%s", name);
+    free(name);
+  }
+
+  if (code)
+    fprintf(stderr, "[-] %s: not available (%s)\n", be->type,
+	    error_message(code));
+  if (me)
+    krb5_free_principal(ctx, me);
+  if (cc)
+    krb5_cc_close(ctx, cc);
+  krb5_free_context(ctx);
+  return code ? -1 : 0;
+}
+
+static void backend_destroy(struct backend *be)
+{
+  k5_context k5;
+
+  if (!k5_init_context(&k5, be->name)) {
+    k5_kdestroy(k5);
+    k5_free_context(k5);
+  }
+}
+
+static void quiet_hook(const char *whoami, long code,
+		       const char *format, va_list args)
+{
+}
+
+static void remove_tree(const char *path)
+{
+  struct dirent *d;
+  DIR *dir;
+
+  if ((dir = opendir(path)) != NULL) {
+    while ((d = readdir(dir)) != NULL) {
+      char sub[1024];
+
+      if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+	continue ;
+      snprintf(sub, sizeof (sub), "%s/%s", path, d->d_name);
+      remove_tree(sub);
+    }
+    closedir(dir);
+    rmdir(path);
+  } else {
+    unlink(path);
+  }
+}
+
+static void run_backends(struct bench *b, FILE *out, int *first)
+{
+  static const char *types[] = { "FILE", "DIR", "KEYRING", "MEMORY", "KCM",
+				 NULL };
+  char dir[] = "/tmp/k5-bench.XXXXXX";
+  et_old_error_hook_func old_hook;
+  int i, t;
+
+  if (!mkdtemp(dir)) {
+    fprintf(stderr, "mkdtemp: %s\n", strerror(errno));
+    return ;
+  }
+
+  /* Readers routinely hit a destroyed cache, keep stderr readable */
+  old_hook = set_com_err_hook(quiet_hook);
+
+  for (t = 0; types[t]; ++t) {
+    struct backend be;
+    double mean[OP_MAX];
+    k5_context k5;
+
+    memset(&be, 0, sizeof (be));
+    be.type = types[t];
+    if (!strstr(b->backends, "all") && !strstr(b->backends, be.type))
+      continue ;
+    if (backend_probe(b, &be, dir))
+      continue ;
+
+    /* Uncontended baselines: one writer, then one reader */
+    fprintf(stderr, "[ ] %s: baseline\n", be.type);
+    backend_run(b, &be, 1, 0, 0, out, first, mean);
+    for (i = 0; i < OP_MAX; ++i)
+      if (mean[i])
+	be.baseline[i] = mean[i];
+    if (!k5_init_context(&k5, be.name)) {
+      if (!bench_kinit(b, k5))
+	k5_get_service_ticket(k5, b->service, b->hosts[0], NULL);
+      k5_free_context(k5);
+    }
+    backend_run(b, &be, 0, 1, 0, out, first, mean);
+    be.baseline[OP_KLIST] = mean[OP_KLIST];
+
+    for (i = 0; i < b->nthreads; ++i) {
+      int n = b->threads[i];
+      int writers = (n * b->write_pct + 50) / 100;
+
+      if (writers < 1)
+	writers = 1;
+      if (writers > n)
+	writers = n;
+      fprintf(stderr, "[ ] %s: %d %s (%d writers)\n", be.type, n,
+	      b->fork ? "processes" : "threads", writers);
+      backend_run(b, &be, writers, n - writers, b->fork, out, first, NULL);
+    }
+    backend_destroy(&be);
+  }
+
+  set_com_err_hook(old_hook);
+  remove_tree(dir);
+}
+
+static int mode_selected(const struct bench *b, const char *name)
+{
+  size_t len = strlen(name);
+  const char *p = b->modes;
+
+  if (!p)
+    return 1;
+  while ((p = strstr(p, name)) != NULL) {
+    if ((p == b->modes || p[-1] == ',') && (p[len] == ',' || !p[len]))
+      return 1;
+    p += len;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  struct bench b;
+  const struct mode *mode;
+  char host[256];
+  FILE *out = stdout;
+  int i, first = 1;
+
+  memset(&b, 0, sizeof (b));
+  b.service = strdup("host");
+  b.prefix = strdup("bench");
+  b.domain = strdup("bench.test");
+  b.spns = 100;
+  b.zipf = 1.0;
+  b.iterations = 1000;
+  b.write_pct = 50;
+  parse_threads(&b, "1,2,4,8");
+  parse_args(argc, argv, &b);
+
+  password = b.password;
+  zipf_init(&b);
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.cond, NULL);
+
+  /* GSSAPI only looks at the default cache, keep it in memory */
+  setenv("KRB5CCNAME", "MEMORY:k5bench-gss", 1);
+
+  if (b.output && !(out = fopen(b.output, "w"))) {
+    fprintf(stderr, "can't open %s: %s\n", b.output, strerror(errno));
+    return 1;
+  }
+
+  if (gethostname(host, sizeof (host)))
+    strcpy(host, "unknown");
+  host[sizeof (host) - 1] = '\0';
+
+  fprintf(out, "{\n  \"host\": \"%s\",\n  \"time\": %ld,\n"
+	  "  \"principal\": \"%s\",\n  \"service\": \"%s\",\n"
+	  "  \"spns\": %d,\n  \"zipf\": %.3f,\n  \"iterations\": %d,\n"
+	  "  \"results\": [\n",
+	  host, (long)time(NULL), b.principal, b.service,
+	  b.spns, b.zipf, b.iterations);
+
+  if (b.backends)
+    run_backends(&b, out, &first);
+
+  for (mode = modes; !b.backends && mode->name; ++mode) {
+    if (!mode_selected(&b, mode->name))
+      continue ;
+    if (mode->global_setup && mode->global_setup(&b)) {
+      fprintf(stderr, "[-] %s: setup failed, skipping\n", mode->name);
+      continue ;
+    }
+    for (i = 0; i < b.nthreads; ++i) {
+      fprintf(stderr, "[ ] %s, %d thread(s)\n", mode->name, b.threads[i]);
+      run(&b, mode, b.threads[i], out, first);
+      first = 0;
+    }
+  }
+
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Exec-to-first-ticket time of klist-k5 and kvno-k5, to compare builds,
+# e.g. with and without -DK5_LAZY_GSSAPI=ON:
+#
+#   ./k5-exec-time.sh -n 200 -S host -H server.example.com \
+#     build-linked build-lazy
+#
+# Each argument is a build directory; its libk5 is used through
+# LD_LIBRARY_PATH. Needs a TGT in the default ccache. kvno asks the KDC
+# on its first run and finds the ticket in the ccache afterwards, which
+# is the common case for short-lived tools.
+#
+# Prints the median and 90th percentile wall time in milliseconds, and
+# the number of relocations processed by the dynamic linker (glibc's
+# LD_DEBUG=statistics) for one run.
+
+set -e
+
+RUNS=200
+SERVICE=host
+HOST=$(hostname -f 2>/dev/null || hostname)
+
+while getopts "n:S:H:h" opt; do
+  case $opt in
+    n) RUNS=$OPTARG ;;
+    S) SERVICE=$OPTARG ;;
+    H) HOST=$OPTARG ;;
+    *) echo "Usage: $0 [-n runs] [-S service] [-H host] [builddir...]" >&2
+       exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+  set -- @CMAKE_BINARY_DIR@
+fi
+
+now_ns() {
+  date +%s%N
+}
+
+# name runs command...: prints median and p90 in ms
+measure() {
+  name=$1
+  runs=$2
+  shift 2
+  i=0
+  while [ $i -lt $runs ]; do
+    start=$(now_ns)
+    "$@" >/dev/null 2>&1 || true
+    echo $(( $(now_ns) - start ))
+    i=$((i + 1))
+  done | sort -n | awk -v name="$name" '
+    { t[NR] = $1 }
+    END {
+      p90 = int(NR * 0.9)
+      if (p90 < 1)
+        p90 = 1
+      printf "  %-6s median %8.3f ms  p90 %8.3f ms", name,
+        t[int((NR + 1) / 2)] / 1e6, t[p90] / 1e6
+    }'
+}
+
+relocations() {
+  LD_DEBUG=statistics "$@" 2>&1 >/dev/null |
+    awk '/number of relocations:/ { n += $NF } END { print n + 0 }'
+}
+
+for build in "$@"; do
+  klist=$build/tools/klist/klist-k5
+  kvno=$build/tools/kvno/kvno-k5
+  if [ ! -x "$klist" ] || [ ! -x "$kvno" ]; then
+    echo "$build: klist-k5 or kvno-k5 not built" >&2
+    exit 1
+  fi
+  LD_LIBRARY_PATH=$build/src${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}
+  export LD_LIBRARY_PATH
+
+  echo "$build:"
+  "$kvno" "$SERVICE" "$HOST" >/dev/null 2>&1 || true
+  measure klist $RUNS "$klist"
+  echo "  relocations $(relocations "$klist")"
+  measure kvno $RUNS "$kvno" "$SERVICE" "$HOST"
+  echo "  relocations $(relocations "$kvno" "$SERVICE" "$HOST")"
+done
@@ -0,0 +1,674 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * k5-kdc-replay: record and replay KDC exchanges.
+ *
+ * In record mode, listens on 127.0.0.1 (UDP and TCP), forwards every
+ * request to the upstream KDC and appends the request/reply pair to a
+ * file. In replay mode, answers from that file, optionally after an
+ * injected latency, without any KDC.
+ *
+ * Requests are matched on their exact bytes first, then on a key made
+ * of the message type, pre-authentication types, client, realm and
+ * server names. Records sharing a key are handed out in recorded
+ * order. Replies carry the client's nonce, so run the client with
+ * libk5-replay-random preloaded (same K5_REPLAY_SEED when recording
+ * and replaying) for them to be accepted.
+ */
+
+#define RECORD_MAGIC 0x4b355252 /* K5RR */
+#define MAX_MSG 65536
+
+enum transport {
+  T_UDP = 0,
+  T_TCP = 1
+};
+
+struct record {
+  unsigned char *req;
+  size_t req_len;
+  unsigned char *rep;
+  size_t rep_len;
+  char *key;
+  int uses;
+};
+
+struct opt {
+  int port;
+  char *record;
+  char *replay;
+  char *upstream;
+  int latency_ms;
+  int jitter_ms;
+  int verbose;
+};
+
+static struct opt opt;
+static struct addrinfo *upstream;
+static FILE *record_file;
+static struct record *records;
+static int nrecords;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage()
+{
+  fprintf(stderr, "Usage: k5-kdc-replay [options]\n"
+	  "\n"
+	  "-l, --listen          port to listen on, 127.0.0.1 (default: 18889)\n"
+	  "-r, --record          record exchanges into file\n"
+	  "-u, --upstream        upstream KDC host[:port] for --record\n"
+	  "-R, --replay          answer from a recorded file\n"
+	  "-L, --latency         replay: injected latency in ms (default: 0)\n"
+	  "-J, --jitter          replay: uniform jitter in ms (default: 0)\n"
+	  "-v, --verbose         log every request\n");
+  exit(1);
+}
+
+static const struct option long_options[] =
+  {
+    {"listen", required_argument, NULL, 'l'},
+    {"record", required_argument, NULL, 'r'},
+    {"upstream", required_argument, NULL, 'u'},
+    {"replay", required_argument, NULL, 'R'},
+    {"latency", required_argument, NULL, 'L'},
+    {"jitter", required_argument, NULL, 'J'},
+    {"verbose", no_argument, NULL, 'v'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+static void parse_args(int argc, char *argv[])
+{
+  while (1) {
+    int c = getopt_long(argc, argv, "l:r:u:R:L:J:vh", long_options, NULL);
+
+    if (c == -1)
+      break ;
+
+    switch(c) {
+    case 'l':
+      opt.port = atoi(optarg);
+      break;
+    case 'r':
+      opt.record = strdup(optarg);
+      break;
+    case 'u':
+      opt.upstream = strdup(optarg);
+      break;
+    case 'R':
+      opt.replay = strdup(optarg);
+      break;
+    case 'L':
+      opt.latency_ms = atoi(optarg);
+      break;
+    case 'J':
+      opt.jitter_ms = atoi(optarg);
+      break;
+    case 'v':
+      opt.verbose = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (!!opt.record == !!opt.replay)
+    usage();
+  if (opt.record && !opt.upstream) {
+    fprintf(stderr, "--record needs --upstream\n");
+    exit(1);
+  }
+}
+
+/* DER walking, just enough to key KDC-REQ messages */
+
+static int der_read(const unsigned char **p, const unsigned char *end,
+		    int *tag, const unsigned char **val, size_t *len)
+{
+  size_t l;
+
+  if (end - *p < 2)
+    return -1;
+  *tag = *(*p)++;
+  l = *(*p)++;
+  if (l & 0x80) {
+    int n = l & 0x7f;
+
+    if (n == 0 || n > 4 || end - *p < n)
+      return -1;
+    for (l = 0; n; n--)
+      l = (l << 8) | *(*p)++;
+  }
+  if ((size_t)(end - *p) < l)
+    return -1;
+  *val = *p;
+  *len = l;
+  *p += l;
+  return 0;
+}
+
+/* Find context tag [n] inside a SEQUENCE body */
+static int der_field(const unsigned char *p, size_t size, int n,
+		     const unsigned char **val, size_t *len)
+{
+  const unsigned char *end = p + size;
+  int tag;
+
+  while (p < end) {
+    if (der_read(&p, end, &tag, val, len))
+      return -1;
+    if (tag == (0xa0 | n))
+      return 0;
+  }
+  return -1;
+}
+
+static int der_integer(const unsigned char *p, size_t size, long *out)
+{
+  const unsigned char *val;
+  size_t len, i;
+  int tag;
+
+  if (der_read(&p, p + size, &tag, &val, &len) || tag != 0x02
+      || len == 0 || len > 4)
+    return -1;
+  *out = (val[0] & 0x80) ? -1 : 0;
+  for (i = 0; i < len; ++i)
+    *out = (*out << 8) | val[i];
+  return 0;
+}
+
+/* PrincipalName as name/name, appended to buf */
+static void der_principal(const unsigned char *p, size_t size,
+			  char *buf, size_t buflen)
+{
+  const unsigned char *seq, *names, *end, *val;
+  size_t len, seq_len;
+  int tag;
+
+  if (der_read(&p, p + size, &tag, &seq, &seq_len) || tag != 0x30)
+    return ;
+  if (der_field(seq, seq_len, 1, &names, &len))
+    return ;
+  if (der_read(&names, names + len, &tag, &seq, &seq_len) || tag != 0x30)
+    return ;
+  end = seq + seq_len;
+  while (seq < end) {
+    if (der_read(&seq, end, &tag, &val, &len))
+      return ;
+    if (buf[0] && strlen(buf) + 1 < buflen)
+      strcat(buf, "/");
+    if (strlen(buf) + len < buflen)
+      strncat(buf, (const char *)val, len);
+  }
+}
+
+static void der_string(const unsigned char *p, size_t size,
+		       char *buf, size_t buflen)
+{
+  const unsigned char *val;
+  size_t len;
+  int tag;
+
+  if (der_read(&p, p + size, &tag, &val, &len))
+    return ;
+  if (strlen(buf) + len < buflen)
+    strncat(buf, (const char *)val, len);
+}
+
+/*
+ * "<msg-type>|<padata types>|<cname>|<realm>|<sname>" for AS-REQ and
+ * TGS-REQ, NULL for anything else.
+ */
+static char *request_key(const unsigned char *msg, size_t size)
+{
+  const unsigned char *p = msg, *seq, *val, *body;
+  char key[1024], cname[256] = "", realm[256] = "", sname[256] = "";
+  size_t len, seq_len, body_len;
+  long msg_type;
+  int tag;
+
+  if (der_read(&p, msg + size, &tag, &seq, &seq_len)
+      || (tag != 0x6a && tag != 0x6c))
+    return NULL;
+  if (der_read(&seq, seq + seq_len, &tag, &p, &seq_len) || tag != 0x30)
+    return NULL;
+  seq = p;
+
+  if (der_field(seq, seq_len, 2, &val, &len) ||
+      der_integer(val, len, &msg_type))
+    return NULL;
+  snprintf(key, sizeof (key), "%ld|", msg_type);
+
+  if (!der_field(seq, seq_len, 3, &val, &len)) {
+    const unsigned char *pa, *end;
+
+    if (!der_read(&val, val + len, &tag, &pa, &len) && tag == 0x30) {
+      end = pa + len;
+      while (pa < end) {
+	const unsigned char *item, *type;
+	size_t item_len, type_len;
+	long pa_type;
+
+	if (der_read(&pa, end, &tag, &item, &item_len))
+	  break ;
+	if (!der_field(item, item_len, 1, &type, &type_len) &&
+	    !der_integer(type, type_len, &pa_type))
+	  snprintf(key + strlen(key), sizeof (key) - strlen(key), "%ld,",
+		   pa_type);
+      }
+    }
+  }
+
+  if (der_field(seq, seq_len, 4, &val, &len) ||
+      der_read(&val, val + len, &tag, &body, &body_len) || tag != 0x30)
+    return NULL;
+  if (!der_field(body, body_len, 1, &val, &len))
+    der_principal(val, len, cname, sizeof (cname));
+  if (!der_field(body, body_len, 2, &val, &len))
+    der_string(val, len, realm, sizeof (realm));
+  if (!der_field(body, body_len, 3, &val, &len))
+    der_principal(val, len, sname, sizeof (sname));
+
+  snprintf(key + strlen(key), sizeof (key) - strlen(key), "|%s|%s|%s",
+	   cname, realm, sname);
+  return strdup(key);
+}
+
+/* Record file: magic, transport, request, reply; big endian lengths */
+
+static int write_u32(FILE *f, unsigned long v)
+{
+  unsigned char b[4];
+
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v;
+  return fwrite(b, 1, 4, f) == 4 ? 0 : -1;
+}
+
+static int read_u32(FILE *f, unsigned long *v)
+{
+  unsigned char b[4];
+
+  if (fread(b, 1, 4, f) != 4)
+    return -1;
+  *v = ((unsigned long)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+  return 0;
+}
+
+static void record_exchange(int transport, const unsigned char *req,
+			    size_t req_len, const unsigned char *rep,
+			    size_t rep_len)
+{
+  pthread_mutex_lock(&lock);
+  write_u32(record_file, RECORD_MAGIC);
+  fputc(transport, record_file);
+  write_u32(record_file, req_len);
+  fwrite(req, 1, req_len, record_file);
+  write_u32(record_file, rep_len);
+  fwrite(rep, 1, rep_len, record_file);
+  fflush(record_file);
+  pthread_mutex_unlock(&lock);
+}
+
+static int load_records(const char *path)
+{
+  FILE *f;
+  unsigned long magic, len;
+
+  if (!(f = fopen(path, "rb"))) {
+    fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  while (!read_u32(f, &magic)) {
+    struct record *r;
+
+    if (magic != RECORD_MAGIC)
+      goto bad;
+    records = realloc(records, sizeof (*records) * (nrecords + 1));
+    if (!records)
+      goto bad;
+    r = &records[nrecords];
+    memset(r, 0, sizeof (*r));
+    fgetc(f);
+
+    if (read_u32(f, &len) || len > MAX_MSG || !(r->req = malloc(len + 1))
+	|| fread(r->req, 1, len, f) != len)
+      goto bad;
+    r->req_len = len;
+    if (read_u32(f, &len) || len > MAX_MSG || !(r->rep = malloc(len + 1))
+	|| fread(r->rep, 1, len, f) != len)
+      goto bad;
+    r->rep_len = len;
+    r->key = request_key(r->req, r->req_len);
+    nrecords++;
+  }
+
+  fclose(f);
+  fprintf(stderr, "[+] loaded %d exchanges from %s\n", nrecords, path);
+  return 0;
+
+ bad:
+  fprintf(stderr, "%s: truncated or corrupted record %d\n", path, nrecords);
+  fclose(f);
+  return -1;
+}
+
+static struct record *find_record(const unsigned char *req, size_t len)
+{
+  struct record *best = NULL;
+  char *key;
+  int i;
+
+  for (i = 0; i < nrecords; ++i)
+    if (records[i].req_len == len && !memcmp(records[i].req, req, len))
+      return &records[i];
+
+  key = request_key(req, len);
+  if (!key)
+    return NULL;
+  for (i = 0; i < nrecords; ++i) {
+    if (!records[i].key || strcmp(records[i].key, key))
+      continue ;
+    if (!best || records[i].uses < best->uses)
+      best = &records[i];
+  }
+  if (opt.verbose)
+    fprintf(stderr, "[%c] %s\n", best ? '+' : '-', key);
+  free(key);
+  return best;
+}
+
+/* Upstream forwarding for --record */
+
+static int resolve_upstream(const char *spec)
+{
+  struct addrinfo hints;
+  char *host = strdup(spec), *port = "88", *p;
+  int ret;
+
+  if ((p = strrchr(host, ':')) != NULL) {
+    *p = '\0';
+    port = p + 1;
+  }
+  memset(&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  ret = getaddrinfo(host, port, &hints, &upstream);
+  if (ret)
+    fprintf(stderr, "getaddrinfo(%s): %s\n", spec, gai_strerror(ret));
+  free(host);
+  return ret ? -1 : 0;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+  unsigned char *p = buf;
+
+  while (len) {
+    ssize_t n = read(fd, p, len);
+
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+
+  while (len) {
+    ssize_t n = write(fd, p, len);
+
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static ssize_t forward(int transport, const unsigned char *req, size_t len,
+		       unsigned char *rep)
+{
+  struct timeval tv = { 5, 0 };
+  unsigned char hdr[4];
+  ssize_t n = -1;
+  int fd;
+
+  fd = socket(upstream->ai_family,
+	      transport == T_UDP ? SOCK_DGRAM : SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  if (connect(fd, upstream->ai_addr, upstream->ai_addrlen))
+    goto out;
+
+  if (transport == T_UDP) {
+    if (send(fd, req, len, 0) == (ssize_t)len)
+      n = recv(fd, rep, MAX_MSG, 0);
+  } else {
+    hdr[0] = len >> 24;
+    hdr[1] = len >> 16;
+    hdr[2] = len >> 8;
+    hdr[3] = len;
+    if (write_full(fd, hdr, 4) || write_full(fd, req, len) ||
+	read_full(fd, hdr, 4))
+      goto out;
+    n = (hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+    if (n > MAX_MSG || read_full(fd, rep, n))
+      n = -1;
+  }
+
+ out:
+  close(fd);
+  return n;
+}
+
+/* Request handling, one thread per request */
+
+struct request {
+  int transport;
+  int fd;
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  unsigned char msg[MAX_MSG];
+  size_t len;
+};
+
+static void inject_latency()
+{
+  struct timespec ts;
+  long ms = opt.latency_ms;
+
+  if (opt.jitter_ms > 0)
+    ms += rand() % (opt.jitter_ms + 1);
+  if (ms <= 0)
+    return ;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&ts, NULL);
+}
+
+static void *handle_request(void *arg)
+{
+  struct request *r = arg;
+  unsigned char *rep = NULL, *buf = NULL;
+  ssize_t rep_len = -1;
+
+  if (opt.record) {
+    buf = malloc(MAX_MSG);
+    if (buf && (rep_len = forward(r->transport, r->msg, r->len, buf)) >= 0)
+      record_exchange(r->transport, r->msg, r->len, buf, rep_len);
+    rep = buf;
+  } else {
+    struct record *rec;
+
+    pthread_mutex_lock(&lock);
+    if ((rec = find_record(r->msg, r->len)) != NULL) {
+      rec->uses++;
+      rep = rec->rep;
+      rep_len = rec->rep_len;
+    }
+    pthread_mutex_unlock(&lock);
+    inject_latency();
+  }
+
+  /* No answer: the client times out, like with a dead KDC */
+  if (rep_len >= 0) {
+    if (r->transport == T_UDP) {
+      sendto(r->fd, rep, rep_len, 0, (struct sockaddr *)&r->from,
+	     r->fromlen);
+    } else {
+      unsigned char hdr[4];
+
+      hdr[0] = rep_len >> 24;
+      hdr[1] = rep_len >> 16;
+      hdr[2] = rep_len >> 8;
+      hdr[3] = rep_len;
+      if (!write_full(r->fd, hdr, 4))
+	write_full(r->fd, rep, rep_len);
+    }
+  }
+
+  if (r->transport == T_TCP)
+    close(r->fd);
+  free(buf);
+  free(r);
+  return NULL;
+}
+
+static void dispatch(struct request *r)
+{
+  pthread_t thread;
+
+  if (pthread_create(&thread, NULL, handle_request, r)) {
+    if (r->transport == T_TCP)
+      close(r->fd);
+    free(r);
+    return ;
+  }
+  pthread_detach(thread);
+}
+
+static int listen_on(int type, int port)
+{
+  struct sockaddr_in sin;
+  int fd, on = 1;
+
+  fd = socket(AF_INET, type, 0);
+  if (fd < 0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+  memset(&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&sin, sizeof (sin)) ||
+      (type == SOCK_STREAM && listen(fd, 64))) {
+    fprintf(stderr, "can't listen on port %d: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, char *argv[])
+{
+  int udp, tcp;
+
+  opt.port = 18889;
+  parse_args(argc, argv);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (opt.record) {
+    if (resolve_upstream(opt.upstream))
+      return 1;
+    if (!(record_file = fopen(opt.record, "ab"))) {
+      fprintf(stderr, "can't open %s: %s\n", opt.record, strerror(errno));
+      return 1;
+    }
+  } else if (load_records(opt.replay)) {
+    return 1;
+  }
+
+  if ((udp = listen_on(SOCK_DGRAM, opt.port)) < 0 ||
+      (tcp = listen_on(SOCK_STREAM, opt.port)) < 0)
+    return 1;
+
+  fprintf(stderr, "[+] %s on 127.0.0.1:%d\n",
+	  opt.record ? "recording" : "replaying", opt.port);
+
+  while (1) {
+    struct request *r;
+    fd_set fds;
+
+    FD_ZERO(&fds);
+    FD_SET(udp, &fds);
+    FD_SET(tcp, &fds);
+    if (select((udp > tcp ? udp : tcp) + 1, &fds, NULL, NULL, NULL) < 0) {
+      if (errno == EINTR)
+	continue ;
+      break ;
+    }
+
+    if (FD_ISSET(udp, &fds) && (r = calloc(1, sizeof (*r))) != NULL) {
+      ssize_t n;
+
+      r->transport = T_UDP;
+      r->fd = udp;
+      r->fromlen = sizeof (r->from);
+      n = recvfrom(udp, r->msg, sizeof (r->msg), 0,
+		   (struct sockaddr *)&r->from, &r->fromlen);
+      if (n > 0) {
+	r->len = n;
+	dispatch(r);
+      } else {
+	free(r);
+      }
+    }
+
+    if (FD_ISSET(tcp, &fds) && (r = calloc(1, sizeof (*r))) != NULL) {
+      unsigned char hdr[4];
+      struct timeval tv = { 5, 0 };
+
+      r->transport = T_TCP;
+      r->fd = accept(tcp, NULL, NULL);
+      if (r->fd < 0) {
+	free(r);
+	continue ;
+      }
+      setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+      if (read_full(r->fd, hdr, 4) ||
+	  (r->len = ((size_t)hdr[0] << 24) | (hdr[1] << 16) |
+	   (hdr[2] << 8) | hdr[3]) > sizeof (r->msg) ||
+	  read_full(r->fd, r->msg, r->len)) {
+	close(r->fd);
+	free(r);
+	continue ;
+      }
+      dispatch(r);
+    }
+  }
+
+  return 1;
+}
@@ -0,0 +1,98 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <krb5/krb5.h>
+
+/*
+ * LD_PRELOAD helper for k5-kdc-replay.
+ *
+ * KDC replies echo the request nonce and are encrypted in keys the
+ * client just generated, so a recorded reply is only accepted if the
+ * client draws the same random numbers again. This replaces krb5's
+ * random source with a PRNG seeded from K5_REPLAY_SEED. Never use it
+ * outside of tests.
+ */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long state;
+static int seeded;
+
+static unsigned long long next()
+{
+  unsigned long long x;
+
+  if (!seeded) {
+    const char *seed = getenv("K5_REPLAY_SEED");
+
+    state = seed ? strtoull(seed, NULL, 0) : 0;
+    state = state * 0x9e3779b97f4a7c15ULL + 1;
+    seeded = 1;
+  }
+  x = state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  state = x;
+  return x * 2685821657736338717ULL;
+}
+
+static void fill(krb5_data *data)
+{
+  unsigned int i;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < data->length; i += 8) {
+    unsigned long long v = next();
+    unsigned int n = data->length - i < 8 ? data->length - i : 8;
+
+    memcpy(data->data + i, &v, n);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_c_random_make_octets(krb5_context context, krb5_data *data)
+{
+  fill(data);
+  return 0;
+}
+
+/*
+ * libk5crypto may call its own random source directly, so session
+ * subkeys are generated here as well.
+ */
+krb5_error_code KRB5_CALLCONV
+krb5_c_make_random_key(krb5_context context, krb5_enctype enctype,
+		       krb5_keyblock *random_key)
+{
+  krb5_error_code code;
+  krb5_data random;
+  size_t keybytes, keylength;
+
+  if ((code = krb5_c_keylengths(context, enctype, &keybytes, &keylength)))
+    return code;
+
+  random.length = keybytes;
+  random.data = malloc(keybytes);
+  random_key->contents = malloc(keylength);
+  if (!random.data || !random_key->contents) {
+    free(random.data);
+    free(random_key->contents);
+    random_key->contents = NULL;
+    return ENOMEM;
+  }
+  random_key->length = keylength;
+  random_key->enctype = enctype;
+  random_key->magic = KV5M_KEYBLOCK;
+
+  fill(&random);
+  code = krb5_c_random_to_key(context, enctype, &random, random_key);
+  free(random.data);
+  if (code) {
+    free(random_key->contents);
+    random_key->contents = NULL;
+  }
+  return code;
+}
@@ -0,0 +1,650 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "k5_priv.h"
+
+/*
+ * k5-microbench: KDC-free benchmarks of libk5 hot paths.
+ *
+ * Builds MEMORY: and FILE: caches holding N fabricated credentials
+ * (valid DER tickets with random cipher text) and times
+ * k5_parse_ticket(), k5_klist(), k5_clear_klist() and
+ * k5_b64enc_ticket(). Links against the static library so internal
+ * functions can be called directly.
+ *
+ * Context creation is timed both ways: krb5_init_context() and
+ * krb5_cc_default(), which is what k5_init_context() used to do, and
+ * k5_init_context() with the shared profile and lazy ccache.
+ */
+
+#define BENCH_REALM "K5BENCH.TEST"
+
+struct opt {
+  int tickets;
+  int ticket_size;
+  int gss_size;
+  double seconds;
+  char *output;
+  char *dir;
+};
+
+struct result {
+  double ns;
+  long ops;
+  double allocs;
+  double alloc_bytes;
+};
+
+/*
+ * Allocation accounting. Defining malloc() and friends in the
+ * executable interposes them for libk5 and libkrb5 as well.
+ */
+#if defined(__GLIBC__)
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static unsigned long alloc_count;
+static unsigned long alloc_bytes;
+
+void *malloc(size_t size)
+{
+  alloc_count++;
+  alloc_bytes += size;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  alloc_count++;
+  alloc_bytes += nmemb * size;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  alloc_count++;
+  alloc_bytes += size;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+  __libc_free(ptr);
+}
+# define HAVE_ALLOC_STATS 1
+#else
+static unsigned long alloc_count;
+static unsigned long alloc_bytes;
+# define HAVE_ALLOC_STATS 0
+#endif
+
+static void usage()
+{
+  fprintf(stderr, "Usage: k5-microbench [options]\n"
+	  "\n"
+	  "-n, --tickets         credentials per cache (default: 1000)\n"
+	  "-s, --ticket-size     cipher text bytes per ticket (default: 1024)\n"
+	  "-g, --gss-size        token bytes for base64 (default: 1500)\n"
+	  "-T, --time            seconds per operation (default: 1)\n"
+	  "-d, --dir             directory for the FILE: cache (default: /tmp)\n"
+	  "-o, --output          JSON output file (default: stdout)\n");
+  exit(1);
+}
+
+static const struct option long_options[] =
+  {
+    {"tickets", required_argument, NULL, 'n'},
+    {"ticket-size", required_argument, NULL, 's'},
+    {"gss-size", required_argument, NULL, 'g'},
+    {"time", required_argument, NULL, 'T'},
+    {"dir", required_argument, NULL, 'd'},
+    {"output", required_argument, NULL, 'o'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+static void parse_args(int argc, char *argv[], struct opt *opt)
+{
+  while (1) {
+    int c = getopt_long(argc, argv, "n:s:g:T:d:o:h", long_options, NULL);
+
+    if (c == -1)
+      break ;
+
+    switch(c) {
+    case 'n':
+      opt->tickets = atoi(optarg);
+      break;
+    case 's':
+      opt->ticket_size = atoi(optarg);
+      break;
+    case 'g':
+      opt->gss_size = atoi(optarg);
+      break;
+    case 'T':
+      opt->seconds = atof(optarg);
+      break;
+    case 'd':
+      opt->dir = strdup(optarg);
+      break;
+    case 'o':
+      opt->output = strdup(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (opt->tickets <= 0 || opt->ticket_size <= 0 || opt->gss_size <= 0
+      || opt->seconds <= 0)
+    usage();
+}
+
+static double now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Minimal DER encoder, enough for a Kerberos Ticket */
+
+struct der {
+  unsigned char *data;
+  size_t len;
+};
+
+static void der_append(struct der *d, const void *data, size_t len)
+{
+  d->data = realloc(d->data, d->len + len);
+  if (!d->data) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  memcpy(d->data + d->len, data, len);
+  d->len += len;
+}
+
+static void der_tlv(struct der *d, unsigned char tag,
+		    const void *data, size_t len)
+{
+  unsigned char hdr[6];
+  size_t n = 0;
+
+  hdr[n++] = tag;
+  if (len < 0x80) {
+    hdr[n++] = len;
+  } else if (len < 0x100) {
+    hdr[n++] = 0x81;
+    hdr[n++] = len;
+  } else if (len < 0x10000) {
+    hdr[n++] = 0x82;
+    hdr[n++] = len >> 8;
+    hdr[n++] = len;
+  } else {
+    hdr[n++] = 0x83;
+    hdr[n++] = len >> 16;
+    hdr[n++] = len >> 8;
+    hdr[n++] = len;
+  }
+  der_append(d, hdr, n);
+  der_append(d, data, len);
+}
+
+/* Wrap the content of d in tag */
+static void der_wrap(struct der *d, unsigned char tag)
+{
+  struct der out = { NULL, 0 };
+
+  der_tlv(&out, tag, d->data, d->len);
+  free(d->data);
+  *d = out;
+}
+
+static void der_int(struct der *d, unsigned char ctx_tag, int value)
+{
+  struct der i = { NULL, 0 };
+  unsigned char v[4];
+
+  /* small non-negative values only */
+  v[0] = value >> 24;
+  v[1] = value >> 16;
+  v[2] = value >> 8;
+  v[3] = value;
+  if (value < 0x80)
+    der_tlv(&i, 0x02, v + 3, 1);
+  else if (value < 0x8000)
+    der_tlv(&i, 0x02, v + 2, 2);
+  else
+    der_tlv(&i, 0x02, v, 4);
+  der_wrap(&i, ctx_tag);
+  der_append(d, i.data, i.len);
+  free(i.data);
+}
+
+static void fill_random(unsigned char *p, size_t len, unsigned int *seed)
+{
+  size_t i;
+
+  for (i = 0; i < len; ++i)
+    p[i] = rand_r(seed);
+}
+
+static void make_ticket(krb5_data *out, const char *host, int size,
+			unsigned int *seed)
+{
+  struct der t = { NULL, 0 }, tmp = { NULL, 0 }, names = { NULL, 0 };
+  unsigned char *cipher;
+
+  /* tkt-vno [0] */
+  der_int(&t, 0xa0, 5);
+
+  /* realm [1] */
+  der_tlv(&tmp, 0x1b, BENCH_REALM, strlen(BENCH_REALM));
+  der_wrap(&tmp, 0xa1);
+  der_append(&t, tmp.data, tmp.len);
+  free(tmp.data);
+  tmp.data = NULL;
+  tmp.len = 0;
+
+  /* sname [2] */
+  der_tlv(&names, 0x1b, "host", 4);
+  der_tlv(&names, 0x1b, host, strlen(host));
+  der_wrap(&names, 0x30);
+  der_wrap(&names, 0xa1);
+  der_int(&tmp, 0xa0, KRB5_NT_SRV_HST);
+  der_append(&tmp, names.data, names.len);
+  free(names.data);
+  der_wrap(&tmp, 0x30);
+  der_wrap(&tmp, 0xa2);
+  der_append(&t, tmp.data, tmp.len);
+  free(tmp.data);
+  tmp.data = NULL;
+  tmp.len = 0;
+
+  /* enc-part [3], aes256-cts-hmac-sha1-96, kvno 2 */
+  cipher = malloc(size);
+  if (!cipher) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  fill_random(cipher, size, seed);
+  der_int(&tmp, 0xa0, 18);
+  der_int(&tmp, 0xa1, 2);
+  names.data = NULL;
+  names.len = 0;
+  der_tlv(&names, 0x04, cipher, size);
+  der_wrap(&names, 0xa2);
+  der_append(&tmp, names.data, names.len);
+  free(names.data);
+  free(cipher);
+  der_wrap(&tmp, 0x30);
+  der_wrap(&tmp, 0xa3);
+  der_append(&t, tmp.data, tmp.len);
+  free(tmp.data);
+
+  der_wrap(&t, 0x30);
+  der_wrap(&t, 0x61);
+
+  out->data = (char *)t.data;
+  out->length = t.len;
+}
+
+static krb5_error_code
+fill_cache(krb5_context ctx, const char *name, const struct opt *opt)
+{
+  krb5_error_code code;
+  krb5_ccache cc = NULL;
+  krb5_principal me = NULL;
+  unsigned int seed = 42;
+  time_t now = time(NULL);
+  unsigned char key[32];
+  int i;
+
+  if ((code = krb5_parse_name(ctx, "bench@" BENCH_REALM, &me)))
+    return code;
+  if ((code = krb5_cc_resolve(ctx, name, &cc)))
+    goto cleanup;
+  if ((code = krb5_cc_initialize(ctx, cc, me)))
+    goto cleanup;
+
+  for (i = 0; i < opt->tickets; ++i) {
+    krb5_creds creds;
+    char host[128];
+
+    snprintf(host, sizeof (host), "bench%d.bench.test", i);
+    memset(&creds, 0, sizeof (creds));
+    creds.client = me;
+    if ((code = krb5_build_principal(ctx, &creds.server,
+				     strlen(BENCH_REALM), BENCH_REALM,
+				     "host", host, NULL)))
+      goto cleanup;
+    fill_random(key, sizeof (key), &seed);
+    creds.keyblock.enctype = 18;
+    creds.keyblock.length = sizeof (key);
+    creds.keyblock.contents = key;
+    creds.times.authtime = now;
+    creds.times.starttime = now;
+    creds.times.endtime = now + 36000;
+    creds.times.renew_till = now + 7 * 86400;
+    creds.ticket_flags = TKT_FLG_FORWARDABLE | TKT_FLG_PROXIABLE |
+      TKT_FLG_RENEWABLE | TKT_FLG_PRE_AUTH;
+    make_ticket(&creds.ticket, host, opt->ticket_size, &seed);
+
+    code = krb5_cc_store_cred(ctx, cc, &creds);
+    free(creds.ticket.data);
+    krb5_free_principal(ctx, creds.server);
+    if (code)
+      goto cleanup;
+  }
+
+ cleanup:
+  if (code)
+    com_err("k5-microbench", code, "while filling %s", name);
+  if (cc)
+    krb5_cc_close(ctx, cc);
+  if (me)
+    krb5_free_principal(ctx, me);
+  return code;
+}
+
+/*
+ * Run op until opt->seconds have elapsed, excluding the optional
+ * untimed prepare step.
+ */
+typedef krb5_error_code (*bench_fn)(void *data);
+
+static int measure(const struct opt *opt, bench_fn prepare, bench_fn op,
+		   void *data, struct result *r)
+{
+  double spent = 0;
+  unsigned long count = 0, bytes = 0;
+
+  memset(r, 0, sizeof (*r));
+  while (spent < opt->seconds * 1e9) {
+    unsigned long c0, b0;
+    double t0;
+
+    if (prepare && prepare(data))
+      return -1;
+    c0 = alloc_count;
+    b0 = alloc_bytes;
+    t0 = now_ns();
+    if (op(data))
+      return -1;
+    spent += now_ns() - t0;
+    count += alloc_count - c0;
+    bytes += alloc_bytes - b0;
+    r->ops++;
+  }
+  r->ns = spent / r->ops;
+  r->allocs = (double)count / r->ops;
+  r->alloc_bytes = (double)bytes / r->ops;
+  return 0;
+}
+
+struct state {
+  k5_context k5;
+  k5_klist_entries klist;
+  int listed;
+  krb5_creds *creds;
+  krb5_ticket *ticket;
+  k5_ticket t;
+};
+
+static krb5_error_code op_parse(void *data)
+{
+  struct state *s = data;
+  krb5_error_code code;
+
+  code = k5_parse_ticket(s->k5, s->creds, s->ticket, &s->t);
+  free(s->t.client_name);
+  free(s->t.server_name);
+  return code;
+}
+
+static krb5_error_code op_klist(void *data)
+{
+  struct state *s = data;
+  krb5_error_code code;
+
+  code = k5_klist(s->k5, &s->klist);
+  if (!code)
+    k5_clear_klist(s->k5, &s->klist);
+  return code;
+}
+
+static krb5_error_code prepare_clear_klist(void *data)
+{
+  struct state *s = data;
+
+  return k5_klist(s->k5, &s->klist);
+}
+
+static krb5_error_code op_clear_klist(void *data)
+{
+  struct state *s = data;
+
+  return k5_clear_klist(s->k5, &s->klist);
+}
+
+static krb5_error_code op_base64(void *data)
+{
+  struct state *s = data;
+  int ret;
+
+  ret = k5_b64enc_ticket(&s->t);
+  free(s->t.gss_base64);
+  s->t.gss_base64 = NULL;
+  return ret;
+}
+
+static krb5_error_code op_krb5_context(void *data)
+{
+  krb5_context ctx;
+  krb5_ccache cc;
+  krb5_error_code code;
+
+  if ((code = krb5_init_context(&ctx)))
+    return code;
+  if (!(code = krb5_cc_default(ctx, &cc)))
+    krb5_cc_close(ctx, cc);
+  krb5_free_context(ctx);
+  return code;
+}
+
+static krb5_error_code op_k5_context(void *data)
+{
+  k5_context k5;
+  krb5_error_code code;
+
+  if ((code = k5_init_context(&k5, NULL)))
+    return code;
+  return k5_free_context(k5);
+}
+
+static void print_result(FILE *out, const char *name, const char *cache,
+			 const struct opt *opt, const struct result *r,
+			 int per_ticket, double cache_bytes, int *first)
+{
+  int n = per_ticket ? opt->tickets : 1;
+
+  fprintf(out, "%s    {\"op\": \"%s\", \"cache\": \"%s\", \"tickets\": %d, "
+	  "\"ops\": %ld, \"ns_per_op\": %.1f, \"ns_per_ticket\": %.1f,\n"
+	  "     \"allocs_per_op\": %.1f, \"alloc_bytes_per_op\": %.1f, "
+	  "\"alloc_bytes_per_ticket\": %.1f, \"cache_bytes_per_ticket\": %.1f}",
+	  *first ? "" : ",\n", name, cache, n, r->ops, r->ns, r->ns / n,
+	  HAVE_ALLOC_STATS ? r->allocs : -1,
+	  HAVE_ALLOC_STATS ? r->alloc_bytes : -1,
+	  HAVE_ALLOC_STATS ? r->alloc_bytes / n : -1,
+	  cache_bytes / opt->tickets);
+  *first = 0;
+}
+
+static int bench_cache(FILE *out, krb5_context ctx, const char *name,
+		       const char *type, const struct opt *opt, int *first)
+{
+  struct state s;
+  struct result r;
+  double cache_bytes = 0;
+  struct stat st;
+
+  memset(&s, 0, sizeof (s));
+  if (fill_cache(ctx, name, opt))
+    return -1;
+  if (!strncmp(name, "FILE:", 5) && !stat(name + 5, &st))
+    cache_bytes = st.st_size;
+
+  if (k5_init_context(&s.k5, name))
+    return -1;
+
+  fprintf(stderr, "[ ] %s: k5_klist\n", type);
+  if (!measure(opt, NULL, op_klist, &s, &r))
+    print_result(out, "k5_klist", type, opt, &r, 1, cache_bytes, first);
+
+  fprintf(stderr, "[ ] %s: k5_clear_klist\n", type);
+  if (!measure(opt, prepare_clear_klist, op_clear_klist, &s, &r))
+    print_result(out, "k5_clear_klist", type, opt, &r, 1, cache_bytes,
+		 first);
+
+  k5_free_context(s.k5);
+  return 0;
+}
+
+static int bench_parse(FILE *out, const struct opt *opt, int *first)
+{
+  struct state s;
+  struct result r;
+  k5_klist_entries klist;
+  int ret;
+
+  memset(&s, 0, sizeof (s));
+  if (k5_init_context(&s.k5, "MEMORY:k5-microbench-parse"))
+    return -1;
+
+  /* Borrow one decoded ticket from a one entry cache */
+  if (k5_klist(s.k5, &klist) || !klist.count) {
+    k5_free_context(s.k5);
+    return -1;
+  }
+  s.creds = klist.tickets[0].creds;
+  s.ticket = klist.tickets[0].ticket;
+
+  fprintf(stderr, "[ ] k5_parse_ticket\n");
+  ret = measure(opt, NULL, op_parse, &s, &r);
+  if (!ret)
+    print_result(out, "k5_parse_ticket", "none", opt, &r, 0, 0, first);
+
+  k5_clear_klist(s.k5, &klist);
+  k5_free_context(s.k5);
+  return ret;
+}
+
+static int bench_context(FILE *out, const struct opt *opt, int *first)
+{
+  struct result r;
+
+  fprintf(stderr, "[ ] krb5_init_context\n");
+  if (measure(opt, NULL, op_krb5_context, NULL, &r))
+    return -1;
+  fprintf(stderr, "    %.0f contexts/s\n", 1e9 / r.ns);
+  print_result(out, "krb5_init_context", "none", opt, &r, 0, 0, first);
+
+  fprintf(stderr, "[ ] k5_init_context\n");
+  if (measure(opt, NULL, op_k5_context, NULL, &r))
+    return -1;
+  fprintf(stderr, "    %.0f contexts/s\n", 1e9 / r.ns);
+  print_result(out, "k5_init_context", "none", opt, &r, 0, 0, first);
+  return 0;
+}
+
+static int bench_base64(FILE *out, const struct opt *opt, int *first)
+{
+  struct state s;
+  struct result r;
+  unsigned int seed = 1;
+  int ret;
+
+  memset(&s, 0, sizeof (s));
+  s.t.gss_data_size = opt->gss_size;
+  s.t.gss_data = malloc(opt->gss_size);
+  if (!s.t.gss_data)
+    return -1;
+  fill_random((unsigned char *)s.t.gss_data, opt->gss_size, &seed);
+
+  fprintf(stderr, "[ ] k5_b64enc_ticket\n");
+  ret = measure(opt, NULL, op_base64, &s, &r);
+  if (!ret)
+    print_result(out, "k5_b64enc_ticket", "none", opt, &r, 0, 0, first);
+
+  free(s.t.gss_data);
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  struct opt opt;
+  struct opt one;
+  krb5_context ctx;
+  char path[1024], name[1100];
+  FILE *out = stdout;
+  int fd, first = 1;
+
+  memset(&opt, 0, sizeof (opt));
+  opt.tickets = 1000;
+  opt.ticket_size = 1024;
+  opt.gss_size = 1500;
+  opt.seconds = 1;
+  parse_args(argc, argv, &opt);
+
+  if (opt.output && !(out = fopen(opt.output, "w"))) {
+    fprintf(stderr, "can't open %s: %s\n", opt.output, strerror(errno));
+    return 1;
+  }
+
+  if (krb5_init_context(&ctx)) {
+    fprintf(stderr, "failed to initilize kerberos\n");
+    return 1;
+  }
+
+  fprintf(out, "{\n  \"time\": %ld,\n  \"tickets\": %d,\n"
+	  "  \"ticket_size\": %d,\n  \"gss_size\": %d,\n"
+	  "  \"alloc_stats\": %s,\n  \"results\": [\n",
+	  (long)time(NULL), opt.tickets, opt.ticket_size, opt.gss_size,
+	  HAVE_ALLOC_STATS ? "true" : "false");
+
+  one = opt;
+  one.tickets = 1;
+  if (!fill_cache(ctx, "MEMORY:k5-microbench-parse", &one))
+    bench_parse(out, &opt, &first);
+  bench_base64(out, &opt, &first);
+  bench_context(out, &opt, &first);
+
+  bench_cache(out, ctx, "MEMORY:k5-microbench", "MEMORY", &opt, &first);
+
+  snprintf(path, sizeof (path), "%s/k5-microbench.XXXXXX",
+	   opt.dir ? opt.dir : "/tmp");
+  if ((fd = mkstemp(path)) >= 0) {
+    close(fd);
+    snprintf(name, sizeof (name), "FILE:%s", path);
+    bench_cache(out, ctx, name, "FILE", &opt, &first);
+    unlink(path);
+  } else {
+    fprintf(stderr, "can't create %s: %s\n", path, strerror(errno));
+  }
+
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout)
+    fclose(out);
+  krb5_free_context(ctx);
+  return 0;
+}
@@ -0,0 +1,54 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <k5.h>
+
+static volatile int stop;
+
+static void
+on_signal(int sig)
+{
+  stop = 1;
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "Usage: k5d [-c ccache] [-s socket]\n");
+}
+
+int main(int argc, char *argv[])
+{
+  k5_context k5 = NULL;
+  const char *cache = NULL, *path = NULL;
+  struct sigaction sa;
+  krb5_error_code code;
+  int c;
+
+  while ((c = getopt(argc, argv, "c:s:h")) != -1) {
+    switch (c) {
+    case 'c':
+      cache = optarg;
+      break ;
+    case 's':
+      path = optarg;
+      break ;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  memset(&sa, 0, sizeof (sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (k5_init_context(&k5, cache))
+    return 1;
+  code = k5_agent_run(k5, path, &stop);
+  k5_free_context(k5);
+  return code ? 1 : 0;
+}
@@ -5,6 +5,7 @@
 #include <time.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdarg.h>
 #if defined(_WIN32)
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -43,8 +44,281 @@ struct opt
   char *service;
   char *principal;
   char *cache;
+  int timing;
+  int repeat;
 };
 
+/*
+ * --timing: every check records phases, printed as a waterfall.
+ * Calls into libk5 are split further using its trace spans.
+ */
+enum category {
+  CAT_DNS,
+  CAT_CCACHE,
+  CAT_DISCOVERY,
+  CAT_EXCHANGE,
+  CAT_GSS,
+  CAT_BASE64,
+  CAT_OTHER,
+  CAT_TOTAL,
+  CAT_MAX
+};
+
+static const char *category_names[CAT_MAX] = {
+  "dns", "ccache", "kdc discovery", "kdc exchange", "gss init", "base64",
+  "other", "total"
+};
+
+#define MAX_PHASES 256
+#define BAR_WIDTH 30
+
+struct phase
+{
+  char name[128];
+  int depth;
+  int children;
+  enum category category;
+  double start;
+  double duration;
+};
+
+struct timing
+{
+  double origin;
+  int count;
+  struct phase phases[MAX_PHASES];
+};
+
+static struct timing *timing;
+/* Set for --repeat runs after the first one */
+static int silent;
+
+static void say(const char *fmt, ...)
+{
+  va_list ap;
+
+  if (silent)
+    return ;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+static double now()
+{
+#if defined(_WIN32)
+  LARGE_INTEGER freq, count;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart / freq.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static void timing_reset()
+{
+  timing->count = 0;
+  timing->origin = now();
+}
+
+static struct phase *phase_add(int depth, enum category category,
+			       const char *fmt, va_list ap)
+{
+  struct phase *p;
+
+  if (timing->count == MAX_PHASES)
+    return NULL;
+  p = &timing->phases[timing->count++];
+  memset(p, 0, sizeof (*p));
+  vsnprintf(p->name, sizeof (p->name), fmt, ap);
+  p->depth = depth;
+  p->category = category;
+  return p;
+}
+
+static int phase_begin(enum category category, const char *fmt, ...)
+{
+  struct phase *p;
+  va_list ap;
+
+  if (!timing)
+    return -1;
+
+  va_start(ap, fmt);
+  p = phase_add(0, category, fmt, ap);
+  va_end(ap);
+  if (!p)
+    return -1;
+  p->start = now() - timing->origin;
+  return timing->count - 1;
+}
+
+static void phase_end(int i)
+{
+  if (i < 0)
+    return ;
+  timing->phases[i].duration = now() - timing->origin -
+    timing->phases[i].start;
+}
+
+static enum category event_category(const char *message)
+{
+  if (strstr(message, "Resolving") || strstr(message, "SRV") ||
+      strstr(message, "URI") || strstr(message, "Looking up"))
+    return CAT_DISCOVERY;
+  if (!strncmp(message, "Sending", 7) || !strncmp(message, "Initiating", 10))
+    return CAT_EXCHANGE;
+  if (strstr(message, "GSS context"))
+    return CAT_GSS;
+  if (strstr(message, "base64"))
+    return CAT_BASE64;
+  if (strstr(message, "ccache"))
+    return CAT_CCACHE;
+  return CAT_OTHER;
+}
+
+static struct phase *phase_child(enum category category,
+				 const char *fmt, ...)
+{
+  struct phase *p;
+  va_list ap;
+
+  va_start(ap, fmt);
+  p = phase_add(1, category, fmt, ap);
+  va_end(ap);
+  return p;
+}
+
+/*
+ * Split phase i using the last libk5 span: each krb5 trace event starts
+ * a step that lasts until the next one.
+ */
+static void phase_span(struct opt *opt, int i)
+{
+  k5_trace_span span;
+  struct phase *parent, *p;
+  int j;
+
+  if (i < 0 || k5_get_trace(opt->k5, &span, 1) != 1)
+    return ;
+
+  parent = &timing->phases[i];
+  for (j = 0; j < span.count; ++j) {
+    double end = j + 1 < span.count ? span.events[j + 1].offset : span.elapsed;
+
+    p = phase_child(event_category(span.events[j].message), "%s",
+		    span.events[j].message);
+    if (!p)
+      break ;
+    p->start = parent->start + span.events[j].offset;
+    p->duration = end - span.events[j].offset;
+    parent->children++;
+  }
+}
+
+static void timing_totals(double *totals)
+{
+  int i;
+
+  memset(totals, 0, CAT_MAX * sizeof (*totals));
+  for (i = 0; i < timing->count; ++i) {
+    struct phase *p = &timing->phases[i];
+
+    if (!p->children)
+      totals[p->category] += p->duration;
+    if (p->start + p->duration > totals[CAT_TOTAL])
+      totals[CAT_TOTAL] = p->start + p->duration;
+  }
+}
+
+static void print_waterfall()
+{
+  double totals[CAT_MAX];
+  double total;
+  int i;
+
+  timing_totals(totals);
+  total = totals[CAT_TOTAL];
+  if (total <= 0)
+    return ;
+
+  fprintf(stderr, "[ ] Timing (ms)\n"
+	  "       start   duration\n");
+  for (i = 0; i < timing->count; ++i) {
+    struct phase *p = &timing->phases[i];
+    char bar[BAR_WIDTH + 1];
+    int from, len;
+
+    from = p->start / total * BAR_WIDTH;
+    len = p->duration / total * BAR_WIDTH + 0.5;
+    if (from >= BAR_WIDTH)
+      from = BAR_WIDTH - 1;
+    if (len < 1)
+      len = 1;
+    if (from + len > BAR_WIDTH)
+      len = BAR_WIDTH - from;
+    memset(bar, ' ', BAR_WIDTH);
+    memset(bar + from, '#', len);
+    bar[BAR_WIDTH] = '\0';
+
+    fprintf(stderr, "  %10.3f %10.3f |%s| %*s%s\n", p->start * 1000,
+	    p->duration * 1000, bar, p->depth * 2, "", p->name);
+  }
+
+  fprintf(stderr, "[ ] Total %.3f ms:", total * 1000);
+  for (i = 0; i < CAT_TOTAL; ++i)
+    if (totals[i] > 0)
+      fprintf(stderr, " %s %.3f", category_names[i], totals[i] * 1000);
+  fprintf(stderr, "\n");
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of a sorted array */
+static double percentile(const double *v, int n, double p)
+{
+  int rank = (int)(p * n + 0.999999);
+
+  if (rank < 1)
+    rank = 1;
+  if (rank > n)
+    rank = n;
+  return v[rank - 1];
+}
+
+static void print_summary(double *runs, int n)
+{
+  double *v;
+  int c, i;
+
+  v = malloc(n * sizeof (*v));
+  if (!v)
+    return ;
+
+  fprintf(stderr, "[ ] %d runs (ms)        min     median        p99\n", n);
+  for (c = 0; c < CAT_MAX; ++c) {
+    for (i = 0; i < n; ++i)
+      v[i] = runs[i * CAT_MAX + c];
+    qsort(v, n, sizeof (*v), compare_double);
+    if (v[n - 1] <= 0)
+      continue ;
+    fprintf(stderr, "    %-15s %10.3f %10.3f %10.3f\n", category_names[c],
+	    v[0] * 1000, percentile(v, n, 0.5) * 1000,
+	    percentile(v, n, 0.99) * 1000);
+  }
+  free(v);
+}
+
 static void usage()
 {
   fprintf(stderr, "Usage: krb5-test [options]\n"
@@ -56,6 +330,10 @@ static void usage()
 	  "-s, --service         get service ticket\n"
 	  "-m, --mslsa           import mslsa cache\n"
 	  "\n"
+	  "-T, --timing          time each step and show a waterfall\n"
+	  "-r, --repeat N        run the checks N times, show min/median/p99\n"
+	  "                      (later runs find tickets in the cache)\n"
+	  "\n"
 	  "-p, --principal       principal ([service/]host@REALM)\n"
 	  "-H, --host            host\n"
 	  "-S, --service-name    service name\n"
@@ -75,6 +353,8 @@ static const struct option long_options[] =
     {"host", required_argument, NULL, 'H'},
     {"service-name", required_argument, NULL, 'S'},
     {"cache", required_argument, NULL, 'c'},
+    {"timing", no_argument, NULL, 'T'},
+    {"repeat", required_argument, NULL, 'r'},
     {"help", no_argument, NULL, 'h'},
     {NULL, 0, NULL, 0}
   };
@@ -82,7 +362,7 @@ static const struct option long_options[] =
 static void parse_args(int argc, char *argv[], struct opt *opt)
 {
   while (1) {
-    char c = getopt_long(argc, argv, "ildtsmp:H:S:c:h",
+    char c = getopt_long(argc, argv, "ildtsmp:H:S:c:Tr:h",
 			 long_options, NULL);
 
     if (c == -1)
@@ -131,6 +411,14 @@ static void parse_args(int argc, char *argv[], struct opt *opt)
 	usage();
       opt->cache = strdup(optarg);
       break;
+    case 'T':
+      opt->timing = 1;
+      break;
+    case 'r':
+      opt->repeat = atoi(optarg);
+      if (opt->repeat < 1)
+	usage();
+      break;
     case 'h':
     case '?':
       usage();
@@ -158,6 +446,14 @@ static void check_opts(struct opt *opt)
 
   if (!opt->action)
     opt->action = INTERACTIVE;
+
+  if (opt->repeat > 1 && opt->action != INTERACTIVE
+      && opt->action != SERVICE) {
+    fprintf(stderr, "--repeat only works with --interactive and --service\n");
+    exit(1);
+  }
+  if (opt->repeat > 1)
+    opt->timing = 1;
 }
 
 static void free_opts(struct opt *opt)
@@ -241,25 +537,32 @@ static void tgt(struct opt *opt)
 static int service(struct opt *opt)
 {
   k5_ticket ticket;
-  int ret;
+  int ret, phase;
 
   if (opt->principal)
-    fprintf(stderr, "[ ] Trying to get a service ticket for %s\n", opt->principal);
+    say("[ ] Trying to get a service ticket for %s\n", opt->principal);
   else
-    fprintf(stderr, "[ ] Trying to get a service ticket for %s@%s\n", opt->service, opt->hostname);
+    say("[ ] Trying to get a service ticket for %s@%s\n", opt->service, opt->hostname);
 
-  if (opt->principal)
+  if (opt->principal) {
+    phase = phase_begin(CAT_OTHER, "service %s", opt->principal);
     ret = k5_get_service_ticket(opt->k5, NULL, opt->principal, &ticket);
-  else
+  } else {
+    phase = phase_begin(CAT_OTHER, "gss %s@%s", opt->service, opt->hostname);
     ret = k5_get_service_ticket_gss(opt->k5, opt->service, opt->hostname, &ticket);
+  }
+  phase_end(phase);
+  phase_span(opt, phase);
 
   if (ret) {
-    fprintf(stderr, "[-] Failed to get a service ticket\n");
+    say("[-] Failed to get a service ticket\n");
   } else {
-    fprintf(stderr, "[+] Successfully fetched service ticket\n");
-    printf(" server: %s\n client: %s\n", ticket.server_name, ticket.client_name);
-    if (opt->hostname)
-      printf(" gss: %s\n", ticket.gss_base64);
+    say("[+] Successfully fetched service ticket\n");
+    if (!silent) {
+      printf(" server: %s\n client: %s\n", ticket.server_name, ticket.client_name);
+      if (opt->hostname)
+	printf(" gss: %s\n", ticket.gss_base64);
+    }
     k5_clear_ticket(opt->k5, &ticket);
   }
 
@@ -358,7 +661,7 @@ static void check_dns(const char *service)
   struct addrinfo hints;
   struct addrinfo *result, *rp;
   char str[INET6_ADDRSTRLEN];
-  int ret;
+  int ret, phase;
 
   memset(&hints, 0, sizeof(struct addrinfo));
   hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
@@ -369,36 +672,40 @@ static void check_dns(const char *service)
   hints.ai_addr = NULL;
   hints.ai_next = NULL;
 
+  phase = phase_begin(CAT_DNS, "getaddrinfo(%s)", service);
   ret = getaddrinfo(service, NULL, &hints, &result);
+  phase_end(phase);
   if (ret != 0) {
-    fprintf(stderr, "[-] getaddrinfo(%s): %s\n", service, gai_strerror(ret));
+    say("[-] getaddrinfo(%s): %s\n", service, gai_strerror(ret));
     return ;
   }
 
-  fprintf(stderr, "[ ] getaddrinfo(%s) = ", service);
+  say("[ ] getaddrinfo(%s) = ", service);
 
   for (rp = result; rp != NULL; rp = rp->ai_next) {
     ip2str(rp->ai_addr, str, sizeof (str));
-    fprintf(stderr, "%s ", str);
+    say("%s ", str);
   }
 
-  fprintf(stderr, "\n");
+  say("\n");
 
   for (rp = result; rp != NULL; rp = rp->ai_next) {
     char host[NI_MAXHOST], service[NI_MAXSERV];
 
     ip2str(rp->ai_addr, str, sizeof (str));
 
+    phase = phase_begin(CAT_DNS, "getnameinfo(%s)", str);
     ret = getnameinfo(rp->ai_addr, rp->ai_addrlen,
 		      host, NI_MAXHOST,
 		      service, NI_MAXSERV, NI_NUMERICSERV);
+    phase_end(phase);
 
     if (ret != 0) {
-      fprintf(stderr, "[-] getnameinfo(%s): %s\n", str, gai_strerror(ret));
+      say("[-] getnameinfo(%s): %s\n", str, gai_strerror(ret));
       continue ;
     }
 
-    fprintf(stderr, "[ ] getnameinfo(%s): %s\n", str, host);
+    say("[ ] getnameinfo(%s): %s\n", str, host);
   }
 
   freeaddrinfo(result);
@@ -407,28 +714,39 @@ static void check_dns(const char *service)
 static void check_tgt(struct opt *opt)
 {
   k5_klist_entries klist;
-  int ret, i;
+  int ret, i, phase;
 
+  phase = phase_begin(CAT_CCACHE, "klist");
   ret = k5_klist(opt->k5, &klist);
+  phase_end(phase);
 
   if (ret) {
-    fprintf(stderr, "[-] klist failed\n");
+    say("[-] klist failed\n");
     return ;
   }
 
-  fprintf(stderr, "[+] Principal: %s\n", klist.defname);
+  say("[+] Principal: %s\n", klist.defname);
 
   for (i = 0; i < klist.count; ++i) {
     k5_ticket *ticket = &klist.tickets[i];
 
     if (strstr(ticket->server_name, "krbtgt/") == ticket->server_name) {
-      fprintf(stderr, "[+] server: %s - client: %s\n", ticket->server_name, ticket->client_name);
+      say("[+] server: %s - client: %s\n", ticket->server_name, ticket->client_name);
     }
   }
 
   k5_clear_klist(opt->k5, &klist);
 }
 
+/* What interactive() measures, run again silently for --repeat */
+static void checks(struct opt *opt)
+{
+  if (opt->hostname)
+    check_dns(opt->hostname);
+  check_tgt(opt);
+  service(opt);
+}
+
 static void interactive(struct opt *opt)
 {
   if (!opt->principal && !(opt->hostname && opt->service)) {
@@ -501,6 +819,15 @@ int main(int argc, char *argv[])
 
   k5_set_verbose(opt.k5, 1);
 
+  if (opt.timing) {
+    timing = malloc(sizeof (*timing));
+    if (!timing || k5_set_trace(opt.k5, 4)) {
+      fprintf(stderr, "failed to enable timing\n");
+      return -1;
+    }
+    timing_reset();
+  }
+
   if (opt.action == INTERACTIVE)
     interactive(&opt);
   else if (opt.action == LIST)
@@ -514,6 +841,31 @@ int main(int argc, char *argv[])
   else if (opt.action == DESTROY)
     destroy(&opt);
 
+  if (opt.timing)
+    print_waterfall();
+
+  if (opt.repeat > 1) {
+    double *runs = calloc(opt.repeat, CAT_MAX * sizeof (*runs));
+    int i;
+
+    if (runs) {
+      timing_totals(runs);
+      silent = 1;
+      k5_set_quiet(opt.k5, 1);
+      for (i = 1; i < opt.repeat; ++i) {
+	timing_reset();
+	if (opt.action == INTERACTIVE)
+	  checks(&opt);
+	else
+	  service(&opt);
+	timing_totals(&runs[i * CAT_MAX]);
+      }
+      print_summary(runs, opt.repeat);
+      free(runs);
+    }
+  }
+
+  free(timing);
   free_opts(&opt);
   k5_free_context(opt.k5);
 